@@ -0,0 +1,668 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <linux/magic.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PATH 4096
+#define MAX_RUNS 64
+
+/*
+ * Shape of the generated tree and of the rule set, and how to run forg
+*/
+typedef struct {
+        const char *forg;
+        const char *root; // Parent of the scratch directory
+        const char *out; // JSON report, NULL for stdout
+        const char *label;
+        size_t files;
+        int depth;
+        int fanout;
+        int tag_ratio; // Percent of files named after a tag
+        int pattern_ratio; // Percent of files matching a glob
+        int ext_ratio; // Percent of files with a known extension
+        unsigned tags;
+        unsigned exts;
+        unsigned patterns;
+        size_t size; // Bytes written to each file
+        int jobs;
+        int runs;
+        uint64_t seed;
+        bool syscalls;
+        bool keep;
+} Params;
+
+/*
+ * What was measured for one scenario
+*/
+typedef struct {
+        const char *name;
+        double seconds[MAX_RUNS];
+        int runs;
+        long max_rss_kb;
+        long syscalls; // -1 when not counted
+} Result;
+
+typedef struct {
+        char **paths;
+        size_t count;
+        size_t cap;
+} DirList;
+
+static Params params = {
+        .forg = "forg",
+        .root = NULL,
+        .out = NULL,
+        .label = "",
+        .files = 20000,
+        .depth = 3,
+        .fanout = 4,
+        .tag_ratio = 20,
+        .pattern_ratio = 0,
+        .ext_ratio = 60,
+        .tags = 20,
+        .exts = 100,
+        .patterns = 0,
+        .size = 0,
+        .jobs = 1,
+        .runs = 3,
+        .seed = 1,
+        .syscalls = true,
+        .keep = false,
+};
+
+// Scratch layout, under a fresh directory of params.root
+static char base[MAX_PATH / 2];
+static char src[MAX_PATH];
+static char dst[MAX_PATH];
+static char cache[MAX_PATH / 2 + 8];
+
+enum {
+        OPT_FORG = 256,
+        OPT_ROOT,
+        OPT_OUT,
+        OPT_LABEL,
+        OPT_FILES,
+        OPT_DEPTH,
+        OPT_FANOUT,
+        OPT_TAG_RATIO,
+        OPT_PATTERN_RATIO,
+        OPT_EXT_RATIO,
+        OPT_TAGS,
+        OPT_EXTS,
+        OPT_PATTERNS,
+        OPT_SIZE,
+        OPT_JOBS,
+        OPT_RUNS,
+        OPT_SEED,
+        OPT_NO_SYSCALLS,
+        OPT_KEEP,
+};
+
+static struct option long_options[] = {
+        { "forg", required_argument, 0, OPT_FORG },
+        { "root", required_argument, 0, OPT_ROOT },
+        { "out", required_argument, 0, OPT_OUT },
+        { "label", required_argument, 0, OPT_LABEL },
+        { "files", required_argument, 0, OPT_FILES },
+        { "depth", required_argument, 0, OPT_DEPTH },
+        { "fanout", required_argument, 0, OPT_FANOUT },
+        { "tag-ratio", required_argument, 0, OPT_TAG_RATIO },
+        { "pattern-ratio", required_argument, 0, OPT_PATTERN_RATIO },
+        { "ext-ratio", required_argument, 0, OPT_EXT_RATIO },
+        { "tags", required_argument, 0, OPT_TAGS },
+        { "exts", required_argument, 0, OPT_EXTS },
+        { "patterns", required_argument, 0, OPT_PATTERNS },
+        { "size", required_argument, 0, OPT_SIZE },
+        { "jobs", required_argument, 0, OPT_JOBS },
+        { "runs", required_argument, 0, OPT_RUNS },
+        { "seed", required_argument, 0, OPT_SEED },
+        { "no-syscalls", no_argument, 0, OPT_NO_SYSCALLS },
+        { "keep", no_argument, 0, OPT_KEEP },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+};
+
+static void usage(const char *prog) {
+        printf("Usage: %s [OPTIONS]\n"
+               "Generate a synthetic tree, run forg on it and report JSON\n"
+               "  --forg PATH          forg binary (default forg)\n"
+               "  --root DIR           Where to generate (default /dev/shm)\n"
+               "  --out FILE           Write the report to FILE\n"
+               "  --label TEXT         Recorded in the report, e.g a commit\n"
+               "  --files N            Files to generate (default 20000)\n"
+               "  --depth N            Levels of subdirectories (default 3)\n"
+               "  --fanout N           Subdirectories per directory (default 4)\n"
+               "  --tag-ratio PCT      Files named after a tag (default 20)\n"
+               "  --pattern-ratio PCT  Files matching a glob (default 0)\n"
+               "  --ext-ratio PCT      Files with a known extension (default 60)\n"
+               "  --tags N             Tag rules (default 20)\n"
+               "  --exts N             Extension rules (default 100)\n"
+               "  --patterns N         Glob rules (default 0)\n"
+               "  --size BYTES         Size of each file (default 0)\n"
+               "  --jobs N             Passed to forg -j (default 1)\n"
+               "  --runs N             Timed runs per scenario (default 3)\n"
+               "  --seed N             Seed of the generator (default 1)\n"
+               "  --no-syscalls        Don't count syscalls with ptrace\n"
+               "  --keep               Keep the scratch directory\n",
+               prog);
+}
+
+static long parse_number(const char *arg, const char *what, long min,
+                         long max) {
+        char *end;
+        errno = 0;
+        long n = strtol(arg, &end, 10);
+        if (errno || *end || n < min || n > max) {
+                fprintf(stderr, "forgbench: invalid %s: %s\n", what, arg);
+                exit(EXIT_FAILURE);
+        }
+        return n;
+}
+
+static uint64_t next_random(uint64_t *state) {
+        uint64_t x = *state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return *state = x;
+}
+
+static double now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+        (void)st;
+        (void)flag;
+        (void)ftw;
+        return remove(path);
+}
+
+static int remove_tree(const char *path) {
+        if (access(path, F_OK) != 0) return 0;
+        return nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+static int dirs_add(DirList *l, const char *path) {
+        if (l->count == l->cap) {
+                size_t cap = l->cap ? l->cap * 2 : 64;
+                char **paths = realloc(l->paths, cap * sizeof(*paths));
+                if (!paths) return -1;
+                l->paths = paths;
+                l->cap = cap;
+        }
+        l->paths[l->count] = strdup(path);
+        return l->paths[l->count++] ? 0 : -1;
+}
+
+static void dirs_free(DirList *l) {
+        for (size_t i = 0; i < l->count; i++) free(l->paths[i]);
+        free(l->paths);
+}
+
+static int make_dirs(DirList *l, const char *path, int level) {
+        if (mkdir(path, 0755) != 0 || dirs_add(l, path) != 0) return -1;
+        if (level == params.depth) return 0;
+        char child[MAX_PATH];
+        for (int i = 0; i < params.fanout; i++) {
+                snprintf(child, sizeof(child), "%s/d%d", path, i);
+                if (make_dirs(l, child, level + 1) != 0) return -1;
+        }
+        return 0;
+}
+
+/*
+ * Generate the source tree, spreading files evenly over its directories.
+ * The same seed always gives the same tree.
+*/
+static int make_tree(void) {
+        DirList dirs = { 0 };
+        if (make_dirs(&dirs, src, 0) != 0) {
+                dirs_free(&dirs);
+                return -1;
+        }
+
+        char *data = calloc(1, params.size ? params.size : 1);
+        uint64_t state = params.seed * 0x9e3779b97f4a7c15ULL + 1;
+        char path[MAX_PATH];
+        int err = !data;
+        for (size_t i = 0; !err && i < params.files; i++) {
+                const char *dir = dirs.paths[i % dirs.count];
+                unsigned roll = next_random(&state) % 100;
+                unsigned pick = next_random(&state) >> 32;
+                unsigned split = params.tag_ratio;
+                if (roll < split && params.tags) {
+                        snprintf(path, sizeof(path), "%s/t%u-f%07zu.dat", dir,
+                                 pick % params.tags, i);
+                } else if (roll < (split += params.pattern_ratio) &&
+                           params.patterns) {
+                        snprintf(path, sizeof(path), "%s/p%u_f%07zu.dat", dir,
+                                 pick % params.patterns, i);
+                } else if (roll < split + params.ext_ratio && params.exts) {
+                        snprintf(path, sizeof(path), "%s/f%07zu.x%u", dir, i,
+                                 pick % params.exts);
+                } else {
+                        snprintf(path, sizeof(path), "%s/f%07zu.none", dir, i);
+                }
+                int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+                if (fd < 0) {
+                        err = 1;
+                        break;
+                }
+                if (params.size &&
+                    write(fd, data, params.size) != (ssize_t)params.size)
+                        err = 1;
+                if (close(fd) != 0) err = 1;
+        }
+        free(data);
+        dirs_free(&dirs);
+        return err ? -1 : 0;
+}
+
+static int write_config(void) {
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s/home/.local", base);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/home/.local/share", base);
+        if (mkdir(path, 0755) != 0) return -1;
+        snprintf(path, sizeof(path), "%s/home/.local/share/forg.conf", base);
+        FILE *fp = fopen(path, "w");
+        if (!fp) return -1;
+        for (unsigned i = 0; i < params.tags; i++)
+                fprintf(fp, "tag:t%u=tags/%u/\n", i, i);
+        for (unsigned i = 0; i < params.patterns; i++)
+                fprintf(fp, "glob:p%u_*=patterns/%u/\n", i, i);
+        for (unsigned i = 0; i < params.exts; i++)
+                fprintf(fp, "ext:x%u=exts/%u/\n", i, i);
+        return fclose(fp);
+}
+
+/*
+ * Forget the scan index, so every run reads the whole tree
+*/
+static void drop_scan_index(void) {
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s/forg", cache);
+        DIR *dir = opendir(path);
+        if (!dir) return;
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+                if (strncmp(entry->d_name, "scan-", 5) == 0)
+                        unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+        closedir(dir);
+}
+
+static pid_t spawn(bool dry, bool traced) {
+        char jobs[16];
+        snprintf(jobs, sizeof(jobs), "%d", params.jobs);
+        char *argv[8];
+        int argc = 0;
+        argv[argc++] = (char *)params.forg;
+        argv[argc++] = "-j";
+        argv[argc++] = jobs;
+        if (dry) argv[argc++] = "-d";
+        argv[argc++] = src;
+        argv[argc++] = dst;
+        argv[argc] = NULL;
+
+        pid_t pid = fork();
+        if (pid != 0) return pid;
+
+        int null = open("/dev/null", O_RDWR);
+        if (null >= 0) {
+                dup2(null, STDIN_FILENO);
+                dup2(null, STDOUT_FILENO);
+                dup2(null, STDERR_FILENO);
+        }
+        if (traced) {
+                ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+                raise(SIGSTOP);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+}
+
+/*
+ * Run forg once and time it, returns -1 if it failed
+*/
+static double run_timed(bool dry, long *max_rss_kb) {
+        double start = now();
+        pid_t pid = spawn(dry, false);
+        if (pid < 0) return -1;
+        int status;
+        struct rusage ru;
+        if (wait4(pid, &status, 0, &ru) < 0) return -1;
+        double elapsed = now() - start;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+        if (ru.ru_maxrss > *max_rss_kb) *max_rss_kb = ru.ru_maxrss;
+        return elapsed;
+}
+
+/*
+ * Run forg once under ptrace, following every thread, and count its system
+ * calls. Returns -1 if it failed or can't be traced.
+*/
+static long run_traced(bool dry) {
+        pid_t pid = spawn(dry, true);
+        if (pid < 0) return -1;
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) return -1;
+        long opts = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                    PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+        if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)opts) != 0 ||
+            ptrace(PTRACE_SYSCALL, pid, NULL, NULL) != 0) {
+                kill(pid, SIGKILL);
+                waitpid(pid, &status, 0);
+                return -1;
+        }
+
+        long stops = 0;
+        int exit_status = -1;
+        for (;;) {
+                pid_t tid = waitpid(-1, &status, __WALL);
+                if (tid < 0) break;
+                if (WIFEXITED(status) || WIFSIGNALED(status)) {
+                        if (tid == pid) exit_status = status;
+                        continue;
+                }
+                int sig = WSTOPSIG(status);
+                if (sig == (SIGTRAP | 0x80)) {
+                        stops++;
+                        sig = 0;
+                } else if (status >> 16 || sig == SIGSTOP) {
+                        // ptrace events, and new threads starting stopped
+                        sig = 0;
+                }
+                ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+        }
+        if (!WIFEXITED(exit_status) || WEXITSTATUS(exit_status) != 0)
+                return -1;
+        // One stop entering each call and one leaving it
+        return stops / 2;
+}
+
+static int cmp_double(const void *a, const void *b) {
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+        return (x > y) - (x < y);
+}
+
+static double median(const Result *r) {
+        double sorted[MAX_RUNS];
+        memcpy(sorted, r->seconds, r->runs * sizeof(double));
+        qsort(sorted, r->runs, sizeof(double), cmp_double);
+        if (r->runs % 2) return sorted[r->runs / 2];
+        return (sorted[r->runs / 2 - 1] + sorted[r->runs / 2]) / 2;
+}
+
+static int fresh_tree(void) {
+        if (remove_tree(src) != 0 || remove_tree(dst) != 0) return -1;
+        if (mkdir(dst, 0755) != 0 || make_tree() != 0) return -1;
+        drop_scan_index();
+        return 0;
+}
+
+/*
+ * dry:    plan every file without moving anything, with a cold scan index
+ * move:   organize a fresh tree
+ * rescan: run again over what was left in place, with a warm scan index
+*/
+static int bench_dry(Result *r) {
+        r->name = "dry";
+        if (fresh_tree() != 0) return -1;
+        for (int i = 0; i < params.runs; i++) {
+                drop_scan_index();
+                r->seconds[r->runs] = run_timed(true, &r->max_rss_kb);
+                if (r->seconds[r->runs++] < 0) return -1;
+        }
+        drop_scan_index();
+        r->syscalls = params.syscalls ? run_traced(true) : -1;
+        return 0;
+}
+
+static int bench_move(Result *r) {
+        r->name = "move";
+        for (int i = 0; i < params.runs; i++) {
+                if (fresh_tree() != 0) return -1;
+                r->seconds[r->runs] = run_timed(false, &r->max_rss_kb);
+                if (r->seconds[r->runs++] < 0) return -1;
+        }
+        if (params.syscalls) {
+                if (fresh_tree() != 0) return -1;
+                r->syscalls = run_traced(false);
+        }
+        return 0;
+}
+
+static int bench_rescan(Result *r) {
+        r->name = "rescan";
+        if (fresh_tree() != 0) return -1;
+        long rss = 0;
+        // Moves change the directories they leave, the index settles after
+        if (run_timed(false, &rss) < 0 || run_timed(false, &rss) < 0)
+                return -1;
+        for (int i = 0; i < params.runs; i++) {
+                r->seconds[r->runs] = run_timed(false, &r->max_rss_kb);
+                if (r->seconds[r->runs++] < 0) return -1;
+        }
+        r->syscalls = params.syscalls ? run_traced(false) : -1;
+        return 0;
+}
+
+static void json_string(FILE *fp, const char *s) {
+        fputc('"', fp);
+        for (; *s; s++) {
+                unsigned char c = *s;
+                if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+                else if (c < 0x20) fprintf(fp, "\\u%04x", c);
+                else fputc(c, fp);
+        }
+        fputc('"', fp);
+}
+
+static void report(FILE *fp, const Result *results, int n, bool tmpfs) {
+        fprintf(fp, "{\n  \"label\": ");
+        json_string(fp, params.label);
+        fprintf(fp, ",\n  \"forg\": ");
+        json_string(fp, params.forg);
+        fprintf(fp, ",\n  \"root\": ");
+        json_string(fp, params.root);
+        fprintf(fp, ",\n  \"tmpfs\": %s,\n", tmpfs ? "true" : "false");
+        fprintf(fp,
+                "  \"params\": {\"files\": %zu, \"depth\": %d, \"fanout\": %d, "
+                "\"tag_ratio\": %d, \"pattern_ratio\": %d, \"ext_ratio\": %d, "
+                "\"tags\": %u, \"exts\": %u, \"patterns\": %u, \"size\": %zu, "
+                "\"jobs\": %d, \"runs\": %d, \"seed\": %llu},\n",
+                params.files, params.depth, params.fanout, params.tag_ratio,
+                params.pattern_ratio, params.ext_ratio, params.tags,
+                params.exts, params.patterns, params.size, params.jobs,
+                params.runs, (unsigned long long)params.seed);
+        fprintf(fp, "  \"results\": [\n");
+        for (int i = 0; i < n; i++) {
+                const Result *r = &results[i];
+                double med = median(r);
+                double best = r->seconds[0];
+                for (int j = 1; j < r->runs; j++) {
+                        if (r->seconds[j] < best) best = r->seconds[j];
+                }
+                fprintf(fp,
+                        "    {\"scenario\": \"%s\", \"seconds_median\": %.6f, "
+                        "\"seconds_min\": %.6f, \"files_per_sec\": %.1f, "
+                        "\"max_rss_kb\": %ld, ",
+                        r->name, med, best,
+                        med > 0 ? params.files / med : 0.0, r->max_rss_kb);
+                if (r->syscalls >= 0)
+                        fprintf(fp,
+                                "\"syscalls\": %ld, \"syscalls_per_file\": %.3f}",
+                                r->syscalls,
+                                (double)r->syscalls / params.files);
+                else
+                        fprintf(fp, "\"syscalls\": null, \"syscalls_per_file\": null}");
+                fprintf(fp, "%s\n", i + 1 < n ? "," : "");
+        }
+        fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+        int opt;
+        while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+                switch (opt) {
+                case OPT_FORG:
+                        params.forg = optarg;
+                        break;
+                case OPT_ROOT:
+                        params.root = optarg;
+                        break;
+                case OPT_OUT:
+                        params.out = optarg;
+                        break;
+                case OPT_LABEL:
+                        params.label = optarg;
+                        break;
+                case OPT_FILES:
+                        params.files = parse_number(optarg, "file count", 1,
+                                                    10000000);
+                        break;
+                case OPT_DEPTH:
+                        params.depth = parse_number(optarg, "depth", 0, 16);
+                        break;
+                case OPT_FANOUT:
+                        params.fanout = parse_number(optarg, "fan-out", 1, 64);
+                        break;
+                case OPT_TAG_RATIO:
+                        params.tag_ratio =
+                                parse_number(optarg, "tag ratio", 0, 100);
+                        break;
+                case OPT_PATTERN_RATIO:
+                        params.pattern_ratio =
+                                parse_number(optarg, "pattern ratio", 0, 100);
+                        break;
+                case OPT_EXT_RATIO:
+                        params.ext_ratio =
+                                parse_number(optarg, "extension ratio", 0, 100);
+                        break;
+                case OPT_TAGS:
+                        params.tags = parse_number(optarg, "tag count", 0,
+                                                   1000000);
+                        break;
+                case OPT_EXTS:
+                        params.exts = parse_number(optarg, "extension count",
+                                                   0, 1000000);
+                        break;
+                case OPT_PATTERNS:
+                        params.patterns = parse_number(
+                                optarg, "pattern count", 0, 1000);
+                        break;
+                case OPT_SIZE:
+                        params.size = parse_number(optarg, "size", 0,
+                                                   1 << 20);
+                        break;
+                case OPT_JOBS:
+                        params.jobs = parse_number(optarg, "jobs", 0, 1024);
+                        break;
+                case OPT_RUNS:
+                        params.runs = parse_number(optarg, "runs", 1,
+                                                   MAX_RUNS);
+                        break;
+                case OPT_SEED:
+                        params.seed = parse_number(optarg, "seed", 1,
+                                                   __LONG_MAX__);
+                        break;
+                case OPT_NO_SYSCALLS:
+                        params.syscalls = false;
+                        break;
+                case OPT_KEEP:
+                        params.keep = true;
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (params.tag_ratio + params.pattern_ratio + params.ext_ratio > 100) {
+                fprintf(stderr, "forgbench: ratios add up to more than 100\n");
+                return EXIT_FAILURE;
+        }
+        if (!params.root) {
+                params.root = access("/dev/shm", W_OK) == 0 ? "/dev/shm"
+                                                             : "/tmp";
+        }
+
+        struct statfs fs;
+        bool tmpfs = statfs(params.root, &fs) == 0 &&
+                     fs.f_type == TMPFS_MAGIC;
+        if (!tmpfs)
+                fprintf(stderr, "forgbench: %s is not a tmpfs, results "
+                                "include the storage\n", params.root);
+
+        if ((size_t)snprintf(base, sizeof(base), "%s/forgbench.XXXXXX",
+                             params.root) >= sizeof(base)) {
+                fprintf(stderr, "forgbench: root path too long\n");
+                return EXIT_FAILURE;
+        }
+        if (!mkdtemp(base)) {
+                perror("forgbench");
+                return EXIT_FAILURE;
+        }
+        snprintf(src, sizeof(src), "%s/src", base);
+        snprintf(dst, sizeof(dst), "%s/dst", base);
+        snprintf(cache, sizeof(cache), "%s/cache", base);
+        char home[MAX_PATH];
+        snprintf(home, sizeof(home), "%s/home", base);
+        mkdir(home, 0755);
+        setenv("HOME", home, 1);
+        setenv("XDG_CACHE_HOME", cache, 1);
+
+        Result results[3];
+        memset(results, 0, sizeof(results));
+        int (*scenarios[])(Result *) = { bench_dry, bench_move, bench_rescan };
+        int n = sizeof(scenarios) / sizeof(scenarios[0]);
+        int err = write_config() != 0;
+        for (int i = 0; !err && i < n; i++) {
+                results[i].syscalls = -1;
+                err = scenarios[i](&results[i]) != 0;
+                if (err) {
+                        fprintf(stderr, "forgbench: scenario %s failed\n",
+                                results[i].name);
+                } else {
+                        fprintf(stderr, "%-7s %.3fs\n", results[i].name,
+                                median(&results[i]));
+                }
+        }
+
+        if (!err) {
+                FILE *fp = params.out ? fopen(params.out, "w") : stdout;
+                if (!fp) {
+                        perror("forgbench");
+                        err = 1;
+                } else {
+                        report(fp, results, n, tmpfs);
+                        if (fp != stdout && fclose(fp) != 0) err = 1;
+                }
+        }
+        if (!params.keep) remove_tree(base);
+        return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
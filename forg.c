@@ -1,4 +1,7 @@
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <libgen.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -14,10 +17,22 @@
 #include "zshgen.h"
 #include "autocomplete.h"
 #include "vendor/printh.h"
+#include "walker.h"
+#include "rules.h"
+#include "dircache.h"
+#include "dedup.h"
+#include "copy.h"
+#include "iobatch.h"
+#include "plan.h"
+#include "watch.h"
+#include "scanindex.h"
+#include "magic.h"
+#include "stats.h"
+#include "logbuf.h"
+#include "journal.h"
 
 #define MAX_PATH 4096
-#define MAX_LINE 1024
-#define MAX_RULES 1024
+#define MAX_SUFFIX 10000
 
 // Extra Modes
 bool dry_mode = false;
@@ -25,9 +40,7 @@ bool deduplicate_mode = false;
 bool verbose = false;
 bool debug_mode = false;
 
-int tag_count = 0;
-int ext_count = 0;
-int operations = 0;
+int threads = 1;
 
 enum ForgMode {
         AUTO,
@@ -36,40 +49,161 @@ enum ForgMode {
 };
 enum ForgMode forg_mode = AUTO; // Default is Auto
 
-static struct option long_options[] = {
-        { "dry", no_argument, 0, 'd' },     { "remove", no_argument, 0, 'r' },
-        { "verbose", no_argument, 0, 'V' }, { "debug", no_argument, 0, 'D' },
-        { "help", no_argument, 0, 'h' },    { 0, 0, 0, 0 }
+// What to do when the destination already has a file with the same name
+enum Conflict {
+        SKIP,
+        RENAME, // Append _N before the extension
+        REPLACE,
 };
+enum Conflict conflict_policy = SKIP;
+SyncPolicy sync_policy = SYNC_FILE;
+bool uring_mode = false;
+bool queue_renames = false; // Renames and deletions go through io_uring
+unsigned queue_depth = 64;
+unsigned debounce_ms = 1000;
+bool full_scan = false; // Read every directory, ignoring the scan index
+bool stats_mode = false;
+StatFormat stats_format = STATS_TEXT;
+Stats stats;
+LogFormat log_format = LOG_TEXT;
+int log_level = -1; // Follows -V, -D and -d unless set
+bool rules_mapped = false; // Rules came from the compiled image
+bool rules_parsed = false; // Rules came from the config itself
+unsigned long index_skipped = 0;
+unsigned long index_read = 0;
 
+// Options without a short flag
+enum {
+        OPT_FSYNC = 256,
+        OPT_IO,
+        OPT_QUEUE_DEPTH,
+        OPT_SAVE_PLAN,
+        OPT_DEBOUNCE,
+        OPT_FULL,
+        OPT_STATS,
+        OPT_LOG_FORMAT,
+        OPT_LOG_LEVEL,
+        OPT_JOURNAL,
+};
+
+// A file waiting for its batch to be handled
 typedef struct {
-        char path[256]; // Destination. e.g docs/
-        char tag[64]; // Tag name. e.g journal << journal-botany.pdf
-} TagMap;
+        char name[NAME_MAX + 1];
+        PlanStep step;
+        int op; // Index of its queued operation, -1 to go through place_file
+        int dst_fd; // Destination directory of a queued operation
+        struct stat st; // Taken before a duplicate was looked for
+        bool deduped; // st is set, a moved file is added to dedup
+        char match[NAME_MAX + 1]; // Duplicate its queued deletion stands for
+} Pending;
 
 typedef struct {
-        char path[256]; // Destination. e.g archives/
-        char ext[16]; // Extension. e.g .zip
-} ExtMap;
+        Pending *files;
+        IoOp *ops;
+        size_t count;
+        size_t nops;
+} Batch;
+
+typedef struct {
+        const char *src; // Directory to organize
+        const char *dst; // Root of the organized tree
+        enum ForgMode mode;
+        const RuleSet *rules;
+        const RuleSet *overrides; // Tried before rules, NULL for none
+        DirCache *dirs;
+        Plan *plan;
+        Batch *batches; // One per worker, NULL to move files one at a time
+        Journal *journal; // NULL unless journaling
+} Job;
+
+/*
+ * A job of a batch file, with what it owns
+*/
+typedef struct {
+        char *name;
+        char *src;
+        char *dst;
+        char *journal_path; // NULL unless journaling
+        enum ForgMode mode;
+        RuleSet overrides;
+        size_t noverrides;
+        uint64_t overrides_id; // Hash of the override lines
+        bool planned; // plan was initialized
+        Plan plan;
+        Journal journal;
+        Job job;
+} BatchJob;
+
+typedef struct {
+        int fd; // Open descriptor of the destination directory
+        const char *root; // e.g /home/user/Files
+        const char *subdir; // e.g media/images/
+} Target;
+
+static struct option long_options[] = {
+        { "dry", no_argument, 0, 'd' },     { "remove", no_argument, 0, 'r' },
+        { "verbose", no_argument, 0, 'V' }, { "debug", no_argument, 0, 'D' },
+        { "jobs", required_argument, 0, 'j' },
+        { "conflict", required_argument, 0, 'c' },
+        { "fsync", required_argument, 0, OPT_FSYNC },
+        { "io", required_argument, 0, OPT_IO },
+        { "queue-depth", required_argument, 0, OPT_QUEUE_DEPTH },
+        { "save-plan", required_argument, 0, OPT_SAVE_PLAN },
+        { "debounce", required_argument, 0, OPT_DEBOUNCE },
+        { "full", no_argument, 0, OPT_FULL },
+        { "stats", optional_argument, 0, OPT_STATS },
+        { "log-format", required_argument, 0, OPT_LOG_FORMAT },
+        { "log-level", required_argument, 0, OPT_LOG_LEVEL },
+        { "journal", required_argument, 0, OPT_JOURNAL },
+        { "help", no_argument, 0, 'h' },    { 0, 0, 0, 0 }
+};
 
-ExtMap ext_map[MAX_RULES];
-TagMap tag_map[MAX_RULES];
+RuleSet rules;
+DirCache dirs;
+Dedup dedup;
+Plan plan;
+Journal journal;
 
-const char *get_ext_path(const char *ext);
-const char *get_tag_path(const char *tag);
-int ensure_directory(const char *path);
+const char *get_ext_path(const RuleSet *rules, const char *filename);
+const char *get_tag_path(const RuleSet *rules, const char *filename);
+const char *get_magic_path(const RuleSet *rules, const WalkEntry *entry);
+const char *get_pattern_path(const RuleSet *rules, const char *filename);
+int cache_file(char *buf, size_t len, const char *name);
 int load_config(const char *filename);
-void move_file(const char *src_file, const char *dst_dir);
+int plan_source(const char *src_dir, const char *dst_dir,
+                const char *config_file, bool walk);
+int move_file(const PlanStep *step, const Target *dst, const Job *job);
 void trim_newline(char *str);
+bool parse_number(const char *str, long min, long max, long *out);
 void usage(const char *prog);
-void walk_and_move(const char *src, const char *dest);
+int plan_file(const WalkEntry *entry, void *arg);
+void execute_step(const PlanStep *step, void *arg);
+void flush_moves(int worker, void *arg);
+void execute_batch(void *arg);
+void report_stats(void);
+int undo_journal(const char *path);
+int run_batch(const char *path, const char *config_file);
+int setup_io(char *hash_cache, size_t len);
+int alloc_batches(Batch **batches, bool journaled);
+void free_batches(Batch *batches);
+void finish_run(const char *hash_cache);
 
 int main(int argc, char *argv[]) {
         int opt = 0;
+        long num = 0;
         const char *home_env = getenv("HOME");
         const char *dst_dir = NULL;
         const char *src_dir = NULL;
+        const char *plan_out = NULL;
+        const char *plan_in = NULL;
+        const char *journal_out = NULL;
+        const char *journal_in = NULL;
+        const char *jobs_in = NULL;
+        bool undo = false;
+        bool watch_mode = false;
+        bool conflict_set = false;
         char config_file[MAX_PATH];
+        char journal_path[MAX_PATH];
 
         if (!home_env) {
                 printfc(FATAL, "Could not get HOME environment variable\n");
@@ -79,7 +213,7 @@ int main(int argc, char *argv[]) {
         snprintf(config_file, sizeof(config_file), "%s/.local/share/forg.conf",
                  home_env);
 
-        while ((opt = getopt_long(argc, argv, ":dDrVh", long_options, NULL)) !=
+        while ((opt = getopt_long(argc, argv, ":dDrVhj:c:", long_options, NULL)) !=
                -1) {
                 switch (opt) {
                 case 'd':
@@ -94,6 +228,123 @@ int main(int argc, char *argv[]) {
                 case 'D':
                         debug_mode = true;
                         break;
+                case 'j':
+                        if (!parse_number(optarg, 0, 1024, &num)) {
+                                printfc(FATAL, "invalid number of jobs: %s\n",
+                                        optarg);
+                                return EXIT_FAILURE;
+                        }
+                        threads = num;
+                        if (threads == 0) {
+                                threads = sysconf(_SC_NPROCESSORS_ONLN);
+                        }
+                        if (threads < 1)
+                                threads = 1;
+                        break;
+                case 'c':
+                        conflict_set = true;
+                        if (strcmp(optarg, "skip") == 0) {
+                                conflict_policy = SKIP;
+                        } else if (strcmp(optarg, "rename") == 0) {
+                                conflict_policy = RENAME;
+                        } else if (strcmp(optarg, "replace") == 0) {
+                                conflict_policy = REPLACE;
+                        } else {
+                                printfc(FATAL, "unknown conflict policy: %s\n",
+                                        optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case OPT_FSYNC:
+                        if (strcmp(optarg, "none") == 0) {
+                                sync_policy = SYNC_NONE;
+                        } else if (strcmp(optarg, "file") == 0) {
+                                sync_policy = SYNC_FILE;
+                        } else if (strcmp(optarg, "full") == 0) {
+                                sync_policy = SYNC_FULL;
+                        } else {
+                                printfc(FATAL, "unknown fsync policy: %s\n",
+                                        optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case OPT_IO:
+                        if (strcmp(optarg, "sync") == 0) {
+                                uring_mode = false;
+                        } else if (strcmp(optarg, "uring") == 0) {
+                                uring_mode = true;
+                        } else {
+                                printfc(FATAL, "unknown I/O backend: %s\n",
+                                        optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case OPT_QUEUE_DEPTH:
+                        if (!parse_number(optarg, 1, 4096, &num)) {
+                                printfc(FATAL, "invalid queue depth: %s\n",
+                                        optarg);
+                                return EXIT_FAILURE;
+                        }
+                        queue_depth = num;
+                        break;
+                case OPT_SAVE_PLAN:
+                        plan_out = optarg;
+                        break;
+                case OPT_DEBOUNCE:
+                        // Up to an hour between batches
+                        if (!parse_number(optarg, 0, 3600000, &num)) {
+                                printfc(FATAL, "invalid debounce: %s\n",
+                                        optarg);
+                                return EXIT_FAILURE;
+                        }
+                        debounce_ms = num;
+                        break;
+                case OPT_FULL:
+                        full_scan = true;
+                        break;
+                case OPT_STATS:
+                        stats_mode = true;
+                        if (!optarg || strcmp(optarg, "text") == 0) {
+                                stats_format = STATS_TEXT;
+                        } else if (strcmp(optarg, "json") == 0) {
+                                stats_format = STATS_JSON;
+                        } else {
+                                printfc(FATAL, "unknown stats format: %s\n",
+                                        optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case OPT_JOURNAL:
+                        journal_out = optarg;
+                        break;
+                case OPT_LOG_FORMAT:
+                        if (strcmp(optarg, "text") == 0) {
+                                log_format = LOG_TEXT;
+                        } else if (strcmp(optarg, "jsonl") == 0) {
+                                log_format = LOG_JSONL;
+                        } else if (strcmp(optarg, "nul") == 0) {
+                                log_format = LOG_NUL;
+                        } else {
+                                printfc(FATAL, "unknown log format: %s\n",
+                                        optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case OPT_LOG_LEVEL:
+                        if (strcmp(optarg, "error") == 0) {
+                                log_level = ERROR;
+                        } else if (strcmp(optarg, "warn") == 0) {
+                                log_level = WARN;
+                        } else if (strcmp(optarg, "info") == 0) {
+                                log_level = INFO;
+                        } else if (strcmp(optarg, "debug") == 0) {
+                                log_level = DEBUG;
+                        } else {
+                                printfc(FATAL, "unknown log level: %s\n",
+                                        optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
                 case 'h':
                         printh(program_info);
                         return EXIT_SUCCESS;
@@ -128,7 +379,45 @@ int main(int argc, char *argv[]) {
                 }
         }
 
-        if (optind < argc) {
+        if (optind < argc && strcmp(argv[optind], "apply") == 0) {
+                if (++optind >= argc) {
+                        fprintf(stderr, "Usage: %s apply FILE\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+                plan_in = argv[optind++];
+        } else if (optind < argc && (strcmp(argv[optind], "resume") == 0 ||
+                                     strcmp(argv[optind], "undo") == 0)) {
+                undo = strcmp(argv[optind], "undo") == 0;
+                if (++optind >= argc) {
+                        fprintf(stderr, "Usage: %s %s JOURNAL\n", argv[0],
+                                undo ? "undo" : "resume");
+                        return EXIT_FAILURE;
+                }
+                journal_in = argv[optind++];
+        } else if (optind < argc && strcmp(argv[optind], "batch") == 0) {
+                if (++optind >= argc) {
+                        fprintf(stderr, "Usage: %s batch FILE\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+                jobs_in = argv[optind++];
+                if (plan_out || journal_out) {
+                        printfc(FATAL, "batches can't save a plan, journals are set per job\n");
+                        return EXIT_FAILURE;
+                }
+        } else if (optind < argc && strcmp(argv[optind], "watch") == 0) {
+                optind++;
+                watch_mode = true;
+                if (plan_out) {
+                        printfc(FATAL, "plans can't be saved while watching\n");
+                        return EXIT_FAILURE;
+                }
+                if (journal_out) {
+                        printfc(FATAL, "journals can't be kept while watching\n");
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (!plan_in && !journal_in && optind < argc) {
                 src_dir = argv[optind++];
         }
         if (optind < argc) {
@@ -143,7 +432,361 @@ int main(int argc, char *argv[]) {
                 }
         }
 
-        if (verbose) {
+        if (stats_init(&stats, threads, stats_mode) != 0) {
+                perror("Stats");
+                return EXIT_FAILURE;
+        }
+        // Files moved are only listed with -V, a dry run always lists them
+        if (log_level < 0)
+                log_level = debug_mode           ? DEBUG :
+                            verbose || dry_mode ? INFO :
+                                                  WARN;
+        if (log_open(log_format, log_level, threads) != 0) {
+                perror("Log");
+                return EXIT_FAILURE;
+        }
+
+        if (undo) return undo_journal(journal_in);
+        if (jobs_in) return run_batch(jobs_in, config_file);
+
+        if (journal_in) {
+                if (journal_load(&journal, &plan, journal_in, threads,
+                                 sync_policy == SYNC_FULL, dry_mode) != 0) {
+                        printfc(FATAL, "could not load journal %s: %s\n",
+                                journal_in, strerror(errno));
+                        return EXIT_FAILURE;
+                }
+                // Conflicts are settled the way the run started settling them
+                if (journal.conflict > REPLACE ||
+                    (conflict_set && journal.conflict != conflict_policy)) {
+                        printfc(FATAL, "journal %s was started with another conflict policy\n",
+                                journal_in);
+                        return EXIT_FAILURE;
+                }
+                conflict_policy = journal.conflict;
+                // Paths of the plan are relative to where the run started
+                if (chdir(journal.cwd) != 0) {
+                        printfc(FATAL, "could not enter %s: %s\n",
+                                journal.cwd, strerror(errno));
+                        return EXIT_FAILURE;
+                }
+        } else if (plan_in) {
+                if (plan_load(&plan, plan_in) != 0) {
+                        printfc(FATAL, "could not load plan %s: %s\n",
+                                plan_in, strerror(errno));
+                        return EXIT_FAILURE;
+                }
+                // A journal named here stays where it was asked for
+                if (journal_out && journal_out[0] != '/') {
+                        char cwd[MAX_PATH];
+                        if (!getcwd(cwd, sizeof(cwd)) ||
+                            snprintf(journal_path, sizeof(journal_path),
+                                     "%s/%s", cwd, journal_out) >=
+                                    (int)sizeof(journal_path)) {
+                                printfc(FATAL, "could not resolve journal %s\n",
+                                        journal_out);
+                                return EXIT_FAILURE;
+                        }
+                        journal_out = journal_path;
+                }
+                // Paths of the plan are relative to where it was made
+                if (chdir(plan_cwd(&plan)) != 0) {
+                        printfc(FATAL, "could not enter %s: %s\n",
+                                plan_cwd(&plan), strerror(errno));
+                        return EXIT_FAILURE;
+                }
+        }
+        if (plan_in || journal_in) {
+                dst_dir = plan_root(&plan);
+                // Duplicates were asked for when the plan was made
+                for (size_t i = 0; i < plan.count; i++) {
+                        if (plan.entries[i].action == PLAN_DEDUP)
+                                deduplicate_mode = true;
+                }
+        } else if (plan_source(src_dir, dst_dir, config_file, !watch_mode) !=
+                   0) {
+                return EXIT_FAILURE;
+        }
+        // Records of a journal refer to its plan in its order
+        if (!journal_in) plan_sort(&plan);
+        if (debug_mode)
+                printfc(DEBUG, "Planned %zu files\n", plan.count);
+
+        if (plan_out) {
+                if (plan_save(&plan, plan_out) != 0) {
+                        printfc(FATAL, "could not save plan %s: %s\n",
+                                plan_out, strerror(errno));
+                        return EXIT_FAILURE;
+                }
+                if (verbose && log_format == LOG_TEXT)
+                        printf("Saved plan of %zu files to %s\n",
+                               plan.count, plan_out);
+                if (stats_mode) report_stats();
+                plan_free(&plan);
+                rules_free(&rules);
+                return EXIT_SUCCESS;
+        }
+
+        if (dry_mode && log_format == LOG_TEXT) {
+                printf("Dry run mode enabled.\n");
+        };
+
+        if (dircache_init(&dirs) != 0 || dircache_get(&dirs, dst_dir, "") < 0) {
+                perror("Open destination");
+                return EXIT_FAILURE;
+        }
+
+        char hash_cache[MAX_PATH];
+        if (setup_io(hash_cache, sizeof(hash_cache)) != 0) return EXIT_FAILURE;
+
+        Job job = { src_dir, dst_dir, forg_mode, &rules, NULL, &dirs, &plan,
+                    NULL, NULL };
+        if (journal_in) {
+                job.journal = &journal;
+        } else if (journal_out && !dry_mode) {
+                if (journal_create(&journal, journal_out, &plan,
+                                   conflict_policy, threads,
+                                   sync_policy == SYNC_FULL) != 0) {
+                        printfc(FATAL, "could not create journal %s: %s\n",
+                                journal_out, strerror(errno));
+                        return EXIT_FAILURE;
+                }
+                job.journal = &journal;
+        }
+        if (alloc_batches(&job.batches, job.journal != NULL) != 0)
+                return EXIT_FAILURE;
+        int status = EXIT_SUCCESS;
+        if (watch_mode) {
+                if (verbose && log_format == LOG_TEXT)
+                        printf("Watching %s\n", src_dir);
+                if (watch_tree(src_dir, dst_dir, debounce_ms, plan_file,
+                               execute_batch, &job) != 0) {
+                        perror("Watch");
+                        status = EXIT_FAILURE;
+                }
+        } else if (plan_execute(&plan, dry_mode ? 1 : threads, execute_step,
+                                flush_moves, &job) != 0) {
+                // One worker keeps a dry run's output in plan order
+                perror("Execute");
+                status = EXIT_FAILURE;
+        }
+        // Whatever was done is still logged and journaled
+        log_sync();
+        if (job.journal && journal_close(job.journal) != 0)
+                printfc(ERROR, "could not write the whole journal\n");
+        free_batches(job.batches);
+        plan_free(&plan);
+        finish_run(hash_cache);
+        return status;
+}
+
+/*
+ * Parse a whole decimal number between min and max
+*/
+bool parse_number(const char *str, long min, long max, long *out) {
+        char *end;
+        errno = 0;
+        long n = strtol(str, &end, 10);
+        if (errno != 0 || end == str || *end != '\0' || n < min || n > max)
+                return false;
+        *out = n;
+        return true;
+}
+
+/*
+ * Set up deduplication, reading its hash cache, and the I/O backend
+*/
+int setup_io(char *hash_cache, size_t len) {
+        if (deduplicate_mode) {
+                if (dedup_init(&dedup) != 0) {
+                        perror("Deduplicate");
+                        return -1;
+                }
+                if (cache_file(hash_cache, len, "hashes") != 0 ||
+                    dedup_load(&dedup, hash_cache) != 0) {
+                        printfc(WARN, "could not read the hash cache\n");
+                }
+        }
+
+        io_setup(uring_mode, queue_depth);
+        if (uring_mode && strcmp(io_backend(), "io_uring") != 0) {
+                printfc(WARN, "io_uring is unavailable, using synchronous I/O\n");
+        }
+        if (debug_mode)
+                printfc(DEBUG, "I/O backend: %s\n", io_backend());
+        return 0;
+}
+
+/*
+ * Allocate a batch per worker when renames can be queued, or when journaled
+ * files are to be recorded as pending a batch at a time, leaving batches
+ * NULL otherwise
+*/
+int alloc_batches(Batch **batches, bool journaled) {
+        *batches = NULL;
+        // Dry runs need a decision per file first
+        queue_renames = uring_mode && !dry_mode &&
+                        strcmp(io_backend(), "io_uring") == 0;
+        if (!queue_renames && (!journaled || dry_mode)) return 0;
+
+        Batch *b = calloc(threads, sizeof(*b));
+        for (int i = 0; b && i < threads; i++) {
+                b[i].files = malloc(queue_depth * sizeof(Pending));
+                b[i].ops = malloc(queue_depth * sizeof(IoOp));
+                if (!b[i].files || !b[i].ops) {
+                        perror("Batch");
+                        free_batches(b);
+                        return -1;
+                }
+        }
+        if (!b) {
+                perror("Batch");
+                return -1;
+        }
+        *batches = b;
+        return 0;
+}
+
+void free_batches(Batch *batches) {
+        for (int i = 0; batches && i < threads; i++) {
+                free(batches[i].files);
+                free(batches[i].ops);
+        }
+        free(batches);
+}
+
+/*
+ * Report on a finished run and release what every job shared
+*/
+void finish_run(const char *hash_cache) {
+        StatSlot total;
+        stats_merge(&stats, &total);
+        if (verbose && log_format == LOG_TEXT && total.copy.files > 0) {
+                double mib = total.copy.bytes / 1048576.0;
+                double secs = total.copy.nsec / 1e9;
+                printf("Copied %lu files across filesystems: %.1f MiB in %.2fs (%.1f MiB/s)\n",
+                       total.copy.files, mib, secs,
+                       secs > 0 ? mib / secs : 0.0);
+        }
+        if (stats_mode) report_stats();
+        if (deduplicate_mode) {
+                if (!dry_mode && dedup_save(&dedup, hash_cache) != 0) {
+                        printfc(WARN, "could not save the hash cache\n");
+                }
+                if (debug_mode)
+                        printfc(DEBUG, "Hash cache: %lu hits, %lu misses\n",
+                                dedup.hits, dedup.misses);
+                dedup_free(&dedup);
+        }
+        dircache_free(&dirs);
+        rules_free(&rules);
+        stats_free(&stats);
+        log_close();
+
+        if (log_format == LOG_TEXT)
+                printf("%lu operations finished.\n",
+                       (unsigned long)(total.count[STAT_MOVED] +
+                                       total.count[STAT_DUPLICATES]));
+}
+
+static uint64_t fnv64(uint64_t h, const void *data, size_t len) {
+        const unsigned char *p = data;
+        for (size_t i = 0; i < len; i++) {
+                h ^= p[i];
+                h *= 1099511628211ULL;
+        }
+        return h;
+}
+
+/*
+ * Open the scan index of a source and destination pair. It is only trusted
+ * with the same config, as it was when the index was written, and the same
+ * mode and override rules.
+*/
+static int open_scan_index(ScanIndex *index, const char *src_dir,
+                           const char *dst_dir, const char *config_file,
+                           enum ForgMode mode, uint64_t rules_id) {
+        char src[PATH_MAX], dst[PATH_MAX];
+        if (!realpath(src_dir, src) || !realpath(dst_dir, dst)) return -1;
+        uint64_t h = fnv64(14695981039346656037ULL, src, strlen(src) + 1);
+        h = fnv64(h, dst, strlen(dst));
+        char name[32], path[MAX_PATH];
+        snprintf(name, sizeof(name), "scan-%08x.idx",
+                 (uint32_t)(h ^ (h >> 32)));
+        if (cache_file(path, sizeof(path), name) != 0) return -1;
+
+        struct stat conf;
+        if (stat(config_file, &conf) != 0) return -1;
+        uint64_t conf_id[] = { conf.st_dev, conf.st_ino, conf.st_size,
+                               conf.st_mtim.tv_sec, conf.st_mtim.tv_nsec,
+                               mode,        rules_id };
+        uint64_t key = fnv64(14695981039346656037ULL, conf_id,
+                             sizeof(conf_id));
+        if (scanindex_open(index, path, key, full_scan) != 0) {
+                if (debug_mode)
+                        printfc(DEBUG, "could not open the scan index %s\n",
+                                path);
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Plan where each file of the sources of njobs jobs goes, walking them all
+ * at once with the worker pool. rules_ids tell each job's override rules
+ * apart in the scan index.
+*/
+static int scan_sources(Job *const *jobs, const uint64_t *rules_ids,
+                        size_t njobs, const char *config_file) {
+        ScanIndex *indexes = calloc(njobs ? njobs : 1, sizeof(*indexes));
+        WalkRoot *roots = calloc(njobs ? njobs : 1, sizeof(*roots));
+        if (!indexes || !roots) {
+                perror("Scan");
+                free(indexes);
+                free(roots);
+                return 1;
+        }
+        for (size_t i = 0; i < njobs; i++) {
+                Job *job = jobs[i];
+                bool indexed = open_scan_index(&indexes[i], job->src, job->dst,
+                                               config_file, job->mode,
+                                               rules_ids[i]) == 0;
+                WalkRoot root = { job->src, indexed ? &indexes[i] : NULL,
+                                  job };
+                roots[i] = root;
+        }
+        uint64_t start = stats_clock(&stats);
+        int err = walk_trees(roots, njobs, threads, plan_file, NULL);
+        stats_time(&stats, 0, STAT_SCAN, start);
+        for (size_t i = 0; i < njobs; i++) {
+                ScanIndex *index = roots[i].index;
+                if (!index) continue;
+                index_skipped += index->skipped;
+                index_read += index->read;
+                if (debug_mode)
+                        printfc(DEBUG,
+                                "Scan index: %lu directories unchanged, %lu read\n",
+                                index->skipped, index->read);
+                if (scanindex_close(index) != 0 && debug_mode)
+                        printfc(DEBUG, "could not save the scan index\n");
+        }
+        free(indexes);
+        free(roots);
+        if (err != 0) {
+                printfc(FATAL, "could not start walking %s\n",
+                        njobs == 1 ? jobs[0]->src : "the sources");
+                return 1;
+        }
+        return 0;
+}
+
+/*
+ * Check the directories, load the rules and, when walk is set, plan where
+ * each file of src_dir goes in dst_dir
+*/
+int plan_source(const char *src_dir, const char *dst_dir,
+                const char *config_file, bool walk) {
+        if (verbose && log_format == LOG_TEXT) {
                 char *tmp_mode = NULL;
                 switch (forg_mode) {
                 case AUTO:
@@ -161,11 +804,11 @@ int main(int argc, char *argv[]) {
 
         if (!isdir(src_dir)) {
                 printfc(FATAL, "source directory is not a directory!\n");
-                return EXIT_FAILURE;
+                return 1;
         }
         if (!isdir(dst_dir)) {
                 printfc(FATAL, "destination directory is not a directory!\n");
-                return EXIT_FAILURE;
+                return 1;
         }
 
         if (strcmp(src_dir, dst_dir) == 0) {
@@ -175,23 +818,25 @@ int main(int argc, char *argv[]) {
                 char choice = getchar();
                 if (choice != 'y' && choice != 'Y') {
                         printf("Aborting.\n");
-                        return EXIT_FAILURE;
+                        return 1;
                 }
         }
 
         if (load_config(config_file) != 0) {
-                return EXIT_FAILURE;
+                return 1;
         }
 
-        if (dry_mode) {
-                printf("Dry run mode enabled.\n");
-        };
-
-        walk_and_move(src_dir, dst_dir);
-
-        printf("%d operations finished.", operations);
+        if (plan_init(&plan, dst_dir, threads) != 0) {
+                perror("Plan");
+                return 1;
+        }
+        if (!walk) return 0;
 
-        return EXIT_SUCCESS;
+        Job job = { src_dir, dst_dir, forg_mode, &rules, NULL, NULL, &plan,
+                    NULL, NULL };
+        Job *jobs = &job;
+        uint64_t rules_id = 0;
+        return scan_sources(&jobs, &rules_id, 1, config_file);
 }
 
 void trim_newline(char *str) {
@@ -199,212 +844,1164 @@ void trim_newline(char *str) {
         if (len && str[len - 1] == '\n') str[len - 1] = '\0';
 }
 
+/*
+ * Path of the compiled image of a config, named after the config's path
+*/
+static int rules_image(char *buf, size_t len, const char *config) {
+        uint32_t h = 2166136261u;
+        for (const char *p = config; *p; p++) {
+                h ^= (unsigned char)*p;
+                h *= 16777619u;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "rules-%08x.bin", h);
+        return cache_file(buf, len, name);
+}
+
+/*
+ * Add the rule of a config line like ext:pdf=docs/ to rules. Rules that can't
+ * be used are only warned about, where naming the file they came from.
+ *
+ * Returns 0 once the rule was added or skipped, 1 when line isn't a rule and
+ * -1 on failure.
+*/
+static int parse_rule(RuleSet *rules, char *line, const char *where) {
+        RuleKind kind;
+        size_t skip = 4;
+        if (strncmp(line, "ext:", 4) == 0) {
+                kind = RULE_EXT;
+        } else if (strncmp(line, "tag:", 4) == 0) {
+                kind = RULE_TAG;
+        } else if (strncmp(line, "magic:", 6) == 0) {
+                kind = RULE_MAGIC;
+                skip = 6;
+        } else if (strncmp(line, "glob:", 5) == 0) {
+                kind = RULE_GLOB;
+                skip = 5;
+        } else if (strncmp(line, "re:", 3) == 0) {
+                kind = RULE_RE;
+                skip = 3;
+        } else {
+                return 1;
+        }
+
+        char *key;
+        char *val;
+        bool pattern = kind == RULE_GLOB || kind == RULE_RE;
+        if (pattern) {
+                // Patterns may hold a '=', destinations don't
+                key = line + skip;
+                val = strrchr(key, '=');
+                if (val) *val++ = '\0';
+        } else {
+                key = strtok(line + skip, "=");
+                val = strtok(NULL, "=");
+        }
+        if (!key || !val || !*key || !*val) return 0;
+
+        if (kind == RULE_MAGIC && !magic_known(key))
+                printfc(WARN, "unknown signature in %s: %s\n", where, key);
+        if (rules_add(rules, kind, key, val) < 0) {
+                if (pattern && errno == EINVAL) {
+                        printfc(WARN, "invalid pattern in %s: %s\n", where,
+                                key);
+                        return 0;
+                }
+                return -1;
+        }
+        return 0;
+}
+
 int load_config(const char *filename) {
+        // Stat before parsing, so a config edited meanwhile isn't cached
+        // as the older version
+        struct stat conf;
+        uint64_t conf_hash;
+        char image[MAX_PATH];
+        bool cached = stat(filename, &conf) == 0 &&
+                      rules_conf_hash(filename, &conf_hash) == 0 &&
+                      rules_image(image, sizeof(image), filename) == 0;
+        if (cached && rules_map(&rules, image, &conf, conf_hash) == 0) {
+                rules_mapped = true;
+                if (debug_mode)
+                        printfc(DEBUG,
+                                "Mapped %u tags, %u extensions, %u patterns and %u signatures from %s\n",
+                                rules.tags.count, rules.exts.count,
+                                rules.patterns.count, rules.magics.count,
+                                image);
+                return 0;
+        }
+
         FILE *fp = fopen(filename, "r");
         if (!fp) {
                 perror("Loading config");
                 return 1;
         }
+        if (rules_init(&rules) != 0) {
+                perror("Loading config");
+                fclose(fp);
+                return 1;
+        }
 
-        char line[MAX_LINE];
-        while (fgets(line, sizeof(line), fp)) {
+        char *line = NULL;
+        size_t cap = 0;
+        int err = 0;
+        while (!err && getline(&line, &cap, fp) != -1) {
                 trim_newline(line);
                 if (line[0] == '#' || strlen(line) < 3) continue;
-
-                if (strncmp(line, "ext:", 4) == 0) {
-                        char *key = strtok(line + 4, "=");
-                        char *val = strtok(NULL, "=");
-                        if (key && val) {
-                                strncpy(ext_map[ext_count].ext, key,
-                                        sizeof(ext_map[0].ext));
-                                strncpy(ext_map[ext_count].path, val,
-                                        sizeof(ext_map[0].path));
-                                ext_count++;
-                        }
-                } else if (strncmp(line, "tag:", 4) == 0) {
-                        char *key = strtok(line + 4, "=");
-                        char *val = strtok(NULL, "=");
-                        if (key && val) {
-                                strncpy(tag_map[tag_count].tag, key,
-                                        sizeof(tag_map[0].tag));
-                                strncpy(tag_map[tag_count].path, val,
-                                        sizeof(tag_map[0].path));
-                                tag_count++;
-                        }
+                if (parse_rule(&rules, line, "config") < 0) {
+                        perror("Loading config");
+                        err = 1;
                 }
         }
+        free(line);
+        fclose(fp);
+        if (!err && rules_compile(&rules) != 0) {
+                if (errno == E2BIG)
+                        printfc(FATAL, "too many patterns in config to match together\n");
+                else
+                        perror("Loading config");
+                err = 1;
+        }
+        if (err) {
+                rules_free(&rules);
+                return 1;
+        }
 
+        rules_parsed = true;
         if (debug_mode)
-                printfc(DEBUG, "Loaded %d tags and %d extensions\n", tag_count,
-                        ext_count);
+                printfc(DEBUG,
+                        "Loaded %u tags, %u extensions, %u patterns and %u signatures\n",
+                        rules.tags.count, rules.exts.count,
+                        rules.patterns.count, rules.magics.count);
+        if (cached && rules_save(&rules, image, &conf, conf_hash) != 0 &&
+            debug_mode)
+                printfc(DEBUG, "could not save the rule image %s\n", image);
+        return 0;
+}
 
-        fclose(fp);
+const char *get_pattern_path(const RuleSet *rules, const char *filename) {
+        return rules_match(rules, filename, strlen(filename));
+}
+
+const char *get_ext_path(const RuleSet *rules, const char *filename) {
+        const char *dot = strrchr(filename, '.');
+        if (!dot) return NULL;
+        return rules_find(rules, RULE_EXT, dot + 1, strlen(dot + 1));
+}
+
+const char *get_tag_path(const RuleSet *rules, const char *filename) {
+        const char *dash = strchr(filename, '-');
+        if (!dash) return NULL;
+        return rules_find(rules, RULE_TAG, filename, dash - filename);
+}
+
+/*
+ * Find the destination of a regular file from its first bytes. Only meant for
+ * files no tag or extension rule matched, as it has to read them.
+*/
+const char *get_magic_path(const RuleSet *rules, const WalkEntry *entry) {
+        if (rules->magics.count == 0 || entry->type != DT_REG) return NULL;
+
+        // Non-blocking, in case it was replaced by a FIFO since the walk
+        int fd = openat(entry->dirfd, entry->name,
+                        O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY |
+                                O_CLOEXEC);
+        if (fd < 0) return NULL;
+        unsigned char buf[MAGIC_LEN];
+        ssize_t n = pread(fd, buf, sizeof(buf), 0);
+        close(fd);
+        if (n <= 0) return NULL;
+
+        const char *name = magic_match(buf, n);
+        if (!name) return NULL;
+        return rules_find(rules, RULE_MAGIC, name, strlen(name));
+}
+
+/*
+ * Build the path of a file under forg's cache directory, creating the
+ * directory if needed
+*/
+int cache_file(char *buf, size_t len, const char *name) {
+        const char *base = getenv("XDG_CACHE_HOME");
+        if (base && *base) {
+                snprintf(buf, len, "%s", base);
+        } else {
+                snprintf(buf, len, "%s/.cache", getenv("HOME"));
+        }
+        if (mkdir(buf, 0700) != 0 && errno != EEXIST) return -1;
+        size_t n = strlen(buf);
+        snprintf(buf + n, len - n, "/forg");
+        if (mkdir(buf, 0700) != 0 && errno != EEXIST) return -1;
+        n = strlen(buf);
+        if ((size_t)snprintf(buf + n, len - n, "/%s", name) >= len - n)
+                return -1;
         return 0;
 }
 
-const char *get_ext_path(const char *ext) {
-        for (int i = 0; i < ext_count; i++) {
-                if (strcmp(ext, ext_map[i].ext) == 0) return ext_map[i].path;
+/*
+ * Rename without replacing an existing destination. Filesystems without
+ * RENAME_NOREPLACE fall back to a racy existence check.
+*/
+static int rename_noreplace(int src_fd, const char *name, int dst_fd,
+                            const char *dst_name) {
+        if (renameat2(src_fd, name, dst_fd, dst_name, RENAME_NOREPLACE) == 0)
+                return 0;
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+
+        if (faccessat(dst_fd, dst_name, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+                errno = EEXIST;
+                return -1;
         }
-        return NULL;
+        return renameat(src_fd, name, dst_fd, dst_name);
+}
+
+/*
+ * Move name into dst_fd, copying it when the destination is on another
+ * filesystem
+*/
+static int transfer(int src_fd, const char *name, int dst_fd,
+                    const char *dst_name, bool replace, CopyStats *copied) {
+        int err = replace ? renameat(src_fd, name, dst_fd, dst_name) :
+                            rename_noreplace(src_fd, name, dst_fd, dst_name);
+        if (err == 0 || errno != EXDEV) return err;
+        return copy_move(src_fd, name, dst_fd, dst_name, replace, sync_policy,
+                         copied);
+}
+
+/*
+ * Write name with _n appended before its extension into out
+*/
+static void suffix_name(const char *name, int n, char *out, size_t len) {
+        const char *dot = strrchr(name, '.');
+        if (!dot || dot == name) dot = name + strlen(name);
+        snprintf(out, len, "%.*s_%d%s", (int)(dot - name), name, n, dot);
 }
 
-const char *get_tag_path(const char *tag) {
-        for (int i = 0; i < tag_count; i++) {
-                if (strcmp(tag, tag_map[i].tag) == 0) return tag_map[i].path;
+/*
+ * Move name under the first free suffixed name, written into out
+*/
+static int rename_unique(int src_fd, const char *name, int dst_fd, char *out,
+                         size_t len, CopyStats *copied) {
+        for (int n = 1; n < MAX_SUFFIX; n++) {
+                suffix_name(name, n, out, len);
+                if (transfer(src_fd, name, dst_fd, out, false, copied) == 0)
+                        return 0;
+                if (errno != EEXIST) return -1;
         }
-        return NULL;
+        errno = EEXIST;
+        return -1;
 }
 
-int ensure_directory(const char *path) {
-        char path_copy[MAX_PATH];
-        size_t len = strlen(path);
-        if (len >= sizeof(path_copy)) {
-                return 1;
+/*
+ * Log what happened to a file headed for dst, dst_name being NULL unless it
+ * was renamed on the way
+*/
+static void log_file(const WalkEntry *src, const Target *dst,
+                     LogAction action, const char *dst_name, int err) {
+        LogLevel level = action == LOG_FAILED ? ERROR : INFO;
+        if (!log_enabled(level)) return;
+        LogEvent event = { action,      src->dir, src->name, dst->root,
+                           dst->subdir, dst_name, err };
+        log_event(src->worker, level, &event);
+}
+
+/*
+ * Journal what happened to a planned file, dst_name being its name at the
+ * destination when it was renamed
+*/
+static void journal_file(const PlanStep *step, const Target *dst,
+                         const Job *job, JournalAction action,
+                         const char *dst_name) {
+        // A dry run leaves the journal as it found it
+        if (!job->journal || dry_mode) return;
+        struct stat st;
+        bool moved = action == JOURNAL_MOVED &&
+                     fstatat(dst->fd, dst_name ? dst_name : step->src.name,
+                             &st, AT_SYMLINK_NOFOLLOW) == 0;
+        journal_record(job->journal, step->src.worker, step->index, action,
+                       dst_name, moved ? &st : NULL);
+}
+
+static void dry_move(const WalkEntry *src, const Target *dst, bool dedup_file) {
+        const char *name = src->name;
+        struct stat st;
+        char match[NAME_MAX + 1];
+
+        uint64_t start = stats_clock(&stats);
+        bool duplicate =
+                dedup_file &&
+                fstatat(src->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                dedup_find(&dedup, dst->fd, src->dirfd, name, &st, match,
+                           sizeof(match));
+        if (dedup_file) stats_time(&stats, src->worker, STAT_HASH, start);
+        if (duplicate) {
+                log_file(src, dst, LOG_WOULD_DELETE, match, 0);
+                return;
         }
-        strcpy(path_copy, path);
 
-        char *p = path_copy;
-        while (*p) {
-                if (*p == '/') {
-                        *p = '\0';
-                        struct stat st;
-                        if (stat(path_copy, &st) != 0) {
-                                if (mkdir(path_copy, 0700) != 0) return 2;
+        if (faccessat(dst->fd, name, F_OK, AT_SYMLINK_NOFOLLOW) != 0) {
+                log_file(src, dst, LOG_WOULD_MOVE, NULL, 0);
+                return;
+        }
+
+        switch (conflict_policy) {
+        case SKIP:
+                log_file(src, dst, LOG_EXISTS, NULL, 0);
+                break;
+        case RENAME:
+                for (int n = 1; n < MAX_SUFFIX; n++) {
+                        suffix_name(name, n, match, sizeof(match));
+                        if (faccessat(dst->fd, match, F_OK,
+                                      AT_SYMLINK_NOFOLLOW) != 0) {
+                                log_file(src, dst, LOG_WOULD_MOVE, match, 0);
+                                break;
                         }
-                        *p = '/';
                 }
-                p++;
+                break;
+        case REPLACE:
+                log_file(src, dst, LOG_WOULD_REPLACE, NULL, 0);
+                break;
         }
+}
+
+/*
+ * Returns 0 once the file was handled, -1 on failure and 1 when the
+ * destination directory was removed since it was opened.
+*/
+int move_file(const PlanStep *step, const Target *dst, const Job *job) {
+        const WalkEntry *src = &step->src;
+        const char *name = src->name;
+        bool dedup_file = step->action == PLAN_DEDUP;
+
+        if (dry_mode) {
+                dry_move(src, dst, dedup_file);
+                return 0;
+        }
+
         struct stat st;
-        if (stat(path, &st) != 0) {
-                if (mkdir(path, 0700) != 0) return 2;
+        bool have_st = false;
+        char match[NAME_MAX + 1];
+        int worker = src->worker;
+        if (dedup_file &&
+            fstatat(src->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                have_st = true;
+                uint64_t start = stats_clock(&stats);
+                int found = dedup_find(&dedup, dst->fd, src->dirfd, name, &st,
+                                       match, sizeof(match));
+                stats_time(&stats, worker, STAT_HASH, start);
+                if (found) {
+                        if (unlinkat(src->dirfd, name, 0) != 0) {
+                                perror("Delete");
+                                stats_count(&stats, worker, STAT_ERRORS, 1);
+                                return -1;
+                        }
+                        log_file(src, dst, LOG_DELETED, match, 0);
+                        journal_file(step, dst, job, JOURNAL_DELETED, match);
+                        stats_count(&stats, worker, STAT_DUPLICATES, 1);
+                        return 0;
+                }
+        }
+
+        const char *final_name = name;
+        CopyStats *copied = stats_copy(&stats, worker);
+        uint64_t start = stats_clock(&stats);
+        int err = transfer(src->dirfd, name, dst->fd, name, false, copied);
+        if (err != 0 && errno == EEXIST) {
+                switch (conflict_policy) {
+                case SKIP:
+                        stats_time(&stats, worker, STAT_MOVE, start);
+                        log_file(src, dst, LOG_EXISTS, NULL, 0);
+                        journal_file(step, dst, job, JOURNAL_SKIPPED, NULL);
+                        stats_count(&stats, worker, STAT_SKIPPED, 1);
+                        return 0;
+                case RENAME:
+                        err = rename_unique(src->dirfd, name, dst->fd, match,
+                                            sizeof(match), copied);
+                        final_name = match;
+                        break;
+                case REPLACE:
+                        err = transfer(src->dirfd, name, dst->fd, name, true,
+                                       copied);
+                        break;
+                }
+        }
+        stats_time(&stats, worker, STAT_MOVE, start);
+
+        if (err != 0) {
+                if (errno == ENOENT && dircache_stale(dst->fd)) return 1;
+                log_file(src, dst, LOG_FAILED, NULL, errno);
+                stats_count(&stats, worker, STAT_ERRORS, 1);
+                return -1;
+        }
+
+        log_file(src, dst, LOG_MOVED, final_name == name ? NULL : final_name,
+                 0);
+        journal_file(step, dst, job, JOURNAL_MOVED,
+                     final_name == name ? NULL : final_name);
+        stats_count(&stats, worker, STAT_MOVED, 1);
+        if (have_st) {
+                start = stats_clock(&stats);
+                dedup_add(&dedup, dst->fd, final_name, &st);
+                stats_time(&stats, worker, STAT_HASH, start);
         }
         return 0;
 }
 
-void move_file(const char *src_file, const char *dst_dir) {
-        const char *filename = strrchr(src_file, '/');
-        if (filename)
-                filename++;
-        else
-                filename = src_file;
+/*
+ * Move a file into subdir of the destination, with every fallback
+*/
+static void place_file(const PlanStep *step, const Job *job) {
+        const WalkEntry *entry = &step->src;
+        const char *subdir = step->subdir;
+        // Retry once if the directory was removed while we held it
+        for (int attempt = 0; attempt < 2; attempt++) {
+                uint64_t start = stats_clock(&stats);
+                int fd = dircache_get(job->dirs, job->dst, subdir);
+                stats_time(&stats, entry->worker, STAT_MKDIR, start);
+                Target target = { fd, job->dst, subdir };
+                if (fd < 0) {
+                        log_file(entry, &target, LOG_FAILED, NULL, errno);
+                        stats_count(&stats, entry->worker, STAT_ERRORS, 1);
+                        return;
+                }
 
-        char dest_path[MAX_PATH];
-        snprintf(dest_path, sizeof(dest_path), "%s/%s", dst_dir, filename);
+                if (move_file(step, &target, job) != 1) return;
+                dircache_invalidate(job->dirs, job->dst, subdir, fd);
+        }
+        Target target = { -1, job->dst, subdir };
+        log_file(entry, &target, LOG_FAILED, NULL, 0);
+        stats_count(&stats, entry->worker, STAT_ERRORS, 1);
+}
 
-        if (access(dest_path, F_OK) == 0) {
-                if (dry_mode) {
-                        if (deduplicate_mode) {
-                                printf("Would delete duplicate: %s\n",
-                                       dest_path);
-                        } else {
-                                printfc(INFO, "File exists: %s\n", dest_path);
-                        }
-                } else {
-                        if (deduplicate_mode) {
-                                if (remove(src_file) == 0) {
-                                        if (verbose) {
-                                                printfc(WARN,
-                                                        "Deleted duplicate: %s\n",
-                                                        dest_path);
-                                        }
-                                } else
-                                        perror("Delete");
-                        } else {
-                                if (verbose && isfile(dest_path)) {
-                                        printfc(INFO, "File exists: %s\n",
-                                                dst_dir);
-                                }
-                        }
-                        return;
+/*
+ * Handle the files queued by a worker, once their pending records are
+ * written. The queued renames are submitted together, and whatever they
+ * couldn't do, like conflicts or moves across filesystems, goes through
+ * place_file along with the files that weren't queued as a rename.
+*/
+static void flush_batch(const Job *job, Batch *batch, int worker) {
+        if (job->journal) journal_commit(job->journal, worker);
+        if (batch->nops > 0) {
+                uint64_t start = stats_clock(&stats);
+                io_run(batch->ops, batch->nops);
+                stats_time(&stats, worker, STAT_MOVE, start);
+        }
+        for (size_t i = 0; i < batch->count; i++) {
+                const Pending *p = &batch->files[i];
+                const IoOp *op = p->op < 0 ? NULL : &batch->ops[p->op];
+                if (!op || op->res != 0) {
+                        place_file(&p->step, job);
+                        continue;
+                }
+                Target target = { p->dst_fd, job->dst, p->step.subdir };
+                if (op->kind == IO_UNLINK) {
+                        log_file(&p->step.src, &target, LOG_DELETED, p->match,
+                                 0);
+                        journal_file(&p->step, &target, job, JOURNAL_DELETED,
+                                     p->match);
+                        stats_count(&stats, worker, STAT_DUPLICATES, 1);
+                        continue;
+                }
+                log_file(&p->step.src, &target, LOG_MOVED, NULL, 0);
+                journal_file(&p->step, &target, job, JOURNAL_MOVED, NULL);
+                stats_count(&stats, worker, STAT_MOVED, 1);
+                if (p->deduped) {
+                        uint64_t start = stats_clock(&stats);
+                        dedup_add(&dedup, p->dst_fd, p->name, &p->st);
+                        stats_time(&stats, worker, STAT_HASH, start);
                 }
         }
+        batch->count = 0;
+        batch->nops = 0;
+}
 
-        if (dry_mode) {
-                printf("Would move: %s => %s\n", src_file, dst_dir);
-        } else {
-                if (rename(src_file, dest_path) == 0) {
-                        if (verbose) {
-                                printf("Moved file: %s => %s\n", src_file,
-                                       dst_dir);
-                                operations++;
-                        }
-                } else {
-                        printfc(ERROR, "failed to move: %s to %s\n", src_file,
-                                dst_dir);
+/*
+ * Queue the rename of a file into its destination directory or, when it
+ * is to be deduplicated and a copy is already there, its deletion. Returns
+ * the index of the operation or -1 when it has to go through place_file.
+*/
+static int queue_op(const Job *job, Batch *batch, Pending *p) {
+        const WalkEntry *entry = &p->step.src;
+        // Created before the rename is queued, so it exists once submitted
+        uint64_t start = stats_clock(&stats);
+        int fd = dircache_get(job->dirs, job->dst, p->step.subdir);
+        stats_time(&stats, entry->worker, STAT_MKDIR, start);
+        if (fd < 0) return -1;
+        p->dst_fd = fd;
+
+        IoOp *op = &batch->ops[batch->nops];
+        memset(op, 0, sizeof(*op));
+        op->fd = entry->dirfd;
+        op->path = p->name;
+        if (p->deduped) {
+                start = stats_clock(&stats);
+                int found = dedup_find(&dedup, fd, entry->dirfd, p->name,
+                                       &p->st, p->match, sizeof(p->match));
+                stats_time(&stats, entry->worker, STAT_HASH, start);
+                if (found) {
+                        op->kind = IO_UNLINK;
+                        return batch->nops++;
+                }
+        }
+        op->kind = IO_RENAME;
+        op->new_fd = fd;
+        op->new_path = p->name;
+        op->flags = conflict_policy == REPLACE ? 0 : RENAME_NOREPLACE;
+        return batch->nops++;
+}
+
+/*
+ * Whether a file of size bytes is queued to be moved after being looked
+ * for among the duplicates, so a file queued later can't be compared to it
+*/
+static bool batch_moves_size(const Batch *batch, off_t size) {
+        for (size_t i = 0; i < batch->count; i++) {
+                const Pending *p = &batch->files[i];
+                if (p->deduped && p->op >= 0 &&
+                    batch->ops[p->op].kind == IO_RENAME &&
+                    p->st.st_size == size)
+                        return true;
+        }
+        return false;
+}
+
+/*
+ * Add a file to the batch of its worker, recording it as pending when
+ * journaling, and handle the batch once full
+*/
+static void queue_step(const PlanStep *step, const Job *job) {
+        const WalkEntry *entry = &step->src;
+        Batch *batch = &job->batches[entry->worker];
+        bool dedup_file = queue_renames && step->action == PLAN_DEDUP;
+        struct stat st;
+        bool known = (job->journal || dedup_file) &&
+                     fstatat(entry->dirfd, entry->name, &st,
+                             AT_SYMLINK_NOFOLLOW) == 0;
+        // It could be a copy of a file still waiting to be moved
+        if (known && dedup_file && batch_moves_size(batch, st.st_size))
+                flush_batch(job, batch, entry->worker);
+
+        Pending *p = &batch->files[batch->count];
+        snprintf(p->name, sizeof(p->name), "%s", entry->name);
+        p->step = *step;
+        p->step.src.name = p->name;
+        p->op = -1;
+        p->deduped = known && dedup_file;
+        if (known) p->st = st;
+        if (queue_renames && (step->action == PLAN_MOVE || p->deduped))
+                p->op = queue_op(job, batch, p);
+
+        if (job->journal) {
+                // A duplicate is deleted instead, unless it was moved
+                JournalAction intent = step->action == PLAN_DEDUP ?
+                                               JOURNAL_DELETED :
+                                               JOURNAL_MOVED;
+                journal_intent(job->journal, entry->worker, step->index,
+                               intent, p->name, known ? &st : NULL);
+        }
+        if (++batch->count == queue_depth)
+                flush_batch(job, batch, entry->worker);
+}
+
+void flush_moves(int worker, void *arg) {
+        const Job *job = arg;
+        if (job->batches && job->batches[worker].count > 0)
+                flush_batch(job, &job->batches[worker], worker);
+        // A chunk of the plan is done, its records are committed together
+        if (job->journal) journal_commit(job->journal, worker);
+}
+
+/*
+ * Find where rules send a file in the given mode, or NULL
+*/
+static const char *classify(const RuleSet *rules, const WalkEntry *entry,
+                            enum ForgMode mode) {
+        const char *filename = entry->name;
+        const char *target_subdir = NULL;
+
+        if (mode == AUTO || mode == TAG) {
+                target_subdir = get_tag_path(rules, filename);
+        }
+        if (!target_subdir && (mode == AUTO || mode == TAG)) {
+                target_subdir = get_pattern_path(rules, filename);
+        }
+        if (!target_subdir && (mode == AUTO || mode == EXT)) {
+                target_subdir = get_ext_path(rules, filename);
+        }
+        if (!target_subdir && (mode == AUTO || mode == EXT)) {
+                target_subdir = get_magic_path(rules, entry);
+        }
+        return target_subdir;
+}
+
+/*
+ * Whether signature rules could still send a file somewhere once its content
+ * is rewritten
+*/
+static bool content_matters(const WalkEntry *entry, const Job *job) {
+        if (entry->type != DT_REG || (job->mode != AUTO && job->mode != EXT))
+                return false;
+        return job->rules->magics.count > 0 ||
+               (job->overrides && job->overrides->magics.count > 0);
+}
+
+/*
+ * Plan where a file goes. Returns 1 unless no rule matched it, and none could
+ * by its content, so its directory can be skipped next time.
+*/
+int plan_file(const WalkEntry *entry, void *arg) {
+        const Job *job = arg;
+        const char *filename = entry->name;
+        const char *target_subdir = NULL;
+        uint64_t start = stats_clock(&stats);
+
+        if (job->overrides)
+                target_subdir = classify(job->overrides, entry, job->mode);
+        if (!target_subdir)
+                target_subdir = classify(job->rules, entry, job->mode);
+
+        stats_time(&stats, entry->worker, STAT_CLASSIFY, start);
+        stats_count(&stats, entry->worker, STAT_SEEN, 1);
+        if (!target_subdir) return content_matters(entry, job);
+
+        stats_count(&stats, entry->worker, STAT_MATCHED, 1);
+        if (plan_add(job->plan, entry->worker, entry->dir, filename,
+                     target_subdir, entry->type,
+                     deduplicate_mode ? PLAN_DEDUP : PLAN_MOVE) != 0) {
+                log_message(ERROR, "out of memory, skipping %s/%s\n",
+                            entry->dir, filename);
+                stats_count(&stats, entry->worker, STAT_ERRORS, 1);
+        }
+        return 1;
+}
+
+/*
+ * Whether st is the file a pending record saw at its source, renamed or
+ * copied across filesystems with its size and modification time
+*/
+static bool same_file(const JournalRecord *r, const struct stat *st) {
+        if (st->st_dev == r->dev) return st->st_ino == r->ino;
+        return (uint64_t)st->st_size == r->size &&
+               st->st_mtim.tv_sec == r->mtime_sec &&
+               (uint32_t)st->st_mtim.tv_nsec == r->mtime_nsec;
+}
+
+/*
+ * When resuming, find out what became of a file the interrupted run left
+ * pending, and journal it. Returns false when it is still to be handled.
+*/
+static bool recover_step(const PlanStep *step, const Job *job) {
+        const JournalRecord *r = journal_last(job->journal, step->index);
+        if (!r || r->action != JOURNAL_PENDING ||
+            faccessat(step->src.dirfd, step->src.name, F_OK,
+                      AT_SYMLINK_NOFOLLOW) == 0 ||
+            errno != ENOENT)
+                return false;
+
+        int fd = dircache_get(job->dirs, job->dst, step->subdir);
+        Target target = { fd, job->dst, step->subdir };
+        // A renamed file took the first free suffix after the planned name
+        char name[NAME_MAX + 1];
+        snprintf(name, sizeof(name), "%s", r->name ? r->name : step->src.name);
+        struct stat st;
+        for (int n = 1; fd >= 0 && r->ino &&
+                        fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+             n++) {
+                if (same_file(r, &st)) {
+                        bool renamed = strcmp(name, step->src.name) != 0;
+                        journal_file(step, &target, job, JOURNAL_MOVED,
+                                     renamed ? name : NULL);
+                        return true;
                 }
+                if (job->journal->conflict != RENAME || n == MAX_SUFFIX)
+                        break;
+                suffix_name(step->src.name, n, name, sizeof(name));
+        }
+        // Not found, so a duplicate was deleted
+        if (r->intent == JOURNAL_DELETED) {
+                journal_file(step, &target, job, JOURNAL_DELETED, NULL);
+                return true;
+        }
+        log_message(WARN, "lost track of %s/%s, left pending by the interrupted run\n",
+                    step->src.dir, step->src.name);
+        return true;
+}
+
+void execute_step(const PlanStep *step, void *arg) {
+        const Job *job = arg;
+        if (job->journal) {
+                JournalAction state = journal_state(job->journal, step->index);
+                if (state == JOURNAL_PENDING ? recover_step(step, job) :
+                                               state != JOURNAL_NONE)
+                        return;
+        }
+        if (job->batches) {
+                queue_step(step, job);
+        } else {
+                place_file(step, job);
         }
 }
 
-void walk_and_move(const char *src, const char *dest) {
-        DIR *dir = opendir(src);
-        if (!dir) {
-                perror("Read directory");
+/*
+ * Apply the files planned since the last batch of watch mode
+*/
+void execute_batch(void *arg) {
+        const Job *job = arg;
+        plan_sort(job->plan);
+        if (debug_mode)
+                printfc(DEBUG, "Batch of %zu files\n", job->plan->count);
+        plan_execute(job->plan, dry_mode ? 1 : threads, execute_step,
+                     flush_moves, arg);
+        plan_clear(job->plan);
+        log_sync();
+}
+
+/*
+ * Write the counters of the run, and how well each cache did, to stderr
+*/
+void report_stats(void) {
+        StatCache caches[] = {
+                { "dirs", dirs.hits, dirs.misses },
+                { "hashes", dedup.hits, dedup.misses },
+                { "scan_index", index_skipped, index_read },
+                { "rule_image", rules_mapped, rules_parsed },
+        };
+        stats_report(&stats, caches, sizeof(caches) / sizeof(caches[0]),
+                     stats_format, stderr);
+}
+
+/*
+ * Descriptor of the directory at path, reusing the one of the previous call
+ * when id, its offset in the plan's strings, is the same
+*/
+static int reopen_dir(uint32_t id, const char *path, uint32_t *last, int *fd) {
+        if (*fd >= 0 && *last == id) return *fd;
+        if (*fd >= 0) close(*fd);
+        *last = id;
+        *fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        return *fd;
+}
+
+/*
+ * Move a file a journal recorded as moved back where it came from
+*/
+static void undo_file(const Plan *plan, const JournalRecord *r, int src_fd,
+                      int dst_fd) {
+        const PlanEntry *e = &plan->entries[r->entry];
+        WalkEntry src = { src_fd, plan->strings + e->dir,
+                          plan->strings + e->name, e->type, 0 };
+        Target dst = { dst_fd, plan_root(plan), plan->strings + e->subdir };
+        const char *moved = r->name ? r->name : src.name;
+
+        struct stat st;
+        if (fstatat(dst_fd, moved, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            (r->ino && (st.st_ino != r->ino || st.st_dev != r->dev))) {
+                printfc(WARN, "no longer where it was moved, left alone: %s/%s%s\n",
+                        dst.root, dst.subdir, moved);
+                stats_count(&stats, 0, STAT_SKIPPED, 1);
+                return;
+        }
+        if (dry_mode) {
+                log_file(&src, &dst, LOG_WOULD_RESTORE, r->name, 0);
                 return;
         }
-        struct dirent *entry;
-        char path[MAX_PATH];
-        while ((entry = readdir(dir))) {
-                if (strcmp(entry->d_name, ".") == 0 ||
-                    strcmp(entry->d_name, "..") == 0)
+        if (transfer(dst_fd, moved, src_fd, src.name, false,
+                     stats_copy(&stats, 0)) != 0) {
+                printfc(ERROR, "failed to restore: %s/%s%s to %s: %s\n",
+                        dst.root, dst.subdir, moved, src.dir,
+                        strerror(errno));
+                stats_count(&stats, 0, STAT_ERRORS, 1);
+                return;
+        }
+        log_file(&src, &dst, LOG_RESTORED, r->name, 0);
+        journal_record(&journal, 0, r->entry, JOURNAL_UNDONE, NULL, NULL);
+        stats_count(&stats, 0, STAT_MOVED, 1);
+}
+
+/*
+ * Reverse the run of a journal, the most recent move first. Restores are
+ * journaled too, so an interrupted undo can be run again.
+*/
+int undo_journal(const char *path) {
+        if (journal_load(&journal, &plan, path, 1, sync_policy == SYNC_FULL,
+                         dry_mode) != 0) {
+                printfc(FATAL, "could not load journal %s: %s\n", path,
+                        strerror(errno));
+                return EXIT_FAILURE;
+        }
+        if (chdir(journal.cwd) != 0) {
+                printfc(FATAL, "could not enter %s: %s\n", journal.cwd,
+                        strerror(errno));
+                return EXIT_FAILURE;
+        }
+
+        int src_fd = -1, dst_fd = -1;
+        uint32_t src_at = 0, dst_at = 0;
+        char dst_dir[MAX_PATH];
+        unsigned long deleted = 0;
+        for (size_t i = journal.nrecords; i-- > 0;) {
+                const JournalRecord *r = &journal.records[i];
+                JournalAction state = journal_state(&journal, r->entry);
+                if (r->action == JOURNAL_DELETED) deleted++;
+                // Only the last record of a file tells where it is
+                if (r->action != JOURNAL_MOVED || state != JOURNAL_MOVED)
+                        continue;
+
+                const PlanEntry *e = &plan.entries[r->entry];
+                if (reopen_dir(e->dir, plan.strings + e->dir, &src_at,
+                               &src_fd) < 0) {
+                        printfc(ERROR, "failed to open %s: %s\n",
+                                plan.strings + e->dir, strerror(errno));
+                        stats_count(&stats, 0, STAT_ERRORS, 1);
+                        continue;
+                }
+                snprintf(dst_dir, sizeof(dst_dir), "%s/%s", plan_root(&plan),
+                         plan.strings + e->subdir);
+                if (reopen_dir(e->subdir, dst_dir, &dst_at, &dst_fd) < 0) {
+                        printfc(WARN, "no longer where it was moved, left alone: %s/%s%s\n",
+                                plan_root(&plan), plan.strings + e->subdir,
+                                r->name ? r->name : plan.strings + e->name);
+                        stats_count(&stats, 0, STAT_SKIPPED, 1);
                         continue;
+                }
+                undo_file(&plan, r, src_fd, dst_fd);
+        }
+        if (src_fd >= 0) close(src_fd);
+        if (dst_fd >= 0) close(dst_fd);
+        log_sync();
+        if (deleted > 0)
+                printfc(WARN, "%lu duplicates were deleted and can't be restored\n",
+                        deleted);
 
-                snprintf(path, sizeof(path), "%s/%s", src, entry->d_name);
+        log_close();
+        int err = journal_close(&journal);
+        if (err != 0) printfc(ERROR, "could not write the whole journal\n");
+        if (stats_mode) report_stats();
+        StatSlot total;
+        stats_merge(&stats, &total);
+        stats_free(&stats);
+        plan_free(&plan);
+        if (log_format == LOG_TEXT)
+                printf("%lu files restored.\n",
+                       (unsigned long)total.count[STAT_MOVED]);
+        return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-                struct stat st;
-                if (stat(path, &st) != 0) continue;
+static void free_jobs(BatchJob *jobs, size_t njobs) {
+        for (size_t i = 0; i < njobs; i++) {
+                free(jobs[i].name);
+                free(jobs[i].src);
+                free(jobs[i].dst);
+                free(jobs[i].journal_path);
+                rules_free(&jobs[i].overrides);
+                if (jobs[i].planned) plan_free(&jobs[i].plan);
+        }
+        free(jobs);
+}
 
-                if (S_ISDIR(st.st_mode)) {
-                        walk_and_move(path, dest);
-                } else {
-                        const char *filename = entry->d_name;
-                        char *dot = strrchr(filename, '.');
-                        char *dash = strchr(filename, '-');
-                        const char *target_subdir = NULL;
-
-                        if (forg_mode == AUTO) {
-                                if (dash) {
-                                        char tag[64] = { 0 };
-                                        strncpy(tag, filename, dash - filename);
-                                        target_subdir = get_tag_path(tag);
-                                }
-                                if (!target_subdir && dot) {
-                                        target_subdir = get_ext_path(dot + 1);
-                                }
-                        } else if (forg_mode == TAG) {
-                                if (dash) {
-                                        char tag[64] = { 0 };
-                                        strncpy(tag, filename, dash - filename);
-                                        target_subdir = get_tag_path(tag);
-                                }
-                        } else if (forg_mode == EXT) {
-                                if (dot) target_subdir = get_ext_path(dot + 1);
-                        }
+/*
+ * Set a field of a job from a key=value line. Returns 1 when line isn't one
+ * of its fields.
+*/
+static int job_field(BatchJob *job, const char *line) {
+        char **field;
+        if (strncmp(line, "src=", 4) == 0) {
+                field = &job->src;
+        } else if (strncmp(line, "dst=", 4) == 0) {
+                field = &job->dst;
+        } else if (strncmp(line, "journal=", 8) == 0) {
+                field = &job->journal_path;
+        } else {
+                return 1;
+        }
+        const char *val = strchr(line, '=') + 1;
+        if (!*val) {
+                errno = EINVAL;
+                return -1;
+        }
+        free(*field);
+        *field = strdup(val);
+        return *field ? 0 : -1;
+}
 
-                        if (target_subdir) {
-                                char final_dir[MAX_PATH];
-                                snprintf(final_dir, sizeof(final_dir), "%s/%s",
-                                         dest, target_subdir);
-
-                                int err = ensure_directory(final_dir);
-                                switch (err) {
-                                case 0:
-                                        break;
-                                case 1:
-                                        printfc(ERROR,
-                                                "failed to prepare directory. Directory length is too large.\n");
-                                        printfc(DEBUG, "Directory: %s\n",
-                                                final_dir);
-                                        continue;
-                                case 2:
-                                        printfc(ERROR,
-                                                "failed to make directory.\n");
+/*
+ * Read the jobs of a batch file. A job starts with a [name] line, followed by
+ * its src= and dst= lines, optionally mode= and journal= lines, and rules
+ * written as in the config, which take precedence over it for that job.
+*/
+static int load_jobs(const char *path, BatchJob **out, size_t *count) {
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+                printfc(FATAL, "could not read jobs %s: %s\n", path,
+                        strerror(errno));
+                return -1;
+        }
+
+        BatchJob *jobs = NULL;
+        size_t njobs = 0, cap = 0, lineno = 0;
+        char *line = NULL;
+        size_t len = 0;
+        int err = 0;
+        while (!err && getline(&line, &len, fp) != -1) {
+                lineno++;
+                trim_newline(line);
+                if (line[0] == '#' || line[0] == '\0') continue;
+
+                if (line[0] == '[') {
+                        char *end = strchr(line, ']');
+                        if (!end || end == line + 1) {
+                                printfc(FATAL, "%s:%zu: invalid job name\n",
+                                        path, lineno);
+                                err = 1;
+                                continue;
+                        }
+                        if (njobs == cap) {
+                                cap = cap ? cap * 2 : 8;
+                                BatchJob *grown =
+                                        realloc(jobs, cap * sizeof(*jobs));
+                                if (!grown) {
+                                        perror("Loading jobs");
+                                        err = 1;
                                         continue;
                                 }
-                                move_file(path, final_dir);
+                                jobs = grown;
+                        }
+                        BatchJob *job = &jobs[njobs++];
+                        memset(job, 0, sizeof(*job));
+                        job->name = strndup(line + 1, end - line - 1);
+                        job->overrides_id = 14695981039346656037ULL;
+                        if (!job->name || rules_init(&job->overrides) != 0) {
+                                perror("Loading jobs");
+                                err = 1;
+                        }
+                        continue;
+                }
+                if (njobs == 0) {
+                        printfc(FATAL, "%s:%zu: expected a [name] line first\n",
+                                path, lineno);
+                        err = 1;
+                        continue;
+                }
+
+                BatchJob *job = &jobs[njobs - 1];
+                int res = job_field(job, line);
+                if (res == 1 && strncmp(line, "mode=", 5) == 0) {
+                        const char *mode = line + 5;
+                        res = 0;
+                        if (strcmp(mode, "auto") == 0) {
+                                job->mode = AUTO;
+                        } else if (strcmp(mode, "tag") == 0) {
+                                job->mode = TAG;
+                        } else if (strcmp(mode, "ext") == 0) {
+                                job->mode = EXT;
+                        } else {
+                                printfc(FATAL, "%s:%zu: unknown mode: %s\n",
+                                        path, lineno, mode);
+                                err = 1;
+                                continue;
                         }
                 }
+                if (res == 1) {
+                        // Hashed before parse_rule cuts the line apart
+                        uint64_t id = fnv64(job->overrides_id, line,
+                                            strlen(line) + 1);
+                        res = parse_rule(&job->overrides, line, path);
+                        job->overrides_id = id;
+                        if (res == 0) job->noverrides++;
+                }
+                if (res != 0) {
+                        printfc(FATAL, "%s:%zu: %s\n", path, lineno,
+                                res == 1 ? "unknown line" : strerror(errno));
+                        err = 1;
+                }
+        }
+        free(line);
+        fclose(fp);
+
+        for (size_t i = 0; !err && i < njobs; i++) {
+                if (!jobs[i].src || !jobs[i].dst) {
+                        printfc(FATAL, "job %s needs a src= and a dst=\n",
+                                jobs[i].name);
+                        err = 1;
+                } else if (rules_compile(&jobs[i].overrides) != 0) {
+                        if (errno == E2BIG)
+                                printfc(FATAL, "too many patterns in job %s to match together\n",
+                                        jobs[i].name);
+                        else
+                                perror("Loading jobs");
+                        err = 1;
+                }
+        }
+        if (err) {
+                free_jobs(jobs, njobs);
+                return -1;
+        }
+        *out = jobs;
+        *count = njobs;
+        return 0;
+}
+
+/*
+ * Check the directories of a batch job and set up its plan. Returns 0 once
+ * it is ready to be scanned, -1 when it has to be skipped.
+*/
+static int prepare_job(BatchJob *b) {
+        if (!isdir(b->src) || !isdir(b->dst)) {
+                printfc(ERROR, "job %s: %s is not a directory, skipped\n",
+                        b->name, isdir(b->src) ? b->dst : b->src);
+                return -1;
+        }
+        // Unlike a single run, there is no one to ask
+        if (strcmp(b->src, b->dst) == 0) {
+                printfc(ERROR, "job %s: source and destination are the same, skipped\n",
+                        b->name);
+                return -1;
+        }
+        if (dircache_get(&dirs, b->dst, "") < 0) {
+                printfc(ERROR, "job %s: could not open %s: %s, skipped\n",
+                        b->name, b->dst, strerror(errno));
+                return -1;
+        }
+        if (plan_init(&b->plan, b->dst, threads) != 0) {
+                perror("Plan");
+                return -1;
+        }
+        b->planned = true;
+
+        const RuleSet *overrides = b->noverrides ? &b->overrides : NULL;
+        Job job = { b->src,   b->dst, b->mode, &rules, overrides, &dirs,
+                    &b->plan, NULL,   NULL };
+        b->job = job;
+        return 0;
+}
+
+/*
+ * Sort the plan of a scanned batch job and open its journal. Returns 0 once
+ * it is ready to run, -1 when it has to be skipped.
+*/
+static int start_job(BatchJob *b) {
+        plan_sort(&b->plan);
+        if (verbose && log_format == LOG_TEXT)
+                printf("Planned %zu files for job %s\n", b->plan.count,
+                       b->name);
+
+        if (b->journal_path && !dry_mode) {
+                if (journal_create(&b->journal, b->journal_path, &b->plan,
+                                   conflict_policy, threads,
+                                   sync_policy == SYNC_FULL) != 0) {
+                        printfc(ERROR, "job %s: could not create journal %s: %s, skipped\n",
+                                b->name, b->journal_path, strerror(errno));
+                        return -1;
+                }
+                b->job.journal = &b->journal;
+        }
+        return 0;
+}
+
+/*
+ * Run every job of a batch file in one process. The jobs share the rules,
+ * the destination directories and one pool of workers, which walks every
+ * source at once and then takes a destination directory of each job in turn. Jobs that can't run are
+ * skipped, failing the batch once the others are done.
+*/
+int run_batch(const char *path, const char *config_file) {
+        BatchJob *jobs = NULL;
+        size_t njobs = 0;
+        const Plan **plans = NULL;
+        void **args = NULL;
+        Job **scanned = NULL;
+        uint64_t *rules_ids = NULL;
+        Batch *batches = NULL;
+        bool started = false; // Once set, finish_run releases what's shared
+        char hash_cache[MAX_PATH];
+        int status = EXIT_FAILURE;
+        if (load_config(config_file) != 0) return EXIT_FAILURE;
+        if (load_jobs(path, &jobs, &njobs) != 0) goto cleanup;
+        if (dircache_init(&dirs) != 0) {
+                perror("Open destination");
+                goto cleanup;
+        }
+
+        plans = malloc((njobs ? njobs : 1) * sizeof(*plans));
+        args = malloc((njobs ? njobs : 1) * sizeof(*args));
+        scanned = malloc((njobs ? njobs : 1) * sizeof(*scanned));
+        rules_ids = malloc((njobs ? njobs : 1) * sizeof(*rules_ids));
+        if (!plans || !args || !scanned || !rules_ids) {
+                perror("Batch");
+                goto cleanup;
+        }
+        status = EXIT_SUCCESS;
+        size_t nscanned = 0;
+        for (size_t i = 0; i < njobs; i++) {
+                if (prepare_job(&jobs[i]) != 0) {
+                        status = EXIT_FAILURE;
+                        continue;
+                }
+                scanned[nscanned] = &jobs[i].job;
+                rules_ids[nscanned++] = jobs[i].overrides_id;
+        }
+        if (scan_sources(scanned, rules_ids, nscanned, config_file) != 0) {
+                status = EXIT_FAILURE;
+                goto cleanup;
+        }
+
+        size_t nready = 0;
+        bool journaled = false;
+        for (size_t i = 0; i < njobs; i++) {
+                if (!jobs[i].planned) continue;
+                if (start_job(&jobs[i]) != 0) {
+                        status = EXIT_FAILURE;
+                        continue;
+                }
+                if (jobs[i].job.journal) journaled = true;
+                plans[nready] = &jobs[i].plan;
+                args[nready++] = &jobs[i].job;
+        }
+
+        if (dry_mode && log_format == LOG_TEXT) {
+                printf("Dry run mode enabled.\n");
+        };
+        if (setup_io(hash_cache, sizeof(hash_cache)) != 0 ||
+            alloc_batches(&batches, journaled) != 0) {
+                status = EXIT_FAILURE;
+                goto cleanup;
+        }
+        started = true;
+        // A worker's batch is flushed at the end of every destination
+        // directory, so it never holds files of two jobs
+        for (size_t i = 0; i < nready; i++) {
+                ((Job *)args[i])->batches = batches;
+        }
+
+        if (plan_execute_all(plans, args, nready, dry_mode ? 1 : threads,
+                             execute_step, flush_moves) != 0) {
+                perror("Execute");
+                status = EXIT_FAILURE;
+        }
+        log_sync();
+
+cleanup:
+        // Jobs prepared before a failure still have their journal closed
+        for (size_t i = 0; i < njobs; i++) {
+                if (jobs[i].job.journal &&
+                    journal_close(jobs[i].job.journal) != 0)
+                        printfc(ERROR, "job %s: could not write the whole journal\n",
+                                jobs[i].name);
+        }
+        free_batches(batches);
+        free(plans);
+        free(args);
+        free(scanned);
+        free(rules_ids);
+        free_jobs(jobs, njobs);
+        if (started) {
+                finish_run(hash_cache);
+                return status;
         }
-        closedir(dir);
+        if (deduplicate_mode) dedup_free(&dedup);
+        dircache_free(&dirs);
+        rules_free(&rules);
+        log_close();
+        return status;
 }
@@ -8,13 +8,33 @@ struct ProgramArguments args[] = {
 
 struct ProgramCommands commands[] = {
         {"autocomplete", "SHELL", "Generate autocompletion for bash or zsh"},
+        {"apply", "FILE", "Apply a plan saved with --save-plan"},
+        {"watch", NULL, "Keep organizing new files as they arrive"},
+        {"resume", "JOURNAL", "Finish a run that was interrupted"},
+        {"undo", "JOURNAL", "Move the files of a run back where they came from"},
+        {"batch", "FILE", "Run every job of a job file in one process"},
 };
 
 struct ProgramFlag flags[] = {
         { "-d", "--dry", NULL, "Preview actions" },
-        { "-r", "--remove", NULL, "Remove duplicate files" },
+        { "-r", "--remove", NULL,
+          "Remove source files whose content already exists at the destination" },
+        { "-c", "--conflict", "POLICY",
+          "When a name is taken: skip (default), rename or replace" },
         { "-h", "--help", NULL, "Displays this message and exits" },
         { "-V", "--verbose", NULL, "Enable verbosity" },
+        { NULL, "--fsync", "POLICY",
+          "Across filesystems, sync copies: none, file (default) or full" },
+        { "-j", "--jobs", "N", "Number of worker threads (0 for all cores)" },
+        { NULL, "--io", "BACKEND", "Submit file operations with sync (default) or uring" },
+        { NULL, "--queue-depth", "N", "Files batched per thread, in flight with io_uring (default 64)" },
+        { NULL, "--save-plan", "FILE", "Save the plan to FILE instead of applying it" },
+        { NULL, "--debounce", "MS", "In watch mode, wait for files to be left alone this long (default 1000)" },
+        { NULL, "--full", NULL, "Read every source directory, ignoring the scan index" },
+        { NULL, "--stats", "FMT", "Report counters and timings at exit, as text (default) or json" },
+        { NULL, "--log-format", "FMT", "List files as text (default), jsonl or nul" },
+        { NULL, "--log-level", "LEVEL", "Only list files at error, warn, info or debug and above" },
+        { NULL, "--journal", "FILE", "Record the run in FILE, to resume or undo it" },
 };
 
 ProgramInfo program_info = {
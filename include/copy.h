@@ -0,0 +1,43 @@
+#ifndef COPY_H
+#define COPY_H
+
+/*
+ * When to wait for copied data to reach the disk
+ *
+ * SYNC_NONE => never, the source may be gone before the copy is durable
+ *
+ * SYNC_FILE => fsync the copy, then its directory once it's renamed into
+ *              place, before removing the source
+ *
+ * SYNC_FULL => also fsync the source directory after removing the source
+*/
+typedef enum { SYNC_NONE, SYNC_FILE, SYNC_FULL } SyncPolicy;
+
+/*
+ * Totals of the copies done so far, updated atomically
+*/
+typedef struct {
+        unsigned long files;
+        unsigned long long bytes;
+        unsigned long long nsec;
+} CopyStats;
+
+/*
+ * Move name from src_fd to dst_name in dst_fd across filesystems
+ *
+ * Data is copied with copy_file_range, falling back to sendfile and then to
+ * read/write, in bounded chunks into an unnamed file in the destination
+ * directory, or a temporary file next to the destination where the
+ * filesystem lacks O_TMPFILE. Mode, owner, times and extended attributes are
+ * preserved when permitted. The copy is linked into place and the source
+ * unlinked only once the copy is durable according to policy. When the
+ * source can't be unlinked, the copy is removed again.
+ *
+ * Unless replace is set, fails with EEXIST when dst_name is taken.
+ *
+ * Returns 0 on success, -1 and sets errno on failure.
+*/
+int copy_move(int src_fd, const char *name, int dst_fd, const char *dst_name,
+              int replace, SyncPolicy policy, CopyStats *stats);
+
+#endif // COPY_H
@@ -0,0 +1,96 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * 128-bit content digest
+*/
+typedef struct {
+        uint64_t h[2];
+} Digest;
+
+/*
+ * Digests of a file, valid as long as its identity, mtime and ctime match
+*/
+typedef struct {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtime_sec;
+        int64_t ctime_sec;
+        uint32_t mtime_nsec;
+        uint32_t ctime_nsec;
+        uint32_t flags;
+        uint32_t age; // Runs since the record was last used
+        Digest partial; // First and last block
+        Digest full;
+} HashRecord;
+
+typedef struct DedupDir DedupDir;
+
+/*
+ * Content based duplicate finder
+ *
+ * Files are first bucketed by size, then compared by a partial digest of
+ * their first and last block, and only then by a digest of their whole
+ * content. Digests are cached by (dev, inode, size, mtime, ctime) and can be
+ * saved so later runs skip rehashing unchanged files. Files are only taken
+ * for duplicates once their bytes were compared.
+*/
+typedef struct {
+        pthread_mutex_t lock;
+        HashRecord *records;
+        uint32_t mask;
+        uint32_t count;
+        int dirty;
+        DedupDir **dirs; // Size buckets of destination directories
+        uint32_t dirs_mask;
+        uint32_t dirs_count;
+        unsigned long hits;
+        unsigned long misses;
+} Dedup;
+
+/*
+ * Prepare an empty duplicate finder
+*/
+int dedup_init(Dedup *dedup);
+
+/*
+ * Release everything held by the duplicate finder
+*/
+void dedup_free(Dedup *dedup);
+
+/*
+ * Load digests saved by a previous run. A missing or outdated file is not an
+ * error.
+*/
+int dedup_load(Dedup *dedup, const char *path);
+
+/*
+ * Save the digest cache, if anything changed since it was loaded. Records
+ * left unused for several runs, e.g. of files deleted since, are dropped.
+*/
+int dedup_save(Dedup *dedup, const char *path);
+
+/*
+ * Look in the directory behind dst_fd for a file with the same content as
+ * name in src_fd, st being the source's metadata.
+ *
+ * Returns 1 and copies the name of the duplicate into match when one is
+ * found, 0 otherwise.
+*/
+int dedup_find(Dedup *dedup, int dst_fd, int src_fd, const char *name,
+               const struct stat *st, char *match, size_t match_len);
+
+/*
+ * Record that a file named name with metadata st now lives in dst_fd, so
+ * the following files can be compared against it.
+*/
+void dedup_add(Dedup *dedup, int dst_fd, const char *name,
+               const struct stat *st);
+
+#endif // DEDUP_H
@@ -0,0 +1,74 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * A destination directory already verified or created
+*/
+typedef struct {
+        char *root; // e.g /home/user/Files
+        char *subdir; // e.g media/images/, empty for the root itself
+        uint32_t hash;
+        int fd;
+} DirEntry;
+
+/*
+ * Process wide cache of open destination directories
+ *
+ * Lookups take a read lock, only misses serialize on the write lock.
+ * Descriptors of invalidated entries are kept open until dircache_free, as
+ * other workers may still be using them.
+*/
+typedef struct {
+        pthread_rwlock_t lock;
+        DirEntry **slots;
+        uint32_t mask;
+        uint32_t count;
+        int *retired;
+        size_t retired_count;
+        size_t retired_cap;
+        unsigned long hits;
+        unsigned long misses;
+} DirCache;
+
+/*
+ * Prepare an empty cache
+*/
+int dircache_init(DirCache *cache);
+
+/*
+ * Close every descriptor and release the cache
+*/
+void dircache_free(DirCache *cache);
+
+/*
+ * Get a descriptor of root/subdir, creating the missing directories the
+ * first time it's asked for. The descriptor belongs to the cache.
+ *
+ * Returns -1 and sets errno on failure.
+*/
+int dircache_get(DirCache *cache, const char *root, const char *subdir);
+
+/*
+ * Forget fd as the descriptor of root/subdir, e.g. after the directory was
+ * removed behind our back. The next dircache_get creates it again.
+*/
+void dircache_invalidate(DirCache *cache, const char *root,
+                         const char *subdir, int fd);
+
+/*
+ * Check whether the directory behind fd has been removed
+*/
+int dircache_stale(int fd);
+
+/*
+ * Create subdir below root_fd, submitting the mkdir of every component as
+ * one batch ordered from the outermost in
+ *
+ * Returns a new descriptor of the innermost directory, or -1 and sets errno.
+*/
+int ensure_directory(int root_fd, const char *subdir);
+
+#endif // DIRCACHE_H
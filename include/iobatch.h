@@ -0,0 +1,56 @@
+#ifndef IOBATCH_H
+#define IOBATCH_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * Operations that can be batched
+*/
+typedef enum { IO_MKDIR, IO_RENAME, IO_UNLINK, IO_STATX } IoKind;
+
+/*
+ * A single operation of a batch
+ *
+ * IO_MKDIR  => mkdirat(fd, path, mode)
+ *
+ * IO_RENAME => renameat2(fd, path, new_fd, new_path, flags)
+ *
+ * IO_UNLINK => unlinkat(fd, path, flags)
+ *
+ * IO_STATX  => statx(fd, path, flags, STATX_BASIC_STATS, stx)
+ *
+ * When after is set, the operation starts only once the previous one has
+ * completed, whatever its result. res is 0 or -errno once the batch ran.
+*/
+typedef struct {
+        IoKind kind;
+        int after;
+        int fd;
+        const char *path;
+        int new_fd;
+        const char *new_path;
+        unsigned flags;
+        unsigned mode;
+        struct statx *stx;
+        int res;
+} IoOp;
+
+/*
+ * Choose the backend. With use_uring set, every thread gets its own
+ * io_uring of depth entries the first time it runs a batch; when the kernel
+ * refuses, or lacks one of the operations, batches run synchronously.
+*/
+void io_setup(int use_uring, unsigned depth);
+
+/*
+ * Run n operations, up to depth of them in flight at once
+*/
+void io_run(IoOp *ops, size_t n);
+
+/*
+ * Name of the backend the calling thread would use
+*/
+const char *io_backend(void);
+
+#endif // IOBATCH_H
@@ -0,0 +1,133 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "plan.h"
+
+/*
+ * What was done to a planned file
+*/
+typedef enum {
+        JOURNAL_NONE,
+        JOURNAL_MOVED,
+        JOURNAL_DELETED, // Deleted as a duplicate
+        JOURNAL_SKIPPED, // Left in place as the destination was taken
+        JOURNAL_UNDONE, // Moved back by an undo
+        JOURNAL_PENDING, // About to be moved or deleted, as intent says
+} JournalAction;
+
+/*
+ * A record of the journal. name is the destination name when the file was
+ * renamed on the way, NULL otherwise. dev and ino identify the file at its
+ * destination, 0 when unknown.
+ *
+ * A pending record is written before a file is touched. Its name is the one
+ * it was planned to have at the destination, and dev, ino, size and mtime
+ * describe it at its source. Its intent is JOURNAL_DELETED when the file
+ * was to be deleted if it turned out to be a duplicate.
+*/
+typedef struct {
+        uint32_t entry; // Index in the plan
+        JournalAction action;
+        JournalAction intent; // JOURNAL_NONE unless pending
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtime_sec;
+        uint32_t mtime_nsec;
+        const char *name;
+} JournalRecord;
+
+/*
+ * Append-only journal of a run
+ *
+ * The sorted plan is written first, as plan_save does, followed by the
+ * working directory and a record for every file handled. Workers gather
+ * their records in their own buffer and append it in a single write at the
+ * end of each chunk of the plan, or before handling a batch of files it
+ * just recorded as pending. Records of several workers committed meanwhile share one
+ * fdatasync when durable is set.
+*/
+typedef struct {
+        int fd;
+        int durable;
+        int readonly; // Loaded for a dry run, nothing is written
+        pthread_mutex_t lock;
+        pthread_cond_t synced_cond;
+        uint64_t written; // Commits appended so far
+        uint64_t synced; // Commits known to be on disk
+        int syncing;
+        int failed; // A commit could not be written or synced
+        char **bufs; // One per worker
+        size_t *lens;
+        int nworkers;
+        uint8_t *state; // Last action of every plan entry
+        size_t count;
+        JournalRecord *records; // Loaded by journal_load
+        size_t nrecords;
+        size_t *last; // Index in records of the last record of every entry
+        unsigned conflict; // Conflict policy of the run, as its caller numbers it
+        char *names;
+        char *cwd; // Working directory of the run
+} Journal;
+
+/*
+ * Write plan and the conflict policy of the run to a new journal at path,
+ * with a buffer for each of nworkers workers, and wait for it to reach the
+ * disk
+*/
+int journal_create(Journal *journal, const char *path, const Plan *plan,
+                   unsigned conflict, int nworkers, int durable);
+
+/*
+ * Load the plan and records of a journal into an uninitialized plan and
+ * reopen it for appending, unless readonly is set. A record cut short by a
+ * crash is dropped, and cut off the file when not readonly.
+ *
+ * Returns 0 on success, -1 and sets errno on failure: EINVAL for a file
+ * that isn't a journal.
+*/
+int journal_load(Journal *journal, Plan *plan, const char *path,
+                 int nworkers, int durable, int readonly);
+
+/*
+ * Record what a worker did to entry. st is the file at its destination, or
+ * NULL.
+*/
+void journal_record(Journal *journal, int worker, size_t entry,
+                    JournalAction action, const char *name,
+                    const struct stat *st);
+
+/*
+ * Record what a worker is about to do to entry, intent being JOURNAL_MOVED
+ * or JOURNAL_DELETED. st is the file at its source. The record only covers
+ * the file once committed.
+*/
+void journal_intent(Journal *journal, int worker, size_t entry,
+                    JournalAction intent, const char *name,
+                    const struct stat *st);
+
+/*
+ * Append the records of a worker
+*/
+void journal_commit(Journal *journal, int worker);
+
+/*
+ * Last action recorded for entry, JOURNAL_NONE when it wasn't handled yet
+*/
+JournalAction journal_state(const Journal *journal, size_t entry);
+
+/*
+ * Last record loaded for entry, NULL when there is none
+*/
+const JournalRecord *journal_last(const Journal *journal, size_t entry);
+
+/*
+ * Commit what is left, sync and close the journal
+*/
+int journal_close(Journal *journal);
+
+#endif // JOURNAL_H
@@ -0,0 +1,84 @@
+#ifndef LOGBUF_H
+#define LOGBUF_H
+
+#include "printfc.h"
+
+/*
+ * How file events are written
+ *
+ * LOG_TEXT  => one sentence per line, meant for people
+ *
+ * LOG_JSONL => one JSON object per line: level, action, src, dst and error
+ *              when there is one
+ *
+ * LOG_NUL   => action, source and destination, each ended by a NUL byte
+*/
+typedef enum { LOG_TEXT, LOG_JSONL, LOG_NUL } LogFormat;
+
+/*
+ * What happened to a file
+*/
+typedef enum {
+        LOG_MOVED,
+        LOG_EXISTS, // Skipped as the destination is taken
+        LOG_DELETED, // Deleted as a duplicate of the destination
+        LOG_FAILED,
+        LOG_WOULD_MOVE,
+        LOG_WOULD_REPLACE,
+        LOG_WOULD_DELETE,
+        LOG_RESTORED, // Moved back by an undo
+        LOG_WOULD_RESTORE,
+} LogAction;
+
+/*
+ * A file event. The destination is root/subdir followed by name, subdir being
+ * empty or ending with a '/'.
+*/
+typedef struct {
+        LogAction action;
+        const char *dir; // Source directory
+        const char *name;
+        const char *root;
+        const char *subdir;
+        const char *dst_name; // When the destination isn't named as the source
+        int err; // errno of a failure, 0 for none
+} LogEvent;
+
+/*
+ * Start the writer thread with a buffer for each of nworkers workers. Only
+ * events of level or more important are formatted.
+*/
+int log_open(LogFormat format, LogLevel level, int nworkers);
+
+/*
+ * Whether events of level are written
+*/
+int log_enabled(LogLevel level);
+
+/*
+ * Format an event into the buffer of a worker, handing it to the writer once
+ * full. A worker id must not be used by two threads at once.
+ *
+ * In text format, failures, files found in the way and deleted duplicates
+ * are printed right away by printfc, with its labels.
+*/
+void log_event(int worker, LogLevel level, const LogEvent *event);
+
+/*
+ * printfc for worker threads, keeping the label and the message of one
+ * thread together
+*/
+void log_message(LogLevel level, const char *fmt, ...);
+
+/*
+ * Hand every buffer to the writer and wait until it's all written. Only
+ * meant while no worker is logging.
+*/
+void log_sync(void);
+
+/*
+ * Write what is left and stop the writer
+*/
+void log_close(void);
+
+#endif // LOGBUF_H
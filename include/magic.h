@@ -0,0 +1,20 @@
+#ifndef MAGIC_H
+#define MAGIC_H
+
+#include <stddef.h>
+
+// How much of a file is read to recognize it
+#define MAGIC_LEN 512
+
+/*
+ * Name of the built-in signature found in the first len bytes of a file, such
+ * as "pdf" or "png", or NULL. The longest matching signature wins.
+*/
+const char *magic_match(const unsigned char *buf, size_t len);
+
+/*
+ * Whether name is the name of a built-in signature
+*/
+int magic_known(const char *name);
+
+#endif // MAGIC_H
@@ -0,0 +1,69 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Kinds of patterns
+ *
+ * PATTERN_GLOB  => matches the whole name: *, ? and [...] classes
+ *
+ * PATTERN_REGEX => extended regular expression, matching anywhere in the
+ *                  name unless anchored with ^ or $
+ *
+ * Both are case insensitive when they start with (?i).
+*/
+typedef enum { PATTERN_GLOB, PATTERN_REGEX } PatternKind;
+
+/*
+ * A pattern to compile, value is what matching it returns and must not be 0
+*/
+typedef struct {
+        PatternKind kind;
+        const char *text;
+        uint32_t value;
+} PatternSpec;
+
+/*
+ * Every pattern of a rule set compiled into a single DFA
+ *
+ * Bytes are first mapped to classes of bytes no pattern tells apart. State 0
+ * rejects everything, state 1 is the start.
+*/
+typedef struct {
+        uint8_t classes[256];
+        uint32_t nclasses;
+        uint32_t nstates;
+        uint32_t count; // Patterns compiled in
+        uint32_t *next; // nstates * nclasses transitions
+        uint32_t *accept; // Value of the winning pattern, 0 for none
+} PatternDfa;
+
+/*
+ * Check the syntax of a pattern
+ *
+ * Returns 0 when it is valid, -1 otherwise.
+*/
+int pattern_check(PatternKind kind, const char *text);
+
+/*
+ * Compile n valid patterns into dfa. When several patterns match a name, the
+ * first one wins.
+ *
+ * Returns 0 on success, -1 and sets errno on failure: E2BIG when the patterns
+ * need too many states together.
+*/
+int pattern_compile(PatternDfa *dfa, const PatternSpec *specs, size_t n);
+
+/*
+ * Value of the first pattern matching len bytes of name, or 0
+*/
+uint32_t pattern_match(const PatternDfa *dfa, const char *name, size_t len);
+
+/*
+ * Release a DFA built by pattern_compile
+*/
+void pattern_free(PatternDfa *dfa);
+
+#endif // PATTERN_H
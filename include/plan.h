@@ -0,0 +1,172 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "walker.h"
+
+#define PLAN_CHUNK 256 // Files of a destination directory handed out at once
+
+/*
+ * What to do with a planned file
+ *
+ * PLAN_MOVE  => move it, the conflict policy decides when the name is taken
+ *
+ * PLAN_DEDUP => remove it if its content is already in the destination
+ *               directory, move it otherwise
+*/
+typedef enum { PLAN_MOVE, PLAN_DEDUP } PlanAction;
+
+/*
+ * A planned file
+ *
+ * dir, name and subdir are offsets into the string arena of the plan.
+ * Directories are interned, so every file of a directory shares one string.
+*/
+typedef struct {
+        uint32_t dir; // Source directory
+        uint32_t name;
+        uint32_t subdir; // Destination, relative to the root
+        uint8_t type;
+        uint8_t action;
+} PlanEntry;
+
+/*
+ * A slot of the table interning directories, offset 0 marks an empty slot
+*/
+typedef struct {
+        uint32_t hash;
+        uint32_t str;
+} PlanSlot;
+
+typedef struct PlanBuf PlanBuf;
+
+/*
+ * Every file to move, and where to
+ *
+ * Workers gather the files they plan in their own buffer, merged into the
+ * plan under the lock once full.
+*/
+typedef struct {
+        pthread_mutex_t lock;
+        char *strings;
+        size_t strings_len;
+        size_t strings_cap;
+        PlanSlot *dirs;
+        uint32_t dirs_mask;
+        uint32_t dirs_count;
+        PlanEntry *entries;
+        size_t count;
+        size_t cap;
+        uint32_t root; // Destination root
+        uint32_t cwd; // Working directory the plan's relative paths start from
+        PlanBuf **bufs; // One per worker
+        int nworkers;
+} Plan;
+
+/*
+ * A planned file as handed to the executor
+*/
+typedef struct {
+        WalkEntry src;
+        const char *subdir;
+        PlanAction action;
+        size_t index; // Of the entry in the plan
+} PlanStep;
+
+/*
+ * Called once for every planned file. May run on any worker thread.
+*/
+typedef void (*plan_fn)(const PlanStep *step, void *arg);
+
+/*
+ * Prepare an empty plan of moves into root, filled by up to nworkers workers.
+ * The working directory is recorded along, as relative paths of the plan
+ * only make sense from there.
+*/
+int plan_init(Plan *plan, const char *root, int nworkers);
+
+/*
+ * Release everything held by the plan
+*/
+void plan_free(Plan *plan);
+
+/*
+ * Forget every planned file of a plan made by plan_init, keeping its root
+*/
+void plan_clear(Plan *plan);
+
+/*
+ * Plan to move name, found in dir, into subdir of the root. Safe to call
+ * from several threads, as long as each uses its own worker id.
+ *
+ * Returns 0 on success, -1 when out of memory.
+*/
+int plan_add(Plan *plan, int worker, const char *dir, const char *name,
+             const char *subdir, unsigned char type, PlanAction action);
+
+/*
+ * Merge the files still in the buffers of the workers. Only meant while no
+ * worker is planning.
+ *
+ * Returns 0 on success, -1 when some were dropped for lack of memory.
+*/
+int plan_flush(Plan *plan);
+
+/*
+ * Destination root of the plan
+*/
+const char *plan_root(const Plan *plan);
+
+/*
+ * Working directory the plan was made in
+*/
+const char *plan_cwd(const Plan *plan);
+
+/*
+ * Order the plan by destination directory, then by source directory, after
+ * merging what the workers still hold
+*/
+void plan_sort(Plan *plan);
+
+/*
+ * Save the plan so it can be applied later
+*/
+int plan_save(const Plan *plan, const char *path);
+
+/*
+ * Number of bytes plan_save writes for the plan
+*/
+size_t plan_saved_size(const Plan *plan);
+
+/*
+ * Load a plan saved by plan_save into an uninitialized plan
+ *
+ * Returns 0 on success, -1 and sets errno on failure. A file that isn't a
+ * plan fails with EINVAL.
+*/
+int plan_load(Plan *plan, const char *path);
+
+/*
+ * Apply a sorted plan with nthreads workers
+ *
+ * Destination directories are handed out to workers whole, or in chunks of
+ * PLAN_CHUNK files for larger ones, so a single busy directory still keeps
+ * every worker going. The worker calls fn for each file of its chunk and
+ * then done. Source directories are opened as needed and stay open until
+ * done was called.
+*/
+int plan_execute(const Plan *plan, int nthreads, plan_fn fn,
+                 walk_done_fn done, void *arg);
+
+/*
+ * Apply n sorted plans with one pool of nthreads workers, fn and done
+ * getting the arg of the plan a file belongs to
+ *
+ * Chunks of every plan are handed out in turn, one of each plan at a time.
+*/
+int plan_execute_all(const Plan **plans, void **args, size_t n,
+                     int nthreads, plan_fn fn, walk_done_fn done);
+
+#endif // PLAN_H
@@ -0,0 +1,133 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "pattern.h"
+
+/*
+ * Kinds of rules found in forg.conf
+*/
+typedef enum { RULE_TAG, RULE_EXT, RULE_MAGIC, RULE_GLOB, RULE_RE } RuleKind;
+
+/*
+ * A slot of a lookup table
+ *
+ * key and path are offsets into the string arena. Key 0 points to the empty
+ * string at the start of the arena and marks an empty slot.
+*/
+typedef struct {
+        uint32_t hash;
+        uint32_t key;
+        uint32_t key_len;
+        uint32_t path;
+} RuleSlot;
+
+/*
+ * Open addressing hash table with linear probing, kept at most half full
+*/
+typedef struct {
+        RuleSlot *slots;
+        uint32_t mask; // Slot count - 1, the count is a power of two
+        uint32_t count;
+} RuleTable;
+
+/*
+ * A glob or regex rule waiting for rules_compile, as offsets into the string
+ * arena
+*/
+typedef struct {
+        uint32_t kind;
+        uint32_t text;
+        uint32_t path;
+} RulePattern;
+
+/*
+ * Every loaded rule
+ *
+ * Keys and destination paths live in a single string arena, destination paths
+ * are interned so rules sending files to the same place share one string.
+ * Destinations always end with a slash, which rules_add appends when missing.
+ * A rule set mapped from an image points into it and can't be added to.
+*/
+typedef struct {
+        char *strings;
+        size_t strings_len;
+        size_t strings_cap;
+        RuleTable tags; // Case sensitive
+        RuleTable exts; // Case insensitive
+        RuleTable magics; // Signature names, case insensitive
+        RuleTable paths; // Interned destinations
+        PatternDfa patterns; // Globs and regexes, matching to a path offset
+        RulePattern *pending;
+        uint32_t pending_count;
+        uint32_t pending_cap;
+        void *image; // Mapped image, NULL when built in memory
+        size_t image_len;
+} RuleSet;
+
+/*
+ * Prepare an empty rule set
+*/
+int rules_init(RuleSet *rules);
+
+/*
+ * Release everything held by the rule set
+*/
+void rules_free(RuleSet *rules);
+
+/*
+ * Add a rule sending key to path. The first rule for a key wins, and so does
+ * the first glob or regex matching a name.
+ *
+ * Returns 0 on success, 1 if the key was already present and -1 on failure:
+ * out of memory, or EINVAL for a glob or regex that doesn't parse.
+*/
+int rules_add(RuleSet *rules, RuleKind kind, const char *key, const char *path);
+
+/*
+ * Find the destination for a key of len bytes, or NULL
+*/
+const char *rules_find(const RuleSet *rules, RuleKind kind, const char *key,
+                       size_t len);
+
+/*
+ * Compile the globs and regexes added so far, needed before matching or
+ * saving them
+ *
+ * Returns 0 on success, -1 and sets errno on failure.
+*/
+int rules_compile(RuleSet *rules);
+
+/*
+ * Find the destination of the first glob or regex matching a name of len
+ * bytes, or NULL
+*/
+const char *rules_match(const RuleSet *rules, const char *name, size_t len);
+
+/*
+ * Hash the content of the config at path, for rules_save and rules_map
+*/
+int rules_conf_hash(const char *path, uint64_t *hash);
+
+/*
+ * Save the lookup tables and strings as an image that rules_map can use
+ * directly, keyed by the metadata and content hash of the config they were
+ * loaded from
+*/
+int rules_save(const RuleSet *rules, const char *path,
+               const struct stat *conf, uint64_t conf_hash);
+
+/*
+ * Map an image saved by rules_save into an uninitialized rule set. Its
+ * header, layout and every offset, slot and transition are checked, so a
+ * damaged image is never used.
+ *
+ * Returns 0 on success, 1 if the image is missing, damaged or was compiled
+ * from another version of the config, and -1 on failure.
+*/
+int rules_map(RuleSet *rules, const char *path, const struct stat *conf,
+              uint64_t conf_hash);
+
+#endif // RULES_H
@@ -0,0 +1,96 @@
+#ifndef SCANINDEX_H
+#define SCANINDEX_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * Header of the index file, followed by the record table and then by the
+ * names region
+*/
+typedef struct {
+        char magic[8];
+        uint32_t version;
+        uint32_t dirty; // Set while a run may be changing the index
+        uint64_t key; // Rules and options the index was built with
+        uint32_t generation; // Bumped by every run
+        uint32_t slots; // Size of the record table, a power of two
+        uint32_t count;
+        uint32_t record_size;
+        uint64_t names_cap;
+        uint64_t names_len;
+        uint64_t garbage; // Bytes of names no record points to anymore
+} ScanHeader;
+
+/*
+ * What a directory looked like when it was last read
+ *
+ * names is the offset in the names region of the names of its
+ * subdirectories, each ending with a NUL.
+*/
+typedef struct {
+        uint64_t dev;
+        uint64_t ino;
+        int64_t mtime_sec;
+        int64_t ctime_sec;
+        uint32_t mtime_nsec;
+        uint32_t ctime_nsec;
+        uint64_t names;
+        uint32_t names_len;
+        uint32_t seen; // Generation of the last run that visited it
+        uint32_t flags;
+} ScanRecord;
+
+/*
+ * Directories of a source tree that need no reading as long as they don't
+ * change
+*/
+typedef struct {
+        pthread_mutex_t lock;
+        char *path;
+        int fd;
+        void *map;
+        size_t map_len;
+        ScanHeader *hdr;
+        ScanRecord *records;
+        char *names;
+        struct timespec start; // When the run opened the index
+        unsigned long skipped; // Directories found unchanged
+        unsigned long read;
+} ScanIndex;
+
+/*
+ * Open the index at path, starting over when it was built with another key,
+ * is damaged, was left dirty by an interrupted run or full is set.
+*/
+int scanindex_open(ScanIndex *index, const char *path, uint64_t key,
+                   int full);
+
+/*
+ * Look up the directory described by st
+ *
+ * Returns 1 when it is unchanged since it was recorded clean, and sets names
+ * to a copy of the names of its subdirectories, len bytes long, to be freed
+ * by the caller. Returns 0 when the directory must be read.
+*/
+int scanindex_lookup(ScanIndex *index, const struct stat *st, char **names,
+                     size_t *len);
+
+/*
+ * Record a directory just read, with st taken before reading it. Unless
+ * clean is set, the directory will be read again next time, as it will when
+ * it changed since the run started, since a later change within the same
+ * timestamp tick would go unseen.
+*/
+void scanindex_update(ScanIndex *index, const struct stat *st,
+                      const char *names, size_t len, int clean);
+
+/*
+ * Flush the index, compacting it when needed, and release it
+*/
+int scanindex_close(ScanIndex *index);
+
+#endif // SCANINDEX_H
@@ -0,0 +1,120 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "copy.h"
+
+/*
+ * Phases a run spends its time in
+ *
+ * STAT_SCAN     => walking the source, wall clock
+ *
+ * STAT_CLASSIFY => finding the rule of each file
+ *
+ * STAT_MKDIR    => getting destination directories, creating them if needed
+ *
+ * STAT_MOVE     => renaming and copying files
+ *
+ * STAT_HASH     => comparing contents to find duplicates
+ *
+ * Except for the scan, phases add up the time of every worker.
+*/
+typedef enum {
+        STAT_SCAN,
+        STAT_CLASSIFY,
+        STAT_MKDIR,
+        STAT_MOVE,
+        STAT_HASH,
+        STAT_PHASES,
+} StatPhase;
+
+/*
+ * What happened to the files
+*/
+typedef enum {
+        STAT_SEEN,
+        STAT_MATCHED, // A rule gave them a destination
+        STAT_MOVED,
+        STAT_SKIPPED, // Left in place as the destination was taken
+        STAT_DUPLICATES, // Deleted as duplicates
+        STAT_ERRORS,
+        STAT_COUNTERS,
+} StatCounter;
+
+/*
+ * Counters of a single worker, alone on its cache lines so workers never
+ * write to the same one
+*/
+typedef struct {
+        uint64_t nsec[STAT_PHASES];
+        uint64_t count[STAT_COUNTERS];
+        CopyStats copy;
+} __attribute__((aligned(64))) StatSlot;
+
+/*
+ * Counters of a run, one slot per worker. Slots are written without
+ * synchronization, a worker id must not be used by two threads at once.
+ *
+ * Phases are only timed when timed is set.
+*/
+typedef struct {
+        StatSlot *slots;
+        int nslots;
+        int timed;
+} Stats;
+
+/*
+ * Hits and misses of a cache, for the report
+*/
+typedef struct {
+        const char *name;
+        unsigned long hits;
+        unsigned long misses;
+} StatCache;
+
+typedef enum { STATS_TEXT, STATS_JSON } StatFormat;
+
+/*
+ * Prepare zeroed counters for nslots workers
+*/
+int stats_init(Stats *stats, int nslots, int timed);
+
+/*
+ * Release the counters
+*/
+void stats_free(Stats *stats);
+
+/*
+ * Start of a phase, 0 when phases aren't timed
+*/
+uint64_t stats_clock(const Stats *stats);
+
+/*
+ * Add the time since start, as returned by stats_clock, to a phase
+*/
+void stats_time(Stats *stats, int worker, StatPhase phase, uint64_t start);
+
+/*
+ * Add n to a counter of a worker
+*/
+void stats_count(Stats *stats, int worker, StatCounter counter, uint64_t n);
+
+/*
+ * Copy totals of a worker, to hand to copy_move
+*/
+CopyStats *stats_copy(Stats *stats, int worker);
+
+/*
+ * Merge the slots of every worker into total. Only meant once the workers
+ * are done.
+*/
+void stats_merge(const Stats *stats, StatSlot *total);
+
+/*
+ * Write the merged counters and n cache hit rates to out
+*/
+void stats_report(const Stats *stats, const StatCache *caches, size_t n,
+                  StatFormat format, FILE *out);
+
+#endif // STATS_H
@@ -0,0 +1,78 @@
+#ifndef WALKER_H
+#define WALKER_H
+
+#include <stddef.h>
+#include "scanindex.h"
+
+/*
+ * A file found by the walker
+ *
+ * dirfd is an open descriptor of the directory holding the entry, valid for
+ * the duration of the callback. dir is the same directory as a path, only
+ * meant for messages. type is the entry's d_type, already resolved when the
+ * filesystem reported DT_UNKNOWN.
+*/
+typedef struct {
+        int dirfd;
+        const char *dir;
+        const char *name;
+        unsigned char type;
+        int worker;
+} WalkEntry;
+
+/*
+ * Called once for every non-directory entry. May run on any worker thread.
+ *
+ * Returns nonzero when the entry needs handling, or might once it changes
+ * without changing its directory, so its directory has to be read again by
+ * the next walk.
+*/
+typedef int (*walk_fn)(const WalkEntry *entry, void *arg);
+
+/*
+ * Called by a worker once it went through every entry of a directory, while
+ * their dirfd is still open
+*/
+typedef void (*walk_done_fn)(int worker, void *arg);
+
+/*
+ * Walk root recursively with nthreads workers
+ *
+ * Every worker owns a deque of pending directories. Subdirectories are pushed
+ * to the bottom of the deque of the worker that found them and popped from the
+ * same end, while idle workers steal from the top of the others.
+ *
+ * Directories are opened relative to their parent's descriptor, which stays
+ * open until every queued child has been opened. Symbolic links to
+ * directories are not followed. done may be NULL.
+ *
+ * With an index, directories unchanged since a walk found nothing to handle
+ * in them are not read again: only their subdirectories, as recorded, are
+ * visited. index may be NULL.
+ *
+ * Returns 0 once every directory has been read, or -1 if the walk could not
+ * start.
+*/
+int walk_tree(const char *root, int nthreads, walk_fn fn, walk_done_fn done,
+              ScanIndex *index, void *arg);
+
+/*
+ * A tree to walk along with others, with its own index and callback argument.
+ * index may be NULL.
+*/
+typedef struct {
+        const char *path;
+        ScanIndex *index;
+        void *arg;
+} WalkRoot;
+
+/*
+ * Walk several trees at once with one pool of nthreads workers, as walk_tree
+ * does for one. Workers that run out of directories in one tree steal from
+ * the others, so a small tree doesn't leave threads idle while a large one
+ * is still being read.
+*/
+int walk_trees(const WalkRoot *roots, size_t nroots, int nthreads,
+               walk_fn fn, walk_done_fn done);
+
+#endif // WALKER_H
@@ -0,0 +1,28 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "walker.h"
+
+/*
+ * Called after every batch of files reported to the walk_fn
+*/
+typedef void (*watch_batch_fn)(void *arg);
+
+/*
+ * Watch root recursively for new files until SIGINT or SIGTERM
+ *
+ * Files already present are reported first. After that, a file is reported
+ * once it was closed after writing or moved in, and then left alone for
+ * debounce_ms. Files settling close together are reported in one batch,
+ * followed by a call to batch. When the kernel drops events, every watched
+ * directory is read again, a few per round.
+ *
+ * skip, if not NULL, is a directory that isn't watched, like a destination
+ * inside root.
+ *
+ * Returns 0 once stopped by a signal, or -1 if watching could not start.
+*/
+int watch_tree(const char *root, const char *skip, unsigned debounce_ms,
+               walk_fn fn, watch_batch_fn batch, void *arg);
+
+#endif // WATCH_H
@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+#include "copy.h"
+
+#define COPY_CHUNK (8 << 20)
+#define BUFFER_SIZE (1 << 20)
+
+static unsigned long tmp_counter = 0;
+
+static int kernel_copy_unsupported(int err) {
+        return err == EXDEV || err == ENOSYS || err == EINVAL ||
+               err == EOPNOTSUPP || err == EBADF;
+}
+
+static int copy_rw(int in, int out, unsigned long long *copied) {
+        char *buf = malloc(BUFFER_SIZE);
+        if (!buf) return -1;
+
+        for (;;) {
+                ssize_t n = read(in, buf, BUFFER_SIZE);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) break;
+                if (n == 0) {
+                        free(buf);
+                        return 0;
+                }
+                for (ssize_t off = 0; off < n;) {
+                        ssize_t w = write(out, buf + off, n - off);
+                        if (w < 0 && errno == EINTR) continue;
+                        if (w < 0) {
+                                free(buf);
+                                return -1;
+                        }
+                        off += w;
+                }
+                *copied += n;
+        }
+        free(buf);
+        return -1;
+}
+
+/*
+ * Copy everything left in in to out, never holding more than one chunk
+*/
+static int copy_data(int in, int out, unsigned long long *copied) {
+        ssize_t n;
+
+        while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) != 0) {
+                if (n > 0) {
+                        *copied += n;
+                        continue;
+                }
+                if (errno == EINTR) continue;
+                if (*copied == 0 && kernel_copy_unsupported(errno)) break;
+                return -1;
+        }
+        if (n == 0) return 0;
+
+        while ((n = sendfile(out, in, NULL, COPY_CHUNK)) != 0) {
+                if (n > 0) {
+                        *copied += n;
+                        continue;
+                }
+                if (errno == EINTR) continue;
+                if (*copied == 0 && (errno == EINVAL || errno == ENOSYS))
+                        break;
+                return -1;
+        }
+        if (n == 0) return 0;
+
+        return copy_rw(in, out, copied);
+}
+
+/*
+ * Best effort, some attributes can't be set by unprivileged users
+*/
+static void copy_xattrs(int in, int out) {
+        ssize_t len = flistxattr(in, NULL, 0);
+        if (len <= 0) return;
+        char *names = malloc(len);
+        if (!names) return;
+        len = flistxattr(in, names, len);
+
+        for (ssize_t i = 0; i < len; i += strlen(names + i) + 1) {
+                const char *name = names + i;
+                ssize_t vlen = fgetxattr(in, name, NULL, 0);
+                if (vlen < 0) continue;
+                char *value = malloc(vlen ? vlen : 1);
+                if (!value) continue;
+                vlen = fgetxattr(in, name, value, vlen);
+                if (vlen >= 0) fsetxattr(out, name, value, vlen, 0);
+                free(value);
+        }
+        free(names);
+}
+
+static void copy_attrs(int in, int out, const struct stat *st) {
+        mode_t mode = st->st_mode & 07777;
+        // Without the original owner, setuid and setgid must not carry over
+        if (fchown(out, st->st_uid, st->st_gid) != 0) mode &= 0777;
+        // Changing the owner clears setuid bits, so chmod afterwards
+        fchmod(out, mode);
+        // Last, as changing the owner drops security.capability
+        copy_xattrs(in, out);
+        struct timespec times[2] = { st->st_atim, st->st_mtim };
+        futimens(out, times);
+}
+
+static int link_into_place(int dst_fd, const char *tmp, const char *dst_name,
+                           int replace) {
+        if (replace) return renameat(dst_fd, tmp, dst_fd, dst_name);
+        if (renameat2(dst_fd, tmp, dst_fd, dst_name, RENAME_NOREPLACE) == 0)
+                return 0;
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+        // A hard link fails atomically when the name is taken
+        if (linkat(dst_fd, tmp, dst_fd, dst_name, 0) != 0) return -1;
+        unlinkat(dst_fd, tmp, 0);
+        return 0;
+}
+
+static void tmp_name(char *tmp, size_t len) {
+        snprintf(tmp, len, ".forg-%ld-%lu.tmp", (long)getpid(),
+                 __atomic_add_fetch(&tmp_counter, 1, __ATOMIC_RELAXED));
+}
+
+/*
+ * Give the unnamed file behind fd the name name in dst_fd, failing with
+ * EEXIST when it is taken
+*/
+static int link_unnamed(int fd, int dst_fd, const char *name) {
+        char proc[32];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        if (linkat(AT_FDCWD, proc, dst_fd, name, AT_SYMLINK_FOLLOW) == 0)
+                return 0;
+        // Without /proc, only allowed with CAP_DAC_READ_SEARCH
+        if (errno != ENOENT) return -1;
+        return linkat(fd, "", dst_fd, name, AT_EMPTY_PATH);
+}
+
+static int copy_symlink(int src_fd, const char *name, int dst_fd,
+                        const char *dst_name, int replace, SyncPolicy policy) {
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(src_fd, name, target, sizeof(target) - 1);
+        if (len < 0) return -1;
+        target[len] = '\0';
+
+        if (symlinkat(target, dst_fd, dst_name) != 0) {
+                if (errno != EEXIST || !replace) return -1;
+                if (unlinkat(dst_fd, dst_name, 0) != 0 ||
+                    symlinkat(target, dst_fd, dst_name) != 0)
+                        return -1;
+        }
+        if (policy != SYNC_NONE && fsync(dst_fd) != 0) return -1;
+        return unlinkat(src_fd, name, 0);
+}
+
+static unsigned long long elapsed_ns(const struct timespec *start) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec -
+               start->tv_nsec;
+}
+
+int copy_move(int src_fd, const char *name, int dst_fd, const char *dst_name,
+              int replace, SyncPolicy policy, CopyStats *stats) {
+        struct stat st;
+        if (fstatat(src_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+
+        // Cheap early check, link_into_place has the final word
+        if (!replace &&
+            faccessat(dst_fd, dst_name, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+                errno = EEXIST;
+                return -1;
+        }
+        if (S_ISLNK(st.st_mode)) {
+                return copy_symlink(src_fd, name, dst_fd, dst_name, replace,
+                                    policy);
+        }
+        if (!S_ISREG(st.st_mode)) {
+                errno = EXDEV;
+                return -1;
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        int in = openat(src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (in < 0) return -1;
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        // Unnamed until complete, so a crash can't leave a partial copy
+        char tmp[NAME_MAX + 1];
+        bool named = false; // tmp exists in dst_fd
+        int out = openat(dst_fd, ".", O_WRONLY | O_TMPFILE | O_CLOEXEC, 0600);
+        if (out < 0 && (errno == EOPNOTSUPP || errno == EISDIR ||
+                        errno == EINVAL)) {
+                tmp_name(tmp, sizeof(tmp));
+                out = openat(dst_fd, tmp,
+                             O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+                named = true;
+        }
+        if (out < 0) {
+                int err = errno;
+                close(in);
+                errno = err;
+                return -1;
+        }
+
+        unsigned long long copied = 0;
+        int err = copy_data(in, out, &copied);
+        if (!err) {
+                copy_attrs(in, out, &st);
+                if (policy != SYNC_NONE) err = fsync(out);
+        }
+        bool placed = false; // dst_name is the copy
+        if (!err && !named) {
+                // Replacing goes through a name that can be renamed over it
+                if (replace) {
+                        tmp_name(tmp, sizeof(tmp));
+                        err = link_unnamed(out, dst_fd, tmp);
+                        named = !err;
+                } else {
+                        err = link_unnamed(out, dst_fd, dst_name);
+                        placed = !err;
+                }
+        }
+        if (close(out) != 0 && !err) err = -1;
+        if (!err && !placed) {
+                err = link_into_place(dst_fd, tmp, dst_name, replace);
+                placed = !err;
+        }
+        // Without the directory entry on disk a crash would lose both
+        if (!err && policy != SYNC_NONE) err = fsync(dst_fd);
+
+        int saved = errno;
+        close(in);
+        if (err) {
+                if (placed)
+                        unlinkat(dst_fd, dst_name, 0);
+                else if (named)
+                        unlinkat(dst_fd, tmp, 0);
+                errno = saved;
+                return -1;
+        }
+
+        // The copy is in place, only now let go of the source. When it
+        // stays, so must the file alone, not a second copy of it.
+        if (unlinkat(src_fd, name, 0) != 0 && errno != ENOENT) {
+                saved = errno;
+                unlinkat(dst_fd, dst_name, 0);
+                errno = saved;
+                return -1;
+        }
+        if (policy == SYNC_FULL) fsync(src_fd);
+
+        if (stats) {
+                __atomic_add_fetch(&stats->files, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&stats->bytes, copied, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&stats->nsec, elapsed_ns(&start),
+                                   __ATOMIC_RELAXED);
+        }
+        return 0;
+}
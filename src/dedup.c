@@ -0,0 +1,720 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dedup.h"
+#include "iobatch.h"
+
+#define HASH_MAGIC "FORGHASH"
+#define HASH_VERSION 2
+#define HASH_MAX_AGE 8 // Runs a record is kept without being used
+#define TABLE_INITIAL 1024
+#define PARTIAL_BLOCK 4096
+#define READ_CHUNK (1 << 20)
+#define STAT_BATCH 64
+
+#define HAVE_PARTIAL 0x1
+#define HAVE_FULL 0x2
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define C1 0x87c37b91114253d5ULL
+#define C2 0x4cf5ad432745937fULL
+
+/*
+ * Files of one size in a destination directory, chained through next
+*/
+typedef struct {
+        char *name;
+        uint64_t size;
+        long next;
+} DedupFile;
+
+struct DedupDir {
+        uint64_t dev;
+        uint64_t ino;
+        pthread_mutex_t lock;
+        DedupFile *files;
+        size_t count;
+        size_t cap;
+        uint64_t *sizes; // Size buckets, open addressing
+        long *heads; // First file of each bucket, -1 when empty
+        size_t mask;
+        size_t used;
+};
+
+typedef struct {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+        uint64_t count;
+} HashHeader;
+
+/*
+ * Streaming MurmurHash3 x64 128
+*/
+typedef struct {
+        uint64_t h1;
+        uint64_t h2;
+        unsigned char tail[16];
+        size_t tail_len;
+        uint64_t total;
+} Hasher;
+
+static uint64_t fmix64(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+}
+
+static void hasher_init(Hasher *h) {
+        memset(h, 0, sizeof(*h));
+}
+
+static void hasher_block(Hasher *h, const unsigned char *p) {
+        uint64_t k1, k2;
+        memcpy(&k1, p, 8);
+        memcpy(&k2, p + 8, 8);
+
+        k1 *= C1;
+        k1 = ROTL64(k1, 31);
+        k1 *= C2;
+        h->h1 ^= k1;
+        h->h1 = ROTL64(h->h1, 27);
+        h->h1 += h->h2;
+        h->h1 = h->h1 * 5 + 0x52dce729;
+
+        k2 *= C2;
+        k2 = ROTL64(k2, 33);
+        k2 *= C1;
+        h->h2 ^= k2;
+        h->h2 = ROTL64(h->h2, 31);
+        h->h2 += h->h1;
+        h->h2 = h->h2 * 5 + 0x38495ab5;
+}
+
+static void hasher_update(Hasher *h, const unsigned char *p, size_t len) {
+        h->total += len;
+        if (h->tail_len) {
+                size_t n = 16 - h->tail_len;
+                if (n > len) n = len;
+                memcpy(h->tail + h->tail_len, p, n);
+                h->tail_len += n;
+                p += n;
+                len -= n;
+                if (h->tail_len < 16) return;
+                hasher_block(h, h->tail);
+                h->tail_len = 0;
+        }
+        for (; len >= 16; p += 16, len -= 16) {
+                hasher_block(h, p);
+        }
+        memcpy(h->tail, p, len);
+        h->tail_len = len;
+}
+
+static Digest hasher_final(Hasher *h) {
+        uint64_t k1 = 0, k2 = 0;
+        for (size_t i = h->tail_len; i > 8; i--) {
+                k2 |= (uint64_t)h->tail[i - 1] << (8 * (i - 9));
+        }
+        for (size_t i = h->tail_len < 8 ? h->tail_len : 8; i > 0; i--) {
+                k1 |= (uint64_t)h->tail[i - 1] << (8 * (i - 1));
+        }
+        if (h->tail_len > 8) {
+                k2 *= C2;
+                k2 = ROTL64(k2, 33);
+                k2 *= C1;
+                h->h2 ^= k2;
+        }
+        if (h->tail_len > 0) {
+                k1 *= C1;
+                k1 = ROTL64(k1, 31);
+                k1 *= C2;
+                h->h1 ^= k1;
+        }
+
+        h->h1 ^= h->total;
+        h->h2 ^= h->total;
+        h->h1 += h->h2;
+        h->h2 += h->h1;
+        h->h1 = fmix64(h->h1);
+        h->h2 = fmix64(h->h2);
+        h->h1 += h->h2;
+        h->h2 += h->h1;
+
+        Digest d = { { h->h1, h->h2 } };
+        return d;
+}
+
+static int hash_range(int fd, off_t off, size_t len, Hasher *h,
+                      unsigned char *buf, size_t buf_len) {
+        while (len > 0) {
+                size_t want = len < buf_len ? len : buf_len;
+                ssize_t n = pread(fd, buf, want, off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return -1;
+                hasher_update(h, buf, n);
+                off += n;
+                len -= n;
+        }
+        return 0;
+}
+
+static int digest_partial(int fd, uint64_t size, Digest *out) {
+        unsigned char buf[PARTIAL_BLOCK];
+        Hasher h;
+        hasher_init(&h);
+        if (size <= 2 * PARTIAL_BLOCK) {
+                if (hash_range(fd, 0, size, &h, buf, sizeof(buf)) != 0)
+                        return -1;
+        } else {
+                if (hash_range(fd, 0, PARTIAL_BLOCK, &h, buf, sizeof(buf)) !=
+                            0 ||
+                    hash_range(fd, size - PARTIAL_BLOCK, PARTIAL_BLOCK, &h,
+                               buf, sizeof(buf)) != 0)
+                        return -1;
+        }
+        *out = hasher_final(&h);
+        return 0;
+}
+
+static int digest_full(int fd, uint64_t size, Digest *out) {
+        unsigned char *buf = malloc(READ_CHUNK);
+        if (!buf) return -1;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        Hasher h;
+        hasher_init(&h);
+        int err = hash_range(fd, 0, size, &h, buf, READ_CHUNK);
+        free(buf);
+        if (err) return -1;
+        *out = hasher_final(&h);
+        return 0;
+}
+
+static uint64_t mix_key(uint64_t dev, uint64_t ino) {
+        return fmix64(dev * 31 + ino);
+}
+
+static HashRecord *record_probe(const Dedup *dedup, const struct stat *st) {
+        uint64_t i = mix_key(st->st_dev, st->st_ino) & dedup->mask;
+        for (;;) {
+                HashRecord *r = &dedup->records[i];
+                if (r->flags == 0) return r;
+                if (r->dev == (uint64_t)st->st_dev &&
+                    r->ino == (uint64_t)st->st_ino)
+                        return r;
+                i = (i + 1) & dedup->mask;
+        }
+}
+
+static int records_grow(Dedup *dedup) {
+        uint32_t size = (dedup->mask + 1) * 2;
+        HashRecord *records = calloc(size, sizeof(*records));
+        if (!records) return -1;
+
+        for (uint32_t i = 0; i <= dedup->mask; i++) {
+                HashRecord *r = &dedup->records[i];
+                if (r->flags == 0) continue;
+                uint64_t j = mix_key(r->dev, r->ino) & (size - 1);
+                while (records[j].flags != 0) j = (j + 1) & (size - 1);
+                records[j] = *r;
+        }
+        free(dedup->records);
+        dedup->records = records;
+        dedup->mask = size - 1;
+        return 0;
+}
+
+/*
+ * Whether a record still describes the file. The ctime can't be set back, so
+ * a reused inode whose mtime was preserved doesn't pass for the old file.
+*/
+static int record_matches(const HashRecord *r, const struct stat *st) {
+        return r->size == (uint64_t)st->st_size &&
+               r->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+               r->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec &&
+               r->ctime_sec == (int64_t)st->st_ctim.tv_sec &&
+               r->ctime_nsec == (uint32_t)st->st_ctim.tv_nsec;
+}
+
+/*
+ * Get the partial or full digest of fd, from the cache when possible
+*/
+static int file_digest(Dedup *dedup, int fd, const struct stat *st, int full,
+                       Digest *out) {
+        uint32_t want = full ? HAVE_FULL : HAVE_PARTIAL;
+
+        pthread_mutex_lock(&dedup->lock);
+        HashRecord *r = record_probe(dedup, st);
+        if (r->flags != 0 && record_matches(r, st) && (r->flags & want)) {
+                *out = full ? r->full : r->partial;
+                if (r->age != 0) {
+                        r->age = 0;
+                        dedup->dirty = 1;
+                }
+                pthread_mutex_unlock(&dedup->lock);
+                __atomic_add_fetch(&dedup->hits, 1, __ATOMIC_RELAXED);
+                return 0;
+        }
+        pthread_mutex_unlock(&dedup->lock);
+        __atomic_add_fetch(&dedup->misses, 1, __ATOMIC_RELAXED);
+
+        // Hash without holding the lock, other workers keep going
+        Digest d;
+        uint64_t size = st->st_size;
+        if (full ? digest_full(fd, size, &d) : digest_partial(fd, size, &d))
+                return -1;
+
+        pthread_mutex_lock(&dedup->lock);
+        r = record_probe(dedup, st);
+        if (r->flags == 0 || !record_matches(r, st)) {
+                if (r->flags == 0) dedup->count++;
+                r->dev = st->st_dev;
+                r->ino = st->st_ino;
+                r->size = size;
+                r->mtime_sec = st->st_mtim.tv_sec;
+                r->mtime_nsec = st->st_mtim.tv_nsec;
+                r->ctime_sec = st->st_ctim.tv_sec;
+                r->ctime_nsec = st->st_ctim.tv_nsec;
+                r->flags = 0;
+        }
+        r->age = 0;
+        if (full) {
+                r->full = d;
+        } else {
+                r->partial = d;
+        }
+        r->flags |= want;
+        // Small files are read whole by the partial digest
+        if (!full && size <= 2 * PARTIAL_BLOCK) {
+                r->full = d;
+                r->flags |= HAVE_FULL;
+        }
+        dedup->dirty = 1;
+        if (dedup->count * 2 > dedup->mask) records_grow(dedup);
+        pthread_mutex_unlock(&dedup->lock);
+
+        *out = d;
+        return 0;
+}
+
+static int digest_equal(Digest a, Digest b) {
+        return a.h[0] == b.h[0] && a.h[1] == b.h[1];
+}
+
+static int dir_add(DedupDir *dir, const char *name, uint64_t size) {
+        if (dir->count == dir->cap) {
+                size_t cap = dir->cap ? dir->cap * 2 : 64;
+                DedupFile *files = realloc(dir->files, cap * sizeof(*files));
+                if (!files) return -1;
+                dir->files = files;
+                dir->cap = cap;
+        }
+        if ((dir->used + 1) * 2 > dir->mask + 1) {
+                size_t size_n = (dir->mask + 1) * 2;
+                uint64_t *sizes = calloc(size_n, sizeof(*sizes));
+                long *heads = malloc(size_n * sizeof(*heads));
+                if (!sizes || !heads) {
+                        free(sizes);
+                        free(heads);
+                        return -1;
+                }
+                for (size_t i = 0; i < size_n; i++) heads[i] = -1;
+                for (size_t i = 0; i <= dir->mask; i++) {
+                        if (dir->heads[i] < 0) continue;
+                        size_t j = fmix64(dir->sizes[i]) & (size_n - 1);
+                        while (heads[j] >= 0) j = (j + 1) & (size_n - 1);
+                        sizes[j] = dir->sizes[i];
+                        heads[j] = dir->heads[i];
+                }
+                free(dir->sizes);
+                free(dir->heads);
+                dir->sizes = sizes;
+                dir->heads = heads;
+                dir->mask = size_n - 1;
+        }
+
+        char *copy = strdup(name);
+        if (!copy) return -1;
+
+        size_t i = fmix64(size) & dir->mask;
+        while (dir->heads[i] >= 0 && dir->sizes[i] != size) {
+                i = (i + 1) & dir->mask;
+        }
+        if (dir->heads[i] < 0) dir->used++;
+
+        DedupFile *f = &dir->files[dir->count];
+        f->name = copy;
+        f->size = size;
+        f->next = dir->heads[i];
+        dir->sizes[i] = size;
+        dir->heads[i] = dir->count++;
+        return 0;
+}
+
+static long dir_bucket(const DedupDir *dir, uint64_t size) {
+        size_t i = fmix64(size) & dir->mask;
+        while (dir->heads[i] >= 0) {
+                if (dir->sizes[i] == size) return dir->heads[i];
+                i = (i + 1) & dir->mask;
+        }
+        return -1;
+}
+
+static void dir_free(DedupDir *dir) {
+        for (size_t i = 0; i < dir->count; i++) {
+                free(dir->files[i].name);
+        }
+        free(dir->files);
+        free(dir->sizes);
+        free(dir->heads);
+        pthread_mutex_destroy(&dir->lock);
+        free(dir);
+}
+
+/*
+ * Stat a batch of names found in dst_fd and bucket the regular files,
+ * consuming the names
+*/
+static void dir_stat(DedupDir *dir, int dst_fd, char **names, size_t n) {
+        struct statx stx[STAT_BATCH];
+        IoOp ops[STAT_BATCH];
+        memset(ops, 0, n * sizeof(*ops));
+        for (size_t i = 0; i < n; i++) {
+                ops[i].kind = IO_STATX;
+                ops[i].fd = dst_fd;
+                ops[i].path = names[i];
+                ops[i].flags = AT_SYMLINK_NOFOLLOW;
+                ops[i].stx = &stx[i];
+        }
+        io_run(ops, n);
+        for (size_t i = 0; i < n; i++) {
+                if (ops[i].res == 0 && S_ISREG(stx[i].stx_mode) &&
+                    stx[i].stx_size > 0)
+                        dir_add(dir, names[i], stx[i].stx_size);
+                free(names[i]);
+        }
+}
+
+static DedupDir *dir_new(int dst_fd, const struct stat *st) {
+        DedupDir *dir = calloc(1, sizeof(*dir));
+        if (!dir) return NULL;
+        dir->dev = st->st_dev;
+        dir->ino = st->st_ino;
+        dir->mask = 15;
+        dir->sizes = calloc(dir->mask + 1, sizeof(*dir->sizes));
+        dir->heads = malloc((dir->mask + 1) * sizeof(*dir->heads));
+        pthread_mutex_init(&dir->lock, NULL);
+        if (!dir->sizes || !dir->heads) {
+                dir_free(dir);
+                return NULL;
+        }
+        for (size_t i = 0; i <= dir->mask; i++) dir->heads[i] = -1;
+
+        int fd = openat(dst_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+        if (!d) {
+                if (fd >= 0) close(fd);
+                return dir;
+        }
+        char *names[STAT_BATCH];
+        size_t n = 0;
+        struct dirent *entry;
+        do {
+                entry = readdir(d);
+                if (entry && entry->d_type != DT_REG &&
+                    entry->d_type != DT_UNKNOWN)
+                        continue;
+                if (entry && (names[n] = strdup(entry->d_name))) n++;
+                if (n == STAT_BATCH || (!entry && n > 0)) {
+                        dir_stat(dir, dst_fd, names, n);
+                        n = 0;
+                }
+        } while (entry);
+        closedir(d);
+        return dir;
+}
+
+/*
+ * Find the size buckets of a directory, or the free slot i it would take
+*/
+static DedupDir *dir_probe(const Dedup *dedup, const struct stat *st,
+                           uint32_t *i) {
+        *i = mix_key(st->st_dev, st->st_ino) & dedup->dirs_mask;
+        DedupDir *dir;
+        while ((dir = dedup->dirs[*i])) {
+                if (dir->dev == (uint64_t)st->st_dev &&
+                    dir->ino == (uint64_t)st->st_ino)
+                        return dir;
+                *i = (*i + 1) & dedup->dirs_mask;
+        }
+        return NULL;
+}
+
+/*
+ * Find the size buckets of the directory behind dst_fd, reading it the first
+ * time it's seen
+*/
+static DedupDir *dedup_dir(Dedup *dedup, int dst_fd) {
+        struct stat st;
+        if (fstat(dst_fd, &st) != 0) return NULL;
+
+        pthread_mutex_lock(&dedup->lock);
+        uint32_t i;
+        DedupDir *dir = dir_probe(dedup, &st, &i);
+        if (dir) {
+                pthread_mutex_unlock(&dedup->lock);
+                return dir;
+        }
+        pthread_mutex_unlock(&dedup->lock);
+
+        // Read without holding the lock, other directories keep going
+        DedupDir *read = dir_new(dst_fd, &st);
+        if (!read) return NULL;
+
+        pthread_mutex_lock(&dedup->lock);
+        dir = dir_probe(dedup, &st, &i);
+        if (dir) {
+                // Another worker read it meanwhile
+                dir_free(read);
+        } else {
+                dir = read;
+                dedup->dirs[i] = dir;
+                dedup->dirs_count++;
+        }
+        if (dir && dedup->dirs_count * 2 > dedup->dirs_mask) {
+                uint32_t size = (dedup->dirs_mask + 1) * 2;
+                DedupDir **dirs = calloc(size, sizeof(*dirs));
+                if (dirs) {
+                        for (uint32_t j = 0; j <= dedup->dirs_mask; j++) {
+                                DedupDir *d = dedup->dirs[j];
+                                if (!d) continue;
+                                uint64_t k = mix_key(d->dev, d->ino) &
+                                             (size - 1);
+                                while (dirs[k]) k = (k + 1) & (size - 1);
+                                dirs[k] = d;
+                        }
+                        free(dedup->dirs);
+                        dedup->dirs = dirs;
+                        dedup->dirs_mask = size - 1;
+                }
+        }
+        pthread_mutex_unlock(&dedup->lock);
+        return dir;
+}
+
+int dedup_init(Dedup *dedup) {
+        memset(dedup, 0, sizeof(*dedup));
+        dedup->records = calloc(TABLE_INITIAL, sizeof(*dedup->records));
+        dedup->dirs = calloc(64, sizeof(*dedup->dirs));
+        if (!dedup->records || !dedup->dirs) {
+                free(dedup->records);
+                free(dedup->dirs);
+                return -1;
+        }
+        dedup->mask = TABLE_INITIAL - 1;
+        dedup->dirs_mask = 63;
+        pthread_mutex_init(&dedup->lock, NULL);
+        return 0;
+}
+
+void dedup_free(Dedup *dedup) {
+        for (uint32_t i = 0; dedup->dirs && i <= dedup->dirs_mask; i++) {
+                if (dedup->dirs[i]) dir_free(dedup->dirs[i]);
+        }
+        free(dedup->dirs);
+        free(dedup->records);
+        pthread_mutex_destroy(&dedup->lock);
+        memset(dedup, 0, sizeof(*dedup));
+}
+
+int dedup_load(Dedup *dedup, const char *path) {
+        FILE *fp = fopen(path, "rb");
+        if (!fp) return errno == ENOENT ? 0 : -1;
+
+        HashHeader hdr;
+        if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            memcmp(hdr.magic, HASH_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != HASH_VERSION ||
+            hdr.record_size != sizeof(HashRecord)) {
+                fclose(fp);
+                return 0;
+        }
+
+        HashRecord r;
+        for (uint64_t n = 0; n < hdr.count; n++) {
+                if (fread(&r, sizeof(r), 1, fp) != 1) break;
+                if (r.flags == 0) continue;
+                struct stat st;
+                st.st_dev = r.dev;
+                st.st_ino = r.ino;
+                HashRecord *slot = record_probe(dedup, &st);
+                if (slot->flags == 0) dedup->count++;
+                *slot = r;
+                // Aged out on save unless this run uses it
+                slot->age++;
+                dedup->dirty = 1;
+                if (dedup->count * 2 > dedup->mask &&
+                    records_grow(dedup) != 0)
+                        break;
+        }
+        fclose(fp);
+        return 0;
+}
+
+int dedup_save(Dedup *dedup, const char *path) {
+        if (!dedup->dirty) return 0;
+
+        // Named after the process, so concurrent runs don't share it
+        size_t len = strlen(path) + 32;
+        char *tmp = malloc(len);
+        if (!tmp) return -1;
+        snprintf(tmp, len, "%s.%ld.tmp", path, (long)getpid());
+
+        FILE *fp = fopen(tmp, "wb");
+        if (!fp) {
+                free(tmp);
+                return -1;
+        }
+        HashHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, HASH_MAGIC, sizeof(hdr.magic));
+        hdr.version = HASH_VERSION;
+        hdr.record_size = sizeof(HashRecord);
+        for (uint32_t i = 0; i <= dedup->mask; i++) {
+                const HashRecord *r = &dedup->records[i];
+                if (r->flags != 0 && r->age < HASH_MAX_AGE) hdr.count++;
+        }
+
+        int err = fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+        for (uint32_t i = 0; !err && i <= dedup->mask; i++) {
+                const HashRecord *r = &dedup->records[i];
+                if (r->flags == 0 || r->age >= HASH_MAX_AGE) continue;
+                err = fwrite(&dedup->records[i], sizeof(HashRecord), 1, fp) !=
+                      1;
+        }
+        if (fclose(fp) != 0) err = 1;
+        if (!err) err = rename(tmp, path) != 0;
+        if (err) unlink(tmp);
+        free(tmp);
+        if (!err) dedup->dirty = 0;
+        return err ? -1 : 0;
+}
+
+/*
+ * Compare two open files of size bytes, byte for byte
+*/
+static int same_bytes(int a, int b, uint64_t size) {
+        unsigned char *buf = malloc(2 * READ_CHUNK);
+        if (!buf) return 0;
+        posix_fadvise(a, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(b, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        int same = 1;
+        for (off_t off = 0; same && (uint64_t)off < size;) {
+                size_t want = size - off < READ_CHUNK ? size - off : READ_CHUNK;
+                ssize_t na = pread(a, buf, want, off);
+                ssize_t nb = na > 0 ? pread(b, buf + READ_CHUNK, na, off) : -1;
+                if ((na < 0 && errno == EINTR) || (nb < 0 && errno == EINTR))
+                        continue;
+                // Either changed size meanwhile, or can't be read
+                if (na <= 0 || nb != na) {
+                        same = 0;
+                        break;
+                }
+                same = memcmp(buf, buf + READ_CHUNK, na) == 0;
+                off += na;
+        }
+        free(buf);
+        return same;
+}
+
+/*
+ * Compare the open source against a candidate of the same size. Digests
+ * only rule candidates out, a match is confirmed by comparing the bytes.
+*/
+static int same_content(Dedup *dedup, int src, const struct stat *st,
+                        int dst_fd, const char *cand) {
+        int fd = openat(dst_fd, cand, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) return 0;
+
+        struct stat cst;
+        Digest a, b;
+        int same = 0;
+        if (fstat(fd, &cst) != 0 || !S_ISREG(cst.st_mode) ||
+            cst.st_size != st->st_size)
+                goto out;
+        // The very same file, e.g. a hard link
+        if (cst.st_dev == st->st_dev && cst.st_ino == st->st_ino) goto out;
+
+        if (file_digest(dedup, src, st, 0, &a) != 0 ||
+            file_digest(dedup, fd, &cst, 0, &b) != 0 || !digest_equal(a, b))
+                goto out;
+        if (file_digest(dedup, src, st, 1, &a) != 0 ||
+            file_digest(dedup, fd, &cst, 1, &b) != 0 || !digest_equal(a, b))
+                goto out;
+        same = same_bytes(src, fd, st->st_size);
+out:
+        close(fd);
+        return same;
+}
+
+int dedup_find(Dedup *dedup, int dst_fd, int src_fd, const char *name,
+               const struct stat *st, char *match, size_t match_len) {
+        if (!S_ISREG(st->st_mode) || st->st_size == 0) return 0;
+
+        DedupDir *dir = dedup_dir(dedup, dst_fd);
+        if (!dir) return 0;
+
+        // Copy the candidates out, the bucket may grow while we hash
+        pthread_mutex_lock(&dir->lock);
+        size_t ncand = 0;
+        for (long i = dir_bucket(dir, st->st_size); i >= 0;
+             i = dir->files[i].next)
+                ncand++;
+        char **cands = ncand ? malloc(ncand * sizeof(*cands)) : NULL;
+        size_t n = 0;
+        for (long i = dir_bucket(dir, st->st_size); cands && i >= 0;
+             i = dir->files[i].next) {
+                cands[n] = strdup(dir->files[i].name);
+                if (cands[n]) n++;
+        }
+        pthread_mutex_unlock(&dir->lock);
+        if (n == 0) {
+                free(cands);
+                return 0;
+        }
+
+        int found = 0;
+        int src = openat(src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        for (size_t i = 0; src >= 0 && i < n && !found; i++) {
+                if (same_content(dedup, src, st, dst_fd, cands[i])) {
+                        snprintf(match, match_len, "%s", cands[i]);
+                        found = 1;
+                }
+        }
+        if (src >= 0) close(src);
+        for (size_t i = 0; i < n; i++) {
+                free(cands[i]);
+        }
+        free(cands);
+        return found;
+}
+
+void dedup_add(Dedup *dedup, int dst_fd, const char *name,
+               const struct stat *st) {
+        if (!S_ISREG(st->st_mode) || st->st_size == 0) return;
+
+        DedupDir *dir = dedup_dir(dedup, dst_fd);
+        if (!dir) return;
+        pthread_mutex_lock(&dir->lock);
+        dir_add(dir, name, st->st_size);
+        pthread_mutex_unlock(&dir->lock);
+}
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dircache.h"
+#include "iobatch.h"
+
+#define CACHE_INITIAL 64
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+static uint32_t hash_str(uint32_t h, const char *str) {
+        for (; *str; str++) {
+                h ^= (unsigned char)*str;
+                h *= FNV_PRIME;
+        }
+        return h;
+}
+
+static uint32_t hash_dir(const char *root, const char *subdir) {
+        return hash_str(hash_str(hash_str(FNV_OFFSET, root), "/"), subdir);
+}
+
+static DirEntry **cache_probe(const DirCache *cache, const char *root,
+                              const char *subdir, uint32_t hash) {
+        uint32_t i = hash & cache->mask;
+        for (;;) {
+                DirEntry **slot = &cache->slots[i];
+                DirEntry *e = *slot;
+                if (!e) return slot;
+                if (e->hash == hash && strcmp(e->subdir, subdir) == 0 &&
+                    strcmp(e->root, root) == 0)
+                        return slot;
+                i = (i + 1) & cache->mask;
+        }
+}
+
+static int cache_grow(DirCache *cache) {
+        uint32_t size = (cache->mask + 1) * 2;
+        DirEntry **slots = calloc(size, sizeof(*slots));
+        if (!slots) return -1;
+
+        for (uint32_t i = 0; i <= cache->mask; i++) {
+                DirEntry *e = cache->slots[i];
+                if (!e) continue;
+                uint32_t j = e->hash & (size - 1);
+                while (slots[j]) j = (j + 1) & (size - 1);
+                slots[j] = e;
+        }
+        free(cache->slots);
+        cache->slots = slots;
+        cache->mask = size - 1;
+        return 0;
+}
+
+static void cache_retire(DirCache *cache, int fd) {
+        if (cache->retired_count == cache->retired_cap) {
+                size_t cap = cache->retired_cap ? cache->retired_cap * 2 : 16;
+                int *retired = realloc(cache->retired, cap * sizeof(*retired));
+                // Leaking the descriptor beats closing it under a worker
+                if (!retired) return;
+                cache->retired = retired;
+                cache->retired_cap = cap;
+        }
+        cache->retired[cache->retired_count++] = fd;
+}
+
+/*
+ * Find or open root/subdir, the write lock must be held
+*/
+static int cache_open(DirCache *cache, const char *root, const char *subdir) {
+        uint32_t hash = hash_dir(root, subdir);
+        DirEntry **slot = cache_probe(cache, root, subdir, hash);
+        if (*slot && (*slot)->fd >= 0) return (*slot)->fd;
+
+        int fd;
+        if (*subdir == '\0') {
+                fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        } else {
+                int root_fd = cache_open(cache, root, "");
+                if (root_fd >= 0 && dircache_stale(root_fd)) {
+                        uint32_t root_hash = hash_dir(root, "");
+                        DirEntry *r = *cache_probe(cache, root, "", root_hash);
+                        cache_retire(cache, root_fd);
+                        r->fd = -1;
+                        root_fd = cache_open(cache, root, "");
+                }
+                if (root_fd < 0) return -1;
+                fd = ensure_directory(root_fd, subdir);
+                // The root entry may have grown the table
+                slot = cache_probe(cache, root, subdir, hash);
+        }
+        if (fd < 0) return -1;
+
+        if (*slot) {
+                (*slot)->fd = fd;
+                return fd;
+        }
+
+        DirEntry *e = malloc(sizeof(*e));
+        if (e) {
+                e->root = strdup(root);
+                e->subdir = strdup(subdir);
+        }
+        if (!e || !e->root || !e->subdir) {
+                if (e) {
+                        free(e->root);
+                        free(e->subdir);
+                }
+                free(e);
+                close(fd);
+                errno = ENOMEM;
+                return -1;
+        }
+        e->hash = hash;
+        e->fd = fd;
+        *slot = e;
+        cache->count++;
+        if (cache->count * 2 > cache->mask) cache_grow(cache);
+        return fd;
+}
+
+int dircache_init(DirCache *cache) {
+        memset(cache, 0, sizeof(*cache));
+        cache->slots = calloc(CACHE_INITIAL, sizeof(*cache->slots));
+        if (!cache->slots) return -1;
+        cache->mask = CACHE_INITIAL - 1;
+        pthread_rwlock_init(&cache->lock, NULL);
+        return 0;
+}
+
+void dircache_free(DirCache *cache) {
+        for (uint32_t i = 0; cache->slots && i <= cache->mask; i++) {
+                DirEntry *e = cache->slots[i];
+                if (!e) continue;
+                if (e->fd >= 0) close(e->fd);
+                free(e->root);
+                free(e->subdir);
+                free(e);
+        }
+        for (size_t i = 0; i < cache->retired_count; i++) {
+                close(cache->retired[i]);
+        }
+        free(cache->slots);
+        free(cache->retired);
+        pthread_rwlock_destroy(&cache->lock);
+        memset(cache, 0, sizeof(*cache));
+}
+
+int dircache_get(DirCache *cache, const char *root, const char *subdir) {
+        uint32_t hash = hash_dir(root, subdir);
+
+        pthread_rwlock_rdlock(&cache->lock);
+        DirEntry *e = *cache_probe(cache, root, subdir, hash);
+        int fd = e ? e->fd : -1;
+        pthread_rwlock_unlock(&cache->lock);
+        if (fd >= 0) {
+                __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+                return fd;
+        }
+
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_wrlock(&cache->lock);
+        fd = cache_open(cache, root, subdir);
+        int err = errno;
+        pthread_rwlock_unlock(&cache->lock);
+        errno = err;
+        return fd;
+}
+
+void dircache_invalidate(DirCache *cache, const char *root,
+                         const char *subdir, int fd) {
+        uint32_t hash = hash_dir(root, subdir);
+
+        pthread_rwlock_wrlock(&cache->lock);
+        DirEntry *e = *cache_probe(cache, root, subdir, hash);
+        // Someone else may have replaced it already
+        if (e && e->fd == fd) {
+                cache_retire(cache, fd);
+                e->fd = -1;
+        }
+        pthread_rwlock_unlock(&cache->lock);
+}
+
+int dircache_stale(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) return 1;
+        return st.st_nlink == 0;
+}
+
+int ensure_directory(int root_fd, const char *subdir) {
+        char path[PATH_MAX];
+        size_t len = 0;
+        size_t depth = 0;
+        const char *p = subdir;
+
+        // Drop empty and "." components so every prefix is a clean path
+        // relative to root_fd
+        while (*p) {
+                const char *end = strchr(p, '/');
+                size_t n = end ? (size_t)(end - p) : strlen(p);
+                if (n > NAME_MAX) {
+                        errno = ENAMETOOLONG;
+                        return -1;
+                }
+                if (n > 0 && !(n == 1 && *p == '.')) {
+                        if (len + n + 2 > sizeof(path)) {
+                                errno = ENAMETOOLONG;
+                                return -1;
+                        }
+                        if (len) path[len++] = '/';
+                        memcpy(path + len, p, n);
+                        len += n;
+                        depth++;
+                }
+                p += end ? n + 1 : n;
+        }
+        path[len] = '\0';
+        if (depth == 0) return dup(root_fd);
+
+        // One mkdir per prefix, each waiting for its parent
+        char *prefixes = malloc(depth * (len + 1));
+        IoOp *ops = calloc(depth, sizeof(*ops));
+        if (!prefixes || !ops) {
+                free(prefixes);
+                free(ops);
+                errno = ENOMEM;
+                return -1;
+        }
+        size_t k = 0;
+        for (size_t i = 0; i <= len; i++) {
+                if (path[i] != '/' && path[i] != '\0') continue;
+                char *prefix = prefixes + k * (len + 1);
+                memcpy(prefix, path, i);
+                prefix[i] = '\0';
+                ops[k].kind = IO_MKDIR;
+                ops[k].after = k > 0;
+                ops[k].fd = root_fd;
+                ops[k].path = prefix;
+                ops[k].mode = 0700;
+                k++;
+        }
+        io_run(ops, depth);
+
+        int err = 0;
+        for (size_t i = 0; i < depth && !err; i++) {
+                // Another process may have just created it
+                if (ops[i].res != 0 && ops[i].res != -EEXIST) err = -ops[i].res;
+        }
+        free(prefixes);
+        free(ops);
+        if (err) {
+                errno = err;
+                return -1;
+        }
+        return openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
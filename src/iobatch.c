@@ -0,0 +1,306 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "iobatch.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Not a valid result, marks operations that haven't completed
+#define IO_PENDING 1
+
+static int uring_wanted = 0;
+static unsigned ring_depth = 64;
+
+static int run_sync(IoOp *op) {
+        int err = 0;
+        switch (op->kind) {
+        case IO_MKDIR:
+                err = mkdirat(op->fd, op->path, op->mode);
+                break;
+        case IO_RENAME:
+                err = renameat2(op->fd, op->path, op->new_fd, op->new_path,
+                                op->flags);
+                break;
+        case IO_UNLINK:
+                err = unlinkat(op->fd, op->path, op->flags);
+                break;
+        case IO_STATX:
+                err = statx(op->fd, op->path, op->flags, STATX_BASIC_STATS,
+                            op->stx);
+                break;
+        }
+        return err ? -errno : 0;
+}
+
+#ifdef HAVE_IO_URING
+typedef struct {
+        int fd;
+        unsigned entries;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        struct io_uring_sqe *sqes;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+        void *sq_ptr;
+        void *cq_ptr;
+        size_t sq_len;
+        size_t cq_len;
+        size_t sqes_len;
+} Ring;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+// Set when a thread failed to get a ring, so others don't keep trying
+static int ring_broken = 0;
+
+static const unsigned char ring_ops[] = {
+        [IO_MKDIR] = IORING_OP_MKDIRAT,
+        [IO_RENAME] = IORING_OP_RENAMEAT,
+        [IO_UNLINK] = IORING_OP_UNLINKAT,
+        [IO_STATX] = IORING_OP_STATX,
+};
+
+static void ring_free(void *data) {
+        Ring *ring = data;
+        if (!ring) return;
+        if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+        if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+                munmap(ring->cq_ptr, ring->cq_len);
+        if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_len);
+        if (ring->fd >= 0) close(ring->fd);
+        free(ring);
+}
+
+static void ring_key_init(void) {
+        pthread_key_create(&ring_key, ring_free);
+}
+
+/*
+ * Check that the kernel knows every operation we may submit
+*/
+static int ring_probe(int fd) {
+        size_t len = sizeof(struct io_uring_probe) +
+                     256 * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe *probe = calloc(1, len);
+        if (!probe) return -1;
+
+        int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                         probe, 256) == 0;
+        for (size_t i = 0; ok && i < sizeof(ring_ops); i++) {
+                unsigned op = ring_ops[i];
+                ok = op <= probe->last_op &&
+                     (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        }
+        free(probe);
+        return ok ? 0 : -1;
+}
+
+static Ring *ring_new(unsigned depth) {
+        Ring *ring = calloc(1, sizeof(*ring));
+        if (!ring) return NULL;
+
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring->fd = syscall(__NR_io_uring_setup, depth, &p);
+        if (ring->fd < 0 || ring_probe(ring->fd) != 0) goto fail;
+
+        ring->entries = p.sq_entries;
+        ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_len =
+                p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+                ring->cq_len = ring->sq_len;
+        }
+        ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_SQ_RING);
+        if (ring->sq_ptr == MAP_FAILED) {
+                ring->sq_ptr = NULL;
+                goto fail;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ptr = ring->sq_ptr;
+        } else {
+                ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, ring->fd,
+                                    IORING_OFF_CQ_RING);
+                if (ring->cq_ptr == MAP_FAILED) {
+                        ring->cq_ptr = NULL;
+                        goto fail;
+                }
+        }
+        ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+                ring->sqes = NULL;
+                goto fail;
+        }
+
+        char *sq = ring->sq_ptr;
+        char *cq = ring->cq_ptr;
+        ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+        ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+        ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+        ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+        return ring;
+fail:
+        ring_free(ring);
+        return NULL;
+}
+
+static Ring *ring_get(void) {
+        if (!uring_wanted || __atomic_load_n(&ring_broken, __ATOMIC_RELAXED))
+                return NULL;
+
+        pthread_once(&ring_once, ring_key_init);
+        Ring *ring = pthread_getspecific(ring_key);
+        if (ring) return ring;
+
+        ring = ring_new(ring_depth);
+        if (!ring) {
+                __atomic_store_n(&ring_broken, 1, __ATOMIC_RELAXED);
+                return NULL;
+        }
+        pthread_setspecific(ring_key, ring);
+        return ring;
+}
+
+static void ring_prep(struct io_uring_sqe *sqe, const IoOp *op, size_t index) {
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = ring_ops[op->kind];
+        sqe->fd = op->fd;
+        sqe->addr = (unsigned long)op->path;
+        sqe->user_data = index;
+        switch (op->kind) {
+        case IO_MKDIR:
+                sqe->len = op->mode;
+                break;
+        case IO_RENAME:
+                sqe->len = op->new_fd;
+                sqe->addr2 = (unsigned long)op->new_path;
+                sqe->rename_flags = op->flags;
+                break;
+        case IO_UNLINK:
+                sqe->unlink_flags = op->flags;
+                break;
+        case IO_STATX:
+                sqe->len = STATX_BASIC_STATS;
+                sqe->off = (unsigned long)op->stx;
+                sqe->statx_flags = op->flags;
+                break;
+        }
+}
+
+/*
+ * Submit ops[0..n) and wait for all of them. n is at most the ring size.
+ *
+ * On failure, ops the kernel never took are left pending to be run
+ * synchronously. Those it took are waited for, and failed with EIO when
+ * they can't be, as they may have run already.
+*/
+static int ring_run(Ring *ring, IoOp *ops, size_t n) {
+        unsigned tail = *ring->sq_tail;
+        unsigned mask = *ring->sq_mask;
+        for (size_t i = 0; i < n; i++) {
+                unsigned idx = tail & mask;
+                ring_prep(&ring->sqes[idx], &ops[i], i);
+                // Chain to the next one within this submission
+                if (i + 1 < n && ops[i + 1].after)
+                        ring->sqes[idx].flags |= IOSQE_IO_HARDLINK;
+                ring->sq_array[idx] = idx;
+                tail++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        size_t submitted = 0;
+        size_t done = 0;
+        int failed = 0;
+        while (done < (failed ? submitted : n)) {
+                unsigned to_submit = failed ? 0 : n - submitted;
+                int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                                  IORING_ENTER_GETEVENTS, NULL, 0);
+                if (ret < 0) {
+                        if (errno == EINTR || errno == EAGAIN) continue;
+                        if (failed || done == submitted) break;
+                        // Stop submitting, but collect what is in flight
+                        failed = 1;
+                        continue;
+                }
+                submitted += ret;
+
+                unsigned head = *ring->cq_head;
+                unsigned cq_mask = *ring->cq_mask;
+                while (head != __atomic_load_n(ring->cq_tail,
+                                               __ATOMIC_ACQUIRE)) {
+                        struct io_uring_cqe *cqe = &ring->cqes[head & cq_mask];
+                        ops[cqe->user_data].res = cqe->res;
+                        head++;
+                        done++;
+                }
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+        for (size_t i = 0; i < submitted; i++) {
+                if (ops[i].res == IO_PENDING) ops[i].res = -EIO;
+        }
+        return done < n ? -1 : 0;
+}
+#endif
+
+void io_setup(int use_uring, unsigned depth) {
+        uring_wanted = use_uring;
+        if (depth > 0) ring_depth = depth;
+}
+
+void io_run(IoOp *ops, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+                ops[i].res = IO_PENDING;
+        }
+#ifdef HAVE_IO_URING
+        Ring *ring = ring_get();
+        for (size_t i = 0; ring && i < n;) {
+                size_t chunk = n - i;
+                if (chunk > ring->entries) chunk = ring->entries;
+                // Every chunk is waited for before the next is submitted, so
+                // dependencies across chunks hold without links
+                if (ring_run(ring, ops + i, chunk) != 0) {
+                        // Give up on io_uring, the rest runs synchronously
+                        __atomic_store_n(&ring_broken, 1, __ATOMIC_RELAXED);
+                        pthread_setspecific(ring_key, NULL);
+                        ring_free(ring);
+                        break;
+                }
+                i += chunk;
+        }
+#endif
+        for (size_t i = 0; i < n; i++) {
+                if (ops[i].res == IO_PENDING) ops[i].res = run_sync(&ops[i]);
+        }
+}
+
+const char *io_backend(void) {
+#ifdef HAVE_IO_URING
+        if (ring_get()) return "io_uring";
+#endif
+        return "sync";
+}
@@ -0,0 +1,351 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "journal.h"
+
+#define JOURNAL_MAGIC "FORGJRNL"
+#define JOURNAL_VERSION 2
+#define BUF_SIZE 65536
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/*
+ * Follows the plan, itself followed by cwd_len bytes of working directory
+*/
+typedef struct {
+        char magic[8];
+        uint32_t version;
+        uint32_t cwd_len;
+        uint32_t conflict;
+        uint32_t reserved;
+} JournalHeader;
+
+/*
+ * A record as written, followed by name_len bytes of name
+*/
+typedef struct {
+        uint32_t entry;
+        uint32_t check; // Of the record with check zeroed, and of the name
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtime_sec;
+        uint32_t mtime_nsec;
+        uint16_t name_len;
+        uint8_t action;
+        uint8_t intent;
+} DiskRecord;
+
+static uint32_t fnv(uint32_t h, const void *data, size_t len) {
+        const unsigned char *p = data;
+        for (size_t i = 0; i < len; i++) {
+                h ^= p[i];
+                h *= FNV_PRIME;
+        }
+        return h;
+}
+
+static uint32_t record_check(const DiskRecord *r, const char *name) {
+        DiskRecord copy = *r;
+        copy.check = 0;
+        return fnv(fnv(FNV_OFFSET, &copy, sizeof(copy)), name, r->name_len);
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+        const char *p = data;
+        while (len > 0) {
+                ssize_t n = write(fd, p, len);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                p += n;
+                len -= n;
+        }
+        return 0;
+}
+
+/*
+ * Prepare the parts shared by new and loaded journals
+*/
+static int journal_init(Journal *journal, size_t count, int nworkers,
+                        int durable) {
+        if (nworkers < 1) nworkers = 1;
+        journal->durable = durable;
+        journal->nworkers = nworkers;
+        journal->count = count;
+        journal->bufs = calloc(nworkers, sizeof(*journal->bufs));
+        journal->lens = calloc(nworkers, sizeof(*journal->lens));
+        journal->state = calloc(count ? count : 1, 1);
+        if (!journal->bufs || !journal->lens || !journal->state) return -1;
+        for (int i = 0; i < nworkers; i++) {
+                journal->bufs[i] = malloc(BUF_SIZE);
+                if (!journal->bufs[i]) return -1;
+        }
+        pthread_mutex_init(&journal->lock, NULL);
+        pthread_cond_init(&journal->synced_cond, NULL);
+        return 0;
+}
+
+static void journal_release(Journal *journal) {
+        for (int i = 0; journal->bufs && i < journal->nworkers; i++) {
+                free(journal->bufs[i]);
+        }
+        free(journal->bufs);
+        free(journal->lens);
+        free(journal->state);
+        free(journal->records);
+        free(journal->last);
+        free(journal->names);
+        free(journal->cwd);
+        if (journal->fd >= 0) close(journal->fd);
+        memset(journal, 0, sizeof(*journal));
+        journal->fd = -1;
+}
+
+int journal_create(Journal *journal, const char *path, const Plan *plan,
+                   unsigned conflict, int nworkers, int durable) {
+        memset(journal, 0, sizeof(*journal));
+        journal->fd = -1;
+        char cwd[PATH_MAX];
+        if (!getcwd(cwd, sizeof(cwd)) || plan_save(plan, path) != 0)
+                return -1;
+
+        journal->fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        JournalHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+        hdr.version = JOURNAL_VERSION;
+        hdr.cwd_len = strlen(cwd);
+        hdr.conflict = conflict;
+        journal->conflict = conflict;
+        if (journal->fd < 0 ||
+            journal_init(journal, plan->count, nworkers, durable) != 0 ||
+            write_all(journal->fd, &hdr, sizeof(hdr)) != 0 ||
+            write_all(journal->fd, cwd, hdr.cwd_len) != 0 ||
+            fdatasync(journal->fd) != 0 || !(journal->cwd = strdup(cwd))) {
+                int err = errno;
+                journal_release(journal);
+                errno = err;
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Read every valid record of buf into the journal
+*/
+static int parse_records(Journal *journal, const char *buf, size_t len,
+                         size_t *used) {
+        size_t max = len / sizeof(DiskRecord);
+        journal->records = malloc((max ? max : 1) * sizeof(JournalRecord));
+        journal->names = malloc(len + 1);
+        journal->last = malloc((journal->count ? journal->count : 1) *
+                               sizeof(*journal->last));
+        if (!journal->records || !journal->names || !journal->last) return -1;
+        for (size_t i = 0; i < journal->count; i++) {
+                journal->last[i] = SIZE_MAX;
+        }
+
+        size_t off = 0, names_len = 0;
+        while (len - off >= sizeof(DiskRecord)) {
+                DiskRecord r;
+                memcpy(&r, buf + off, sizeof(r));
+                const char *name = buf + off + sizeof(r);
+                if (r.name_len > len - off - sizeof(r) ||
+                    r.check != record_check(&r, name) ||
+                    r.entry >= journal->count || r.action == JOURNAL_NONE ||
+                    r.action > JOURNAL_PENDING || r.intent > JOURNAL_PENDING)
+                        break;
+
+                journal->last[r.entry] = journal->nrecords;
+                JournalRecord *rec = &journal->records[journal->nrecords++];
+                rec->entry = r.entry;
+                rec->action = r.action;
+                rec->intent = r.intent;
+                rec->dev = r.dev;
+                rec->ino = r.ino;
+                rec->size = r.size;
+                rec->mtime_sec = r.mtime_sec;
+                rec->mtime_nsec = r.mtime_nsec;
+                rec->name = NULL;
+                if (r.name_len) {
+                        rec->name = journal->names + names_len;
+                        memcpy(journal->names + names_len, name, r.name_len);
+                        names_len += r.name_len;
+                        journal->names[names_len++] = '\0';
+                }
+                journal->state[r.entry] = r.action;
+                off += sizeof(r) + r.name_len;
+        }
+        *used = off;
+        return 0;
+}
+
+int journal_load(Journal *journal, Plan *plan, const char *path,
+                 int nworkers, int durable, int readonly) {
+        memset(journal, 0, sizeof(*journal));
+        journal->fd = -1;
+        if (plan_load(plan, path) != 0) return -1;
+
+        char *buf = NULL;
+        off_t start = plan_saved_size(plan);
+        struct stat st;
+        JournalHeader hdr;
+        int err = EINVAL;
+        journal->fd = open(path, readonly ? O_RDONLY | O_CLOEXEC :
+                                            O_RDWR | O_APPEND | O_CLOEXEC);
+        if (journal->fd < 0 || fstat(journal->fd, &st) != 0 ||
+            journal_init(journal, plan->count, nworkers, durable) != 0) {
+                err = errno;
+                goto fail;
+        }
+        if (st.st_size < start + (off_t)sizeof(hdr) ||
+            pread(journal->fd, &hdr, sizeof(hdr), start) != sizeof(hdr) ||
+            memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != JOURNAL_VERSION || hdr.cwd_len >= PATH_MAX ||
+            st.st_size - start - (off_t)sizeof(hdr) < hdr.cwd_len)
+                goto fail;
+
+        // The working directory and every record, read at once
+        size_t len = st.st_size - start - sizeof(hdr);
+        buf = malloc(len + 1);
+        if (!buf) {
+                err = ENOMEM;
+                goto fail;
+        }
+        if (pread(journal->fd, buf, len, start + sizeof(hdr)) != (ssize_t)len) {
+                err = EIO;
+                goto fail;
+        }
+        journal->conflict = hdr.conflict;
+        journal->cwd = strndup(buf, hdr.cwd_len);
+        size_t used;
+        if (!journal->cwd || parse_records(journal, buf + hdr.cwd_len,
+                                           len - hdr.cwd_len, &used) != 0) {
+                err = ENOMEM;
+                goto fail;
+        }
+        free(buf);
+        buf = NULL;
+        journal->readonly = readonly;
+
+        // Appending after a torn record would hide what follows
+        off_t end = start + sizeof(hdr) + hdr.cwd_len + used;
+        if (!readonly && end < st.st_size &&
+            ftruncate(journal->fd, end) != 0) {
+                err = errno;
+                goto fail;
+        }
+        return 0;
+
+fail:
+        free(buf);
+        journal_release(journal);
+        plan_free(plan);
+        errno = err;
+        return -1;
+}
+
+/*
+ * Add a record to the buffer of a worker
+*/
+static void append(Journal *journal, int worker, size_t entry,
+                   JournalAction action, JournalAction intent,
+                   const char *name, const struct stat *st) {
+        size_t name_len = name ? strlen(name) : 0;
+        if (name_len > NAME_MAX) name_len = NAME_MAX;
+        if (journal->lens[worker] + sizeof(DiskRecord) + name_len > BUF_SIZE)
+                journal_commit(journal, worker);
+
+        DiskRecord r;
+        memset(&r, 0, sizeof(r));
+        r.entry = entry;
+        r.dev = st ? st->st_dev : 0;
+        r.ino = st ? st->st_ino : 0;
+        r.size = st ? st->st_size : 0;
+        r.mtime_sec = st ? st->st_mtim.tv_sec : 0;
+        r.mtime_nsec = st ? st->st_mtim.tv_nsec : 0;
+        r.name_len = name_len;
+        r.action = action;
+        r.intent = intent;
+        r.check = record_check(&r, name);
+
+        char *buf = journal->bufs[worker] + journal->lens[worker];
+        memcpy(buf, &r, sizeof(r));
+        if (name_len) memcpy(buf + sizeof(r), name, name_len);
+        journal->lens[worker] += sizeof(r) + name_len;
+        journal->state[entry] = action;
+}
+
+void journal_record(Journal *journal, int worker, size_t entry,
+                    JournalAction action, const char *name,
+                    const struct stat *st) {
+        append(journal, worker, entry, action, JOURNAL_NONE, name, st);
+}
+
+void journal_intent(Journal *journal, int worker, size_t entry,
+                    JournalAction intent, const char *name,
+                    const struct stat *st) {
+        append(journal, worker, entry, JOURNAL_PENDING, intent, name, st);
+}
+
+void journal_commit(Journal *journal, int worker) {
+        if (journal->lens[worker] == 0) return;
+        if (journal->readonly) {
+                journal->lens[worker] = 0;
+                return;
+        }
+
+        pthread_mutex_lock(&journal->lock);
+        if (write_all(journal->fd, journal->bufs[worker],
+                      journal->lens[worker]) != 0)
+                journal->failed = 1;
+        journal->lens[worker] = 0;
+        uint64_t mine = ++journal->written;
+
+        // Whoever syncs covers every commit written before it started
+        while (journal->durable && journal->synced < mine) {
+                if (journal->syncing) {
+                        pthread_cond_wait(&journal->synced_cond,
+                                          &journal->lock);
+                        continue;
+                }
+                journal->syncing = 1;
+                uint64_t upto = journal->written;
+                pthread_mutex_unlock(&journal->lock);
+                int err = fdatasync(journal->fd);
+                pthread_mutex_lock(&journal->lock);
+                if (err != 0) journal->failed = 1;
+                journal->synced = upto;
+                journal->syncing = 0;
+                pthread_cond_broadcast(&journal->synced_cond);
+        }
+        pthread_mutex_unlock(&journal->lock);
+}
+
+JournalAction journal_state(const Journal *journal, size_t entry) {
+        return entry < journal->count ? journal->state[entry] : JOURNAL_NONE;
+}
+
+const JournalRecord *journal_last(const Journal *journal, size_t entry) {
+        if (entry >= journal->count || !journal->last ||
+            journal->last[entry] == SIZE_MAX)
+                return NULL;
+        return &journal->records[journal->last[entry]];
+}
+
+int journal_close(Journal *journal) {
+        for (int i = 0; i < journal->nworkers; i++) {
+                journal_commit(journal, i);
+        }
+        int err = journal->failed ||
+                  (!journal->readonly && fdatasync(journal->fd) != 0);
+        pthread_mutex_destroy(&journal->lock);
+        pthread_cond_destroy(&journal->synced_cond);
+        journal_release(journal);
+        return err ? -1 : 0;
+}
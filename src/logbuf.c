@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "logbuf.h"
+
+#define BUF_SIZE (64 * 1024)
+#define RECORD_MAX (16 * 1024)
+#define MAX_QUEUED 64 // Full buffers waiting for the writer
+
+typedef struct LogBuf {
+        struct LogBuf *next;
+        size_t len;
+        char data[BUF_SIZE];
+} LogBuf;
+
+/*
+ * A record being formatted, cut short rather than overflowing
+*/
+typedef struct {
+        char data[RECORD_MAX];
+        size_t len;
+} Record;
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t ready; // Buffers were queued, or the writer must stop
+        pthread_cond_t drained; // The writer went through the queue
+        pthread_t thread;
+        LogBuf *head;
+        LogBuf *tail;
+        LogBuf *spare;
+        size_t queued;
+        int writing;
+        int stop;
+        LogBuf **bufs; // One per worker
+        int nworkers;
+        LogFormat format;
+        LogLevel level;
+} logger = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .ready = PTHREAD_COND_INITIALIZER,
+        .drained = PTHREAD_COND_INITIALIZER,
+};
+
+// Held while printfc writes a message of log_message
+static pthread_mutex_t message_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *level_names[] = { "fatal", "error", "warn", "info",
+                                     "debug" };
+
+static const char *action_names[] = {
+        "moved",      "exists",        "deleted",      "failed",
+        "would_move", "would_replace", "would_delete", "restored",
+        "would_restore",
+};
+
+static void write_all(int fd, const char *data, size_t len) {
+        while (len > 0) {
+                ssize_t n = write(fd, data, len);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return;
+                }
+                data += n;
+                len -= n;
+        }
+}
+
+static void *writer(void *arg) {
+        (void)arg;
+        pthread_mutex_lock(&logger.lock);
+        for (;;) {
+                while (!logger.head && !logger.stop)
+                        pthread_cond_wait(&logger.ready, &logger.lock);
+                if (!logger.head) break;
+
+                LogBuf *list = logger.head;
+                logger.head = logger.tail = NULL;
+                logger.queued = 0;
+                logger.writing = 1;
+                pthread_cond_broadcast(&logger.drained);
+                pthread_mutex_unlock(&logger.lock);
+
+                // Whatever the main thread printed before goes first
+                fflush(stdout);
+                LogBuf *last = list;
+                for (LogBuf *b = list; b; b = b->next) {
+                        write_all(STDOUT_FILENO, b->data, b->len);
+                        b->len = 0;
+                        last = b;
+                }
+
+                pthread_mutex_lock(&logger.lock);
+                last->next = logger.spare;
+                logger.spare = list;
+                logger.writing = 0;
+                pthread_cond_broadcast(&logger.drained);
+        }
+        pthread_mutex_unlock(&logger.lock);
+        return NULL;
+}
+
+int log_open(LogFormat format, LogLevel level, int nworkers) {
+        if (nworkers < 1) nworkers = 1;
+        logger.bufs = calloc(nworkers, sizeof(*logger.bufs));
+        if (!logger.bufs) return -1;
+        logger.nworkers = nworkers;
+        logger.format = format;
+        logger.level = level;
+        logger.stop = 0;
+        if (pthread_create(&logger.thread, NULL, writer, NULL) != 0) {
+                free(logger.bufs);
+                logger.bufs = NULL;
+                return -1;
+        }
+        return 0;
+}
+
+int log_enabled(LogLevel level) {
+        return level <= logger.level;
+}
+
+/*
+ * Queue a full buffer, waiting while the writer is too far behind
+*/
+static void submit(LogBuf *b) {
+        b->next = NULL;
+        pthread_mutex_lock(&logger.lock);
+        while (logger.queued >= MAX_QUEUED)
+                pthread_cond_wait(&logger.drained, &logger.lock);
+        if (logger.tail)
+                logger.tail->next = b;
+        else
+                logger.head = b;
+        logger.tail = b;
+        logger.queued++;
+        pthread_cond_signal(&logger.ready);
+        pthread_mutex_unlock(&logger.lock);
+}
+
+static LogBuf *take(void) {
+        pthread_mutex_lock(&logger.lock);
+        LogBuf *b = logger.spare;
+        if (b) logger.spare = b->next;
+        pthread_mutex_unlock(&logger.lock);
+        if (!b) b = malloc(sizeof(*b));
+        if (b) b->len = 0;
+        return b;
+}
+
+static void put(Record *r, const char *s, size_t n) {
+        if (n > sizeof(r->data) - r->len) n = sizeof(r->data) - r->len;
+        memcpy(r->data + r->len, s, n);
+        r->len += n;
+}
+
+static void puts_raw(Record *r, const char *s) {
+        put(r, s, strlen(s));
+}
+
+static void put_fmt(Record *r, const char *fmt, ...) {
+        size_t room = sizeof(r->data) - r->len;
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(r->data + r->len, room, fmt, args);
+        va_end(args);
+        if (n < 0) return;
+        r->len += (size_t)n < room ? (size_t)n : room - 1;
+}
+
+/*
+ * Write s as the inside of a JSON string. Bytes above 0x7f are kept as they
+ * are, names that aren't UTF-8 stay so.
+*/
+static void put_json(Record *r, const char *s) {
+        for (; *s; s++) {
+                unsigned char c = *s;
+                if (c == '"' || c == '\\') {
+                        char esc[2] = { '\\', c };
+                        put(r, esc, 2);
+                } else if (c < 0x20) {
+                        char esc[8];
+                        snprintf(esc, sizeof(esc), "\\u%04x", c);
+                        put(r, esc, 6);
+                } else {
+                        put(r, (const char *)&c, 1);
+                }
+        }
+}
+
+static const char *dst_name(const LogEvent *e) {
+        return e->dst_name ? e->dst_name : e->name;
+}
+
+static void format_text(Record *r, const LogEvent *e) {
+        const char *renamed = e->dst_name ? e->dst_name : "";
+        switch (e->action) {
+        case LOG_MOVED:
+                put_fmt(r, "Moved file: %s/%s => %s/%s%s\n", e->dir, e->name,
+                        e->root, e->subdir, renamed);
+                break;
+        case LOG_EXISTS:
+        case LOG_DELETED:
+        case LOG_FAILED:
+                // Labeled by printfc in print_text
+                break;
+        case LOG_WOULD_MOVE:
+                put_fmt(r, "Would move: %s/%s => %s/%s%s\n", e->dir, e->name,
+                        e->root, e->subdir, renamed);
+                break;
+        case LOG_WOULD_REPLACE:
+                put_fmt(r, "Would replace: %s/%s%s with %s/%s\n", e->root,
+                        e->subdir, e->name, e->dir, e->name);
+                break;
+        case LOG_WOULD_DELETE:
+                put_fmt(r,
+                        "Would delete duplicate: %s/%s (same as %s/%s%s)\n",
+                        e->dir, e->name, e->root, e->subdir, renamed);
+                break;
+        case LOG_RESTORED:
+                put_fmt(r, "Restored file: %s/%s%s => %s/%s\n", e->root,
+                        e->subdir, dst_name(e), e->dir, e->name);
+                break;
+        case LOG_WOULD_RESTORE:
+                put_fmt(r, "Would restore: %s/%s%s => %s/%s\n", e->root,
+                        e->subdir, dst_name(e), e->dir, e->name);
+                break;
+        }
+}
+
+/*
+ * Print the text of the events that get a label, with printfc's, right away.
+ * Returns 0 for the others, which are buffered.
+*/
+static int print_text(LogLevel level, const LogEvent *e) {
+        switch (e->action) {
+        case LOG_EXISTS:
+                log_message(INFO, "File exists: %s/%s%s\n", e->root, e->subdir,
+                            dst_name(e));
+                return 1;
+        case LOG_DELETED:
+                log_message(WARN, "Deleted duplicate: %s/%s (same as %s/%s%s)\n",
+                            e->dir, e->name, e->root, e->subdir,
+                            e->dst_name ? e->dst_name : "");
+                return 1;
+        case LOG_FAILED:
+                log_message(level, "failed to move: %s/%s to %s/%s%s%s\n",
+                            e->dir, e->name, e->root, e->subdir,
+                            e->err ? ": " : "",
+                            e->err ? strerror(e->err) : "");
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+static void format_json(Record *r, LogLevel level, const LogEvent *e) {
+        put_fmt(r, "{\"level\":\"%s\",\"action\":\"%s\",\"src\":\"",
+                level_names[level], action_names[e->action]);
+        put_json(r, e->dir);
+        puts_raw(r, "/");
+        put_json(r, e->name);
+        puts_raw(r, "\",\"dst\":\"");
+        put_json(r, e->root);
+        puts_raw(r, "/");
+        put_json(r, e->subdir);
+        put_json(r, dst_name(e));
+        puts_raw(r, "\"");
+        if (e->err) {
+                puts_raw(r, ",\"error\":\"");
+                put_json(r, strerror(e->err));
+                puts_raw(r, "\"");
+        }
+        puts_raw(r, "}\n");
+}
+
+static void format_nul(Record *r, const LogEvent *e) {
+        put_fmt(r, "%s%c%s/%s%c%s/%s%s%c", action_names[e->action], 0, e->dir,
+                e->name, 0, e->root, e->subdir, dst_name(e), 0);
+}
+
+void log_event(int worker, LogLevel level, const LogEvent *event) {
+        if (!log_enabled(level)) return;
+
+        if (logger.format == LOG_TEXT && print_text(level, event)) return;
+
+        Record r;
+        r.len = 0;
+        switch (logger.format) {
+        case LOG_TEXT:
+                format_text(&r, event);
+                break;
+        case LOG_JSONL:
+                format_json(&r, level, event);
+                break;
+        case LOG_NUL:
+                format_nul(&r, event);
+                break;
+        }
+
+        LogBuf **slot = &logger.bufs[worker];
+        if (*slot && (*slot)->len + r.len > BUF_SIZE) {
+                submit(*slot);
+                *slot = NULL;
+        }
+        if (!*slot && !(*slot = take())) return;
+        memcpy((*slot)->data + (*slot)->len, r.data, r.len);
+        (*slot)->len += r.len;
+}
+
+void log_message(LogLevel level, const char *fmt, ...) {
+        char msg[RECORD_MAX];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, args);
+        va_end(args);
+
+        pthread_mutex_lock(&message_lock);
+        printfc(level, "%s", msg);
+        pthread_mutex_unlock(&message_lock);
+}
+
+void log_sync(void) {
+        if (!logger.bufs) return;
+        for (int i = 0; i < logger.nworkers; i++) {
+                if (logger.bufs[i] && logger.bufs[i]->len > 0) {
+                        submit(logger.bufs[i]);
+                        logger.bufs[i] = NULL;
+                }
+        }
+        pthread_mutex_lock(&logger.lock);
+        while (logger.head || logger.writing)
+                pthread_cond_wait(&logger.drained, &logger.lock);
+        pthread_mutex_unlock(&logger.lock);
+}
+
+void log_close(void) {
+        if (!logger.bufs) return;
+        log_sync();
+        pthread_mutex_lock(&logger.lock);
+        logger.stop = 1;
+        pthread_cond_signal(&logger.ready);
+        pthread_mutex_unlock(&logger.lock);
+        pthread_join(logger.thread, NULL);
+
+        for (int i = 0; i < logger.nworkers; i++) {
+                free(logger.bufs[i]);
+        }
+        free(logger.bufs);
+        logger.bufs = NULL;
+        while (logger.spare) {
+                LogBuf *next = logger.spare->next;
+                free(logger.spare);
+                logger.spare = next;
+        }
+}
@@ -0,0 +1,200 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include "magic.h"
+
+#define MAX_NODES 1024
+#define MAX_ROOTS 8
+
+/*
+ * A built-in signature: len bytes expected at offset. Bit i of wild set means
+ * byte i can be anything.
+*/
+typedef struct {
+        const char *name;
+        uint16_t offset;
+        const char *bytes;
+        uint8_t len;
+        uint32_t wild;
+} Signature;
+
+#define SIG(name, offset, bytes) { name, offset, bytes, sizeof(bytes) - 1, 0 }
+#define SIGW(name, offset, bytes, wild) \
+        { name, offset, bytes, sizeof(bytes) - 1, wild }
+
+// RIFF and ISO media containers carry their size before the type
+#define RIFF(name, type) SIGW(name, 0, "RIFF\0\0\0\0" type, 0xf0)
+#define FTYP(name, brand) SIGW(name, 0, "\0\0\0\0ftyp" brand, 0x0f)
+
+static const Signature signatures[] = {
+        SIG("pdf", 0, "%PDF-"),
+        SIG("ps", 0, "%!PS"),
+        SIG("png", 0, "\x89PNG\r\n\x1a\n"),
+        SIG("jpg", 0, "\xff\xd8\xff"),
+        SIG("gif", 0, "GIF87a"),
+        SIG("gif", 0, "GIF89a"),
+        SIG("tiff", 0, "II*\0"),
+        SIG("tiff", 0, "MM\0*"),
+        SIG("psd", 0, "8BPS"),
+        RIFF("webp", "WEBP"),
+        RIFF("wav", "WAVE"),
+        RIFF("avi", "AVI "),
+        FTYP("mp4", ""),
+        FTYP("mov", "qt  "),
+        FTYP("m4a", "M4A "),
+        FTYP("avif", "avif"),
+        FTYP("avif", "avis"),
+        FTYP("heic", "heic"),
+        FTYP("heic", "heix"),
+        FTYP("heic", "mif1"),
+        SIG("mkv", 0, "\x1a\x45\xdf\xa3"),
+        SIG("mp3", 0, "ID3"),
+        SIG("mp3", 0, "\xff\xfb"),
+        SIG("mp3", 0, "\xff\xf3"),
+        SIG("mp3", 0, "\xff\xf2"),
+        SIG("flac", 0, "fLaC"),
+        SIG("ogg", 0, "OggS"),
+        SIG("mid", 0, "MThd"),
+        SIG("zip", 0, "PK\x03\x04"),
+        SIG("zip", 0, "PK\x05\x06"),
+        SIG("epub", 30, "mimetypeapplication/epub+zip"),
+        SIG("gz", 0, "\x1f\x8b"),
+        SIG("bz2", 0, "BZh"),
+        SIG("xz", 0, "\xfd" "7zXZ\0"),
+        SIG("zst", 0, "\x28\xb5\x2f\xfd"),
+        SIG("7z", 0, "7z\xbc\xaf\x27\x1c"),
+        SIG("rar", 0, "Rar!\x1a\x07"),
+        SIG("tar", 257, "ustar"),
+        SIG("deb", 0, "!<arch>\ndebian"),
+        SIG("rpm", 0, "\xed\xab\xee\xdb"),
+        SIG("elf", 0, "\x7f" "ELF"),
+        SIG("exe", 0, "MZ"),
+        SIG("wasm", 0, "\0asm"),
+        SIG("sqlite", 0, "SQLite format 3\0"),
+        SIG("doc", 0, "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1"),
+        SIG("rtf", 0, "{\\rtf"),
+        SIG("xml", 0, "<?xml"),
+        SIG("html", 0, "<!DOCTYPE html"),
+        SIG("html", 0, "<!doctype html"),
+        SIG("html", 0, "<html"),
+        SIG("sh", 0, "#!/bin/sh"),
+        SIG("sh", 0, "#!/bin/bash"),
+        SIG("sh", 0, "#!/usr/bin/env sh"),
+        SIG("sh", 0, "#!/usr/bin/env bash"),
+        SIG("py", 0, "#!/usr/bin/python"),
+        SIG("py", 0, "#!/usr/bin/env python"),
+        SIG("otf", 0, "OTTO"),
+        SIG("ttf", 0, "\0\1\0\0\0"),
+        SIG("woff", 0, "wOFF"),
+        SIG("woff2", 0, "wOF2"),
+};
+
+#define NSIGNATURES (sizeof(signatures) / sizeof(signatures[0]))
+
+/*
+ * A node of the trie, matching one byte. Index 0 is never a node, so it ends
+ * lists.
+*/
+typedef struct {
+        uint16_t child; // First node of the next byte
+        uint16_t next; // Next alternative for this byte
+        uint8_t byte;
+        uint8_t any;
+        int16_t sig; // Signature ending here, -1 for none
+} MagicNode;
+
+/*
+ * Every signature starting at the same offset shares one trie
+*/
+typedef struct {
+        uint16_t offset;
+        uint16_t first;
+} MagicRoot;
+
+static MagicNode nodes[MAX_NODES];
+static uint16_t nnodes = 1;
+static MagicRoot roots[MAX_ROOTS];
+static int nroots;
+static pthread_once_t built = PTHREAD_ONCE_INIT;
+
+static uint16_t *root_of(uint16_t offset) {
+        for (int i = 0; i < nroots; i++) {
+                if (roots[i].offset == offset) return &roots[i].first;
+        }
+        if (nroots == MAX_ROOTS) return NULL;
+        roots[nroots].offset = offset;
+        roots[nroots].first = 0;
+        return &roots[nroots++].first;
+}
+
+/*
+ * Find the node matching a byte in a list, adding it if needed
+*/
+static uint16_t node_get(uint16_t *list, uint8_t byte, int any) {
+        uint16_t *link = list;
+        while (*link) {
+                MagicNode *n = &nodes[*link];
+                if (n->any == any && (any || n->byte == byte)) return *link;
+                link = &n->next;
+        }
+        if (nnodes == MAX_NODES) return 0;
+        MagicNode *n = &nodes[nnodes];
+        n->child = 0;
+        n->next = 0;
+        n->byte = any ? 0 : byte;
+        n->any = any;
+        n->sig = -1;
+        *link = nnodes;
+        return nnodes++;
+}
+
+static void build(void) {
+        for (size_t i = 0; i < NSIGNATURES; i++) {
+                const Signature *s = &signatures[i];
+                uint16_t *list = root_of(s->offset);
+                uint16_t node = 0;
+                for (uint8_t j = 0; list && j < s->len; j++) {
+                        int any = j < 32 && (s->wild >> j) & 1;
+                        node = node_get(list, s->bytes[j], any);
+                        list = node ? &nodes[node].child : NULL;
+                }
+                // The first signature for a sequence of bytes wins
+                if (node && nodes[node].sig < 0) nodes[node].sig = i;
+        }
+}
+
+static void trie_match(uint16_t node, const unsigned char *buf, size_t len,
+                       size_t depth, int *best, size_t *best_len) {
+        if (depth >= len) return;
+        for (; node; node = nodes[node].next) {
+                const MagicNode *n = &nodes[node];
+                if (!n->any && n->byte != buf[depth]) continue;
+                if (n->sig >= 0 && depth + 1 > *best_len) {
+                        *best = n->sig;
+                        *best_len = depth + 1;
+                }
+                trie_match(n->child, buf, len, depth + 1, best, best_len);
+        }
+}
+
+const char *magic_match(const unsigned char *buf, size_t len) {
+        pthread_once(&built, build);
+
+        int best = -1;
+        size_t best_len = 0;
+        for (int i = 0; i < nroots; i++) {
+                size_t off = roots[i].offset;
+                if (off < len)
+                        trie_match(roots[i].first, buf + off, len - off, 0,
+                                   &best, &best_len);
+        }
+        return best >= 0 ? signatures[best].name : NULL;
+}
+
+int magic_known(const char *name) {
+        for (size_t i = 0; i < NSIGNATURES; i++) {
+                if (strcasecmp(signatures[i].name, name) == 0) return 1;
+        }
+        return 0;
+}
@@ -0,0 +1,735 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pattern.h"
+
+#define MAX_NFA 65536
+#define MAX_DFA 16384
+#define MAX_REPEAT 255
+#define SET_BYTES 32
+
+typedef enum {
+        AST_SET,
+        AST_EMPTY,
+        AST_CAT,
+        AST_ALT,
+        AST_REPEAT,
+} AstKind;
+
+/*
+ * A parsed pattern. AST_REPEAT repeats a between min and max times, max -1
+ * meaning without bound.
+*/
+typedef struct Ast Ast;
+struct Ast {
+        AstKind kind;
+        Ast *a;
+        Ast *b;
+        int min;
+        int max;
+        uint8_t set[SET_BYTES];
+};
+
+typedef struct {
+        const char *p;
+        const char *end;
+        int icase;
+        int glob;
+        int err;
+} Parser;
+
+/*
+ * A state of the NFA. A state with a set moves to out on any byte of it,
+ * others move to out and out2 without reading anything.
+*/
+typedef struct {
+        int set; // -1 for none
+        int out;
+        int out2;
+        int rule; // Pattern accepted here, -1 for none
+} NfaState;
+
+typedef struct {
+        NfaState *states;
+        size_t count;
+        size_t cap;
+        uint8_t (*sets)[SET_BYTES];
+        size_t nsets;
+        size_t sets_cap;
+} Nfa;
+
+static void ast_free(Ast *node) {
+        if (!node) return;
+        ast_free(node->a);
+        ast_free(node->b);
+        free(node);
+}
+
+static Ast *ast_new(Parser *ps, AstKind kind, Ast *a, Ast *b) {
+        Ast *node = calloc(1, sizeof(*node));
+        if (!node) {
+                ps->err = 1;
+                ast_free(a);
+                ast_free(b);
+                return NULL;
+        }
+        node->kind = kind;
+        node->a = a;
+        node->b = b;
+        return node;
+}
+
+static void set_add(uint8_t *set, unsigned char c, int icase) {
+        set[c >> 3] |= 1 << (c & 7);
+        if (!icase) return;
+        if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+        else if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        set[c >> 3] |= 1 << (c & 7);
+}
+
+static int set_has(const uint8_t *set, unsigned char c) {
+        return (set[c >> 3] >> (c & 7)) & 1;
+}
+
+static Ast *ast_byte(Parser *ps, unsigned char c) {
+        Ast *node = ast_new(ps, AST_SET, NULL, NULL);
+        if (node) set_add(node->set, c, ps->icase);
+        return node;
+}
+
+static Ast *ast_any(Parser *ps) {
+        Ast *node = ast_new(ps, AST_SET, NULL, NULL);
+        if (node) memset(node->set, 0xff, SET_BYTES);
+        return node;
+}
+
+static Ast *ast_repeat(Parser *ps, Ast *a, int min, int max) {
+        if (!a) return NULL;
+        Ast *node = ast_new(ps, AST_REPEAT, a, NULL);
+        if (node) {
+                node->min = min;
+                node->max = max;
+        }
+        return node;
+}
+
+static Ast *ast_cat(Parser *ps, Ast *a, Ast *b) {
+        if (!a || !b) {
+                ast_free(a);
+                ast_free(b);
+                return NULL;
+        }
+        return ast_new(ps, AST_CAT, a, b);
+}
+
+/*
+ * Add the escapes naming classes of bytes, returns 0 for other escapes
+*/
+static int class_escape(uint8_t *set, char c) {
+        int negate = c == 'D' || c == 'W' || c == 'S';
+        uint8_t add[SET_BYTES] = { 0 };
+        switch (c) {
+        case 'd':
+        case 'D':
+                for (int b = '0'; b <= '9'; b++) set_add(add, b, 0);
+                break;
+        case 'w':
+        case 'W':
+                for (int b = '0'; b <= '9'; b++) set_add(add, b, 0);
+                for (int b = 'a'; b <= 'z'; b++) set_add(add, b, 1);
+                set_add(add, '_', 0);
+                break;
+        case 's':
+        case 'S':
+                set_add(add, ' ', 0);
+                for (int b = '\t'; b <= '\r'; b++) set_add(add, b, 0);
+                break;
+        default:
+                return 0;
+        }
+        for (int i = 0; i < SET_BYTES; i++) set[i] |= negate ? ~add[i] : add[i];
+        return 1;
+}
+
+/*
+ * Parse a bracket expression, ps->p is just past the opening [
+*/
+static Ast *parse_class(Parser *ps) {
+        Ast *node = ast_new(ps, AST_SET, NULL, NULL);
+        if (!node) return NULL;
+
+        int negate = 0;
+        if (ps->p < ps->end &&
+            (*ps->p == '^' || (ps->glob && *ps->p == '!'))) {
+                negate = 1;
+                ps->p++;
+        }
+        int first = 1;
+        while (ps->p < ps->end && (*ps->p != ']' || first)) {
+                first = 0;
+                unsigned char lo = *ps->p++;
+                if (lo == '\\' && ps->p < ps->end) {
+                        if (!ps->glob && class_escape(node->set, *ps->p)) {
+                                ps->p++;
+                                continue;
+                        }
+                        lo = *ps->p++;
+                }
+                unsigned char hi = lo;
+                if (ps->p + 1 < ps->end && ps->p[0] == '-' &&
+                    ps->p[1] != ']') {
+                        hi = ps->p[1];
+                        ps->p += 2;
+                        if (hi == '\\' && ps->p < ps->end) hi = *ps->p++;
+                        if (hi < lo) {
+                                ps->err = 1;
+                                break;
+                        }
+                }
+                for (int c = lo; c <= hi; c++) set_add(node->set, c, ps->icase);
+        }
+        if (ps->err || ps->p == ps->end) {
+                ps->err = 1;
+                ast_free(node);
+                return NULL;
+        }
+        ps->p++;
+        if (negate) {
+                for (int i = 0; i < SET_BYTES; i++) node->set[i] ^= 0xff;
+        }
+        return node;
+}
+
+static Ast *parse_alt(Parser *ps);
+
+static Ast *parse_atom(Parser *ps) {
+        char c = *ps->p++;
+        switch (c) {
+        case '(': {
+                if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':')
+                        ps->p += 2;
+                Ast *node = parse_alt(ps);
+                if (ps->p == ps->end || *ps->p != ')') {
+                        ps->err = 1;
+                        ast_free(node);
+                        return NULL;
+                }
+                ps->p++;
+                return node;
+        }
+        case '[':
+                return parse_class(ps);
+        case '.':
+                return ast_any(ps);
+        case '\\':
+                if (ps->p == ps->end) break;
+                c = *ps->p++;
+                Ast *node = ast_new(ps, AST_SET, NULL, NULL);
+                if (node && !class_escape(node->set, c))
+                        set_add(node->set, c, ps->icase);
+                return node;
+        // Anchors only make sense at the ends of the pattern
+        case '^':
+        case '$':
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+        case ')':
+                break;
+        default:
+                return ast_byte(ps, c);
+        }
+        ps->err = 1;
+        return NULL;
+}
+
+static int parse_count(Parser *ps) {
+        int n = -1;
+        while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+                n = (n < 0 ? 0 : n * 10) + (*ps->p++ - '0');
+                if (n > MAX_REPEAT) return -2;
+        }
+        return n;
+}
+
+static Ast *parse_repeat(Parser *ps) {
+        Ast *node = parse_atom(ps);
+        while (node && ps->p < ps->end) {
+                char c = *ps->p;
+                if (c == '*') {
+                        node = ast_repeat(ps, node, 0, -1);
+                } else if (c == '+') {
+                        node = ast_repeat(ps, node, 1, -1);
+                } else if (c == '?') {
+                        node = ast_repeat(ps, node, 0, 1);
+                } else if (c == '{') {
+                        ps->p++;
+                        int min = parse_count(ps);
+                        int max = min;
+                        if (ps->p < ps->end && *ps->p == ',') {
+                                ps->p++;
+                                max = parse_count(ps);
+                        }
+                        if (min < 0 || max < -1 || (max >= 0 && max < min) ||
+                            ps->p == ps->end || *ps->p != '}') {
+                                ps->err = 1;
+                                ast_free(node);
+                                return NULL;
+                        }
+                        node = ast_repeat(ps, node, min, max);
+                } else {
+                        break;
+                }
+                ps->p++;
+        }
+        return node;
+}
+
+static Ast *parse_concat(Parser *ps) {
+        Ast *node = ast_new(ps, AST_EMPTY, NULL, NULL);
+        while (node && ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+                node = ast_cat(ps, node, parse_repeat(ps));
+        }
+        return node;
+}
+
+static Ast *parse_alt(Parser *ps) {
+        Ast *node = parse_concat(ps);
+        while (node && ps->p < ps->end && *ps->p == '|') {
+                ps->p++;
+                Ast *other = parse_concat(ps);
+                if (!other) {
+                        ast_free(node);
+                        return NULL;
+                }
+                node = ast_new(ps, AST_ALT, node, other);
+        }
+        return node;
+}
+
+static Ast *parse_glob(Parser *ps) {
+        Ast *node = ast_new(ps, AST_EMPTY, NULL, NULL);
+        while (node && ps->p < ps->end) {
+                char c = *ps->p++;
+                Ast *next;
+                if (c == '*') {
+                        next = ast_repeat(ps, ast_any(ps), 0, -1);
+                } else if (c == '?') {
+                        next = ast_any(ps);
+                } else if (c == '[') {
+                        next = parse_class(ps);
+                } else {
+                        if (c == '\\' && ps->p < ps->end) c = *ps->p++;
+                        next = ast_byte(ps, c);
+                }
+                node = ast_cat(ps, node, next);
+        }
+        return node;
+}
+
+/*
+ * Parse a pattern into a tree matching whole names
+*/
+static Ast *parse(PatternKind kind, const char *text) {
+        Parser ps = { text, text + strlen(text), 0, kind == PATTERN_GLOB, 0 };
+        if (strncmp(ps.p, "(?i)", 4) == 0) {
+                ps.icase = 1;
+                ps.p += 4;
+        }
+        if (ps.glob) {
+                Ast *node = parse_glob(&ps);
+                if (ps.err) {
+                        ast_free(node);
+                        return NULL;
+                }
+                return node;
+        }
+
+        int head = ps.p < ps.end && *ps.p == '^';
+        if (head) ps.p++;
+        // A trailing $ anchors unless it is escaped
+        int tail = 0;
+        if (ps.end > ps.p && ps.end[-1] == '$') {
+                size_t slashes = 0;
+                while (ps.end - 2 - (ptrdiff_t)slashes >= ps.p &&
+                       ps.end[-2 - (ptrdiff_t)slashes] == '\\')
+                        slashes++;
+                tail = slashes % 2 == 0;
+        }
+        if (tail) ps.end--;
+
+        Ast *node = parse_alt(&ps);
+        if (node && ps.p != ps.end) ps.err = 1;
+        if (!ps.err && !head)
+                node = ast_cat(&ps, ast_repeat(&ps, ast_any(&ps), 0, -1),
+                               node);
+        if (!ps.err && !tail)
+                node = ast_cat(&ps, node,
+                               ast_repeat(&ps, ast_any(&ps), 0, -1));
+        if (ps.err) {
+                ast_free(node);
+                return NULL;
+        }
+        return node;
+}
+
+int pattern_check(PatternKind kind, const char *text) {
+        Ast *node = parse(kind, text);
+        if (!node) return -1;
+        ast_free(node);
+        return 0;
+}
+
+static int nfa_state(Nfa *nfa, int set, int out, int out2) {
+        if (nfa->count == MAX_NFA) return -1;
+        if (nfa->count == nfa->cap) {
+                size_t cap = nfa->cap ? nfa->cap * 2 : 256;
+                NfaState *states = realloc(nfa->states, cap * sizeof(*states));
+                if (!states) return -1;
+                nfa->states = states;
+                nfa->cap = cap;
+        }
+        NfaState *s = &nfa->states[nfa->count];
+        s->set = set;
+        s->out = out;
+        s->out2 = out2;
+        s->rule = -1;
+        return nfa->count++;
+}
+
+static int nfa_set(Nfa *nfa, const uint8_t *set) {
+        if (nfa->nsets == nfa->sets_cap) {
+                size_t cap = nfa->sets_cap ? nfa->sets_cap * 2 : 64;
+                uint8_t(*sets)[SET_BYTES] =
+                        realloc(nfa->sets, cap * sizeof(*sets));
+                if (!sets) return -1;
+                nfa->sets = sets;
+                nfa->sets_cap = cap;
+        }
+        memcpy(nfa->sets[nfa->nsets], set, SET_BYTES);
+        return nfa->nsets++;
+}
+
+/*
+ * Build the states of a tree, from start to a final state moving nowhere yet
+*/
+static int nfa_build(Nfa *nfa, const Ast *node, int *start, int *end) {
+        int s, e, a, b;
+        switch (node->kind) {
+        case AST_EMPTY:
+                *start = *end = nfa_state(nfa, -1, -1, -1);
+                return *start < 0 ? -1 : 0;
+        case AST_SET:
+                s = nfa_set(nfa, node->set);
+                e = nfa_state(nfa, -1, -1, -1);
+                if (s < 0 || e < 0) return -1;
+                *start = nfa_state(nfa, s, e, -1);
+                *end = e;
+                return *start < 0 ? -1 : 0;
+        case AST_CAT:
+                if (nfa_build(nfa, node->a, start, &a) != 0 ||
+                    nfa_build(nfa, node->b, &b, end) != 0)
+                        return -1;
+                nfa->states[a].out = b;
+                return 0;
+        case AST_ALT:
+                if (nfa_build(nfa, node->a, &s, &a) != 0 ||
+                    nfa_build(nfa, node->b, &e, &b) != 0)
+                        return -1;
+                *start = nfa_state(nfa, -1, s, e);
+                *end = nfa_state(nfa, -1, -1, -1);
+                if (*start < 0 || *end < 0) return -1;
+                nfa->states[a].out = *end;
+                nfa->states[b].out = *end;
+                return 0;
+        case AST_REPEAT:
+                break;
+        }
+
+        // The mandatory copies, then the optional ones
+        *start = *end = nfa_state(nfa, -1, -1, -1);
+        if (*start < 0) return -1;
+        for (int i = 0; i < node->min; i++) {
+                if (nfa_build(nfa, node->a, &s, &e) != 0) return -1;
+                nfa->states[*end].out = s;
+                *end = e;
+        }
+        if (node->max < 0) {
+                // Loop: try another copy or leave
+                if (nfa_build(nfa, node->a, &s, &e) != 0) return -1;
+                int loop = nfa_state(nfa, -1, s, -1);
+                int exit = nfa_state(nfa, -1, -1, -1);
+                if (loop < 0 || exit < 0) return -1;
+                nfa->states[loop].out2 = exit;
+                nfa->states[e].out = loop;
+                nfa->states[*end].out = loop;
+                *end = exit;
+                return 0;
+        }
+        int exit = nfa_state(nfa, -1, -1, -1);
+        if (exit < 0) return -1;
+        for (int i = node->min; i < node->max; i++) {
+                if (nfa_build(nfa, node->a, &s, &e) != 0) return -1;
+                int fork = nfa_state(nfa, -1, s, exit);
+                if (fork < 0) return -1;
+                nfa->states[*end].out = fork;
+                *end = e;
+        }
+        nfa->states[*end].out = exit;
+        *end = exit;
+        return 0;
+}
+
+/*
+ * Subset construction, every DFA state standing for a sorted set of the NFA
+ * states that read a byte or accept
+*/
+typedef struct {
+        const Nfa *nfa;
+        int *pool; // The sets of every DFA state, back to back
+        size_t pool_len;
+        size_t pool_cap;
+        size_t *offs; // Where each DFA state's set starts in pool
+        uint32_t *table; // Open addressing, DFA state + 1, 0 for empty
+        uint32_t table_mask;
+        uint32_t *marks; // Generation that last reached each NFA state
+        uint32_t generation;
+        int *stack;
+        int *found;
+        size_t nfound;
+        uint32_t states_cap; // Room in the transitions of the DFA
+} Subsets;
+
+static void closure_add(Subsets *ss, int state) {
+        size_t top = 0;
+        ss->stack[top++] = state;
+        while (top > 0) {
+                int s = ss->stack[--top];
+                if (s < 0 || ss->marks[s] == ss->generation) continue;
+                ss->marks[s] = ss->generation;
+                const NfaState *st = &ss->nfa->states[s];
+                if (st->set >= 0 || st->rule >= 0) ss->found[ss->nfound++] = s;
+                if (st->set < 0) {
+                        ss->stack[top++] = st->out;
+                        ss->stack[top++] = st->out2;
+                }
+        }
+}
+
+static int cmp_int(const void *a, const void *b) {
+        int x = *(const int *)a;
+        int y = *(const int *)b;
+        return (x > y) - (x < y);
+}
+
+static uint32_t set_hash(const int *set, size_t n) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; i++) {
+                h ^= (uint32_t)set[i];
+                h *= 16777619u;
+        }
+        return h;
+}
+
+static size_t set_len(const Subsets *ss, uint32_t state) {
+        return ss->offs[state + 1] - ss->offs[state];
+}
+
+/*
+ * Find the DFA state of the found set, adding it when new. Returns the state,
+ * or -1 on failure.
+*/
+static long subsets_intern(Subsets *ss, PatternDfa *dfa) {
+        qsort(ss->found, ss->nfound, sizeof(int), cmp_int);
+        uint32_t h = set_hash(ss->found, ss->nfound);
+        uint32_t i = h & ss->table_mask;
+        while (ss->table[i]) {
+                uint32_t state = ss->table[i] - 1;
+                if (set_len(ss, state) == ss->nfound &&
+                    memcmp(ss->pool + ss->offs[state], ss->found,
+                           ss->nfound * sizeof(int)) == 0)
+                        return state;
+                i = (i + 1) & ss->table_mask;
+        }
+        if (dfa->nstates == MAX_DFA) {
+                errno = E2BIG;
+                return -1;
+        }
+        if (dfa->nstates == ss->states_cap) {
+                uint32_t cap = ss->states_cap * 2;
+                uint32_t *next = realloc(dfa->next, (size_t)cap *
+                                                            dfa->nclasses *
+                                                            sizeof(*next));
+                if (!next) return -1;
+                dfa->next = next;
+                uint32_t *accept = realloc(dfa->accept, cap * sizeof(*accept));
+                if (!accept) return -1;
+                dfa->accept = accept;
+                ss->states_cap = cap;
+        }
+
+        if (ss->pool_len + ss->nfound > ss->pool_cap) {
+                size_t cap = ss->pool_cap * 2;
+                while (cap < ss->pool_len + ss->nfound) cap *= 2;
+                int *pool = realloc(ss->pool, cap * sizeof(*pool));
+                if (!pool) return -1;
+                ss->pool = pool;
+                ss->pool_cap = cap;
+        }
+        memcpy(ss->pool + ss->pool_len, ss->found, ss->nfound * sizeof(int));
+        ss->pool_len += ss->nfound;
+
+        uint32_t state = dfa->nstates++;
+        ss->offs[state + 1] = ss->pool_len;
+        ss->table[i] = state + 1;
+        return state;
+}
+
+static int dfa_build(PatternDfa *dfa, const Nfa *nfa, const int *starts,
+                     const PatternSpec *specs, size_t n) {
+        Subsets ss;
+        memset(&ss, 0, sizeof(ss));
+        ss.nfa = nfa;
+        ss.table_mask = MAX_DFA * 2 - 1;
+        ss.table = calloc(MAX_DFA * 2, sizeof(*ss.table));
+        ss.offs = calloc(MAX_DFA + 1, sizeof(*ss.offs));
+        ss.marks = calloc(nfa->count, sizeof(*ss.marks));
+        ss.stack = malloc(nfa->count * 2 * sizeof(*ss.stack) + sizeof(int));
+        ss.found = malloc(nfa->count * sizeof(*ss.found));
+        ss.pool_cap = 1024;
+        ss.pool = malloc(ss.pool_cap * sizeof(*ss.pool));
+        ss.states_cap = 64;
+        dfa->next = malloc(ss.states_cap * dfa->nclasses * sizeof(*dfa->next));
+        dfa->accept = malloc(ss.states_cap * sizeof(*dfa->accept));
+        int err = !ss.table || !ss.offs || !ss.marks || !ss.stack ||
+                  !ss.found || !ss.pool || !dfa->next || !dfa->accept;
+
+        // One byte standing for each class
+        int rep[256];
+        for (int c = 255; c >= 0; c--) rep[dfa->classes[c]] = c;
+
+        // State 0 rejects, state 1 starts every pattern
+        ss.nfound = 0;
+        if (!err) err = subsets_intern(&ss, dfa) < 0;
+        ss.generation++;
+        for (size_t i = 0; !err && i < n; i++) closure_add(&ss, starts[i]);
+        if (!err) err = subsets_intern(&ss, dfa) < 0;
+
+        for (uint32_t state = 0; !err && state < dfa->nstates; state++) {
+                const int *set = ss.pool + ss.offs[state];
+                size_t len = set_len(&ss, state);
+                int best = -1;
+                for (size_t i = 0; i < len; i++) {
+                        int rule = nfa->states[set[i]].rule;
+                        if (rule >= 0 && (best < 0 || rule < best))
+                                best = rule;
+                }
+                dfa->accept[state] = best >= 0 ? specs[best].value : 0;
+
+                for (uint32_t c = 0; !err && c < dfa->nclasses; c++) {
+                        ss.generation++;
+                        ss.nfound = 0;
+                        // The pool may move while adding states
+                        for (size_t i = 0; i < len; i++) {
+                                const NfaState *st =
+                                        &nfa->states[ss.pool[ss.offs[state] + i]];
+                                if (st->set >= 0 &&
+                                    set_has(nfa->sets[st->set], rep[c]))
+                                        closure_add(&ss, st->out);
+                        }
+                        long next = subsets_intern(&ss, dfa);
+                        if (next < 0) err = 1;
+                        else dfa->next[state * dfa->nclasses + c] = next;
+                }
+        }
+
+        free(ss.table);
+        free(ss.offs);
+        free(ss.marks);
+        free(ss.stack);
+        free(ss.found);
+        free(ss.pool);
+        if (err) return -1;
+
+        // Give back what the states didn't use
+        uint32_t *next = realloc(dfa->next, (size_t)dfa->nstates *
+                                                    dfa->nclasses *
+                                                    sizeof(*next));
+        uint32_t *accept =
+                realloc(dfa->accept, dfa->nstates * sizeof(*accept));
+        if (next) dfa->next = next;
+        if (accept) dfa->accept = accept;
+        return 0;
+}
+
+/*
+ * Split bytes into classes, two bytes sharing a class when every set of the
+ * NFA holds either both or neither
+*/
+static void byte_classes(PatternDfa *dfa, const Nfa *nfa) {
+        memset(dfa->classes, 0, sizeof(dfa->classes));
+        dfa->nclasses = 1;
+        for (size_t i = 0; i < nfa->nsets; i++) {
+                // Every (class, membership) pair becomes a class of its own
+                int map[512];
+                for (int k = 0; k < 512; k++) map[k] = -1;
+                uint32_t count = 0;
+                for (int c = 0; c < 256; c++) {
+                        int key = dfa->classes[c] * 2 +
+                                  set_has(nfa->sets[i], c);
+                        if (map[key] < 0) map[key] = count++;
+                        dfa->classes[c] = map[key];
+                }
+                dfa->nclasses = count;
+        }
+}
+
+int pattern_compile(PatternDfa *dfa, const PatternSpec *specs, size_t n) {
+        memset(dfa, 0, sizeof(*dfa));
+        Nfa nfa;
+        memset(&nfa, 0, sizeof(nfa));
+        int *starts = malloc((n ? n : 1) * sizeof(*starts));
+        int err = !starts;
+
+        for (size_t i = 0; !err && i < n; i++) {
+                Ast *node = parse(specs[i].kind, specs[i].text);
+                int end;
+                err = !node || nfa_build(&nfa, node, &starts[i], &end) != 0;
+                if (!err) nfa.states[end].rule = i;
+                if (!node) errno = EINVAL;
+                else if (err && nfa.count == MAX_NFA) errno = E2BIG;
+                ast_free(node);
+        }
+        if (!err) {
+                byte_classes(dfa, &nfa);
+                dfa->count = n;
+                err = dfa_build(dfa, &nfa, starts, specs, n) != 0;
+        }
+
+        free(starts);
+        free(nfa.states);
+        free(nfa.sets);
+        if (err) {
+                pattern_free(dfa);
+                return -1;
+        }
+        return 0;
+}
+
+uint32_t pattern_match(const PatternDfa *dfa, const char *name, size_t len) {
+        if (dfa->nstates == 0) return 0;
+        uint32_t state = 1;
+        for (size_t i = 0; i < len; i++) {
+                unsigned char c = name[i];
+                state = dfa->next[state * dfa->nclasses + dfa->classes[c]];
+                if (state == 0) return 0;
+        }
+        return dfa->accept[state];
+}
+
+void pattern_free(PatternDfa *dfa) {
+        free(dfa->next);
+        free(dfa->accept);
+        memset(dfa, 0, sizeof(*dfa));
+}
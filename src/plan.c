@@ -0,0 +1,575 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "logbuf.h"
+#include "plan.h"
+
+#define PLAN_MAGIC "FORGPLAN"
+#define PLAN_VERSION 2
+#define ARENA_INITIAL 65536
+#define DIRS_INITIAL 1024
+#define ENTRIES_INITIAL 1024
+#define SRC_CACHE 16 // Source directories a worker keeps open
+#define BUF_FILES 256
+#define BUF_BYTES 32768
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+typedef struct {
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_size;
+        uint64_t strings_len;
+        uint64_t count;
+        uint32_t root;
+        uint32_t cwd;
+} PlanHeader;
+
+/*
+ * Files planned by a worker, their offsets pointing into strings
+*/
+struct PlanBuf {
+        PlanEntry entries[BUF_FILES];
+        size_t count;
+        size_t len;
+        char strings[BUF_BYTES];
+};
+
+/*
+ * Consecutive files of a plan going to the same destination directory, at
+ * most PLAN_CHUNK of them
+*/
+typedef struct {
+        const Plan *plan;
+        void *arg;
+        size_t start;
+        size_t end;
+} ExecGroup;
+
+typedef struct {
+        ExecGroup *groups;
+        size_t ngroups;
+        size_t next; // Next group to hand out
+        plan_fn fn;
+        walk_done_fn done;
+} Exec;
+
+typedef struct {
+        Exec *exec;
+        int id;
+} ExecWorker;
+
+typedef struct {
+        const Plan *plan;
+        uint32_t dir;
+        int fd;
+} SrcDir;
+
+static uint32_t hash_str(const char *str) {
+        uint32_t h = FNV_OFFSET;
+        for (; *str; str++) {
+                h ^= (unsigned char)*str;
+                h *= FNV_PRIME;
+        }
+        return h;
+}
+
+/*
+ * Copy str into the arena and return its offset, or 0 on failure
+*/
+static uint32_t arena_add(Plan *plan, const char *str) {
+        size_t len = strlen(str) + 1;
+        if (plan->strings_len + len > UINT32_MAX) return 0;
+        if (plan->strings_len + len > plan->strings_cap) {
+                size_t cap = plan->strings_cap * 2;
+                while (cap < plan->strings_len + len) cap *= 2;
+                char *strings = realloc(plan->strings, cap);
+                if (!strings) return 0;
+                plan->strings = strings;
+                plan->strings_cap = cap;
+        }
+        uint32_t off = plan->strings_len;
+        memcpy(plan->strings + off, str, len);
+        plan->strings_len += len;
+        return off;
+}
+
+static int dirs_grow(Plan *plan) {
+        uint32_t size = (plan->dirs_mask + 1) * 2;
+        PlanSlot *slots = calloc(size, sizeof(*slots));
+        if (!slots) return -1;
+
+        for (uint32_t i = 0; i <= plan->dirs_mask; i++) {
+                if (plan->dirs[i].str == 0) continue;
+                uint32_t j = plan->dirs[i].hash & (size - 1);
+                while (slots[j].str != 0) j = (j + 1) & (size - 1);
+                slots[j] = plan->dirs[i];
+        }
+        free(plan->dirs);
+        plan->dirs = slots;
+        plan->dirs_mask = size - 1;
+        return 0;
+}
+
+/*
+ * Offset of the one copy of a directory string, or 0 on failure
+*/
+static uint32_t intern(Plan *plan, const char *str) {
+        uint32_t hash = hash_str(str);
+        uint32_t i = hash & plan->dirs_mask;
+        while (plan->dirs[i].str != 0) {
+                if (plan->dirs[i].hash == hash &&
+                    strcmp(plan->strings + plan->dirs[i].str, str) == 0)
+                        return plan->dirs[i].str;
+                i = (i + 1) & plan->dirs_mask;
+        }
+
+        uint32_t off = arena_add(plan, str);
+        if (off == 0) return 0;
+        plan->dirs[i].hash = hash;
+        plan->dirs[i].str = off;
+        plan->dirs_count++;
+        if (plan->dirs_count * 2 > plan->dirs_mask && dirs_grow(plan) != 0)
+                return 0;
+        return off;
+}
+
+int plan_init(Plan *plan, const char *root, int nworkers) {
+        memset(plan, 0, sizeof(*plan));
+        plan->strings = malloc(ARENA_INITIAL);
+        plan->dirs = calloc(DIRS_INITIAL, sizeof(*plan->dirs));
+        if (!plan->strings || !plan->dirs) {
+                free(plan->strings);
+                free(plan->dirs);
+                return -1;
+        }
+        plan->strings_cap = ARENA_INITIAL;
+        plan->dirs_mask = DIRS_INITIAL - 1;
+        // Offset 0 is the empty string, which marks empty slots
+        plan->strings[0] = '\0';
+        plan->strings_len = 1;
+        pthread_mutex_init(&plan->lock, NULL);
+
+        char cwd[PATH_MAX];
+        plan->root = intern(plan, root);
+        if (plan->root && getcwd(cwd, sizeof(cwd)))
+                plan->cwd = arena_add(plan, cwd);
+        plan->bufs = calloc(nworkers > 0 ? nworkers : 1, sizeof(*plan->bufs));
+        if (plan->root == 0 || plan->cwd == 0 || !plan->bufs) {
+                plan_free(plan);
+                return -1;
+        }
+        plan->nworkers = nworkers > 0 ? nworkers : 1;
+        return 0;
+}
+
+void plan_free(Plan *plan) {
+        for (int i = 0; plan->bufs && i < plan->nworkers; i++) {
+                free(plan->bufs[i]);
+        }
+        free(plan->bufs);
+        free(plan->strings);
+        free(plan->dirs);
+        free(plan->entries);
+        pthread_mutex_destroy(&plan->lock);
+        memset(plan, 0, sizeof(*plan));
+}
+
+void plan_clear(Plan *plan) {
+        // Only the root and the working directory survive, as the first
+        // strings after the empty one
+        const char *root = plan->strings + plan->root;
+        uint32_t hash = hash_str(root);
+        memset(plan->dirs, 0, (plan->dirs_mask + 1) * sizeof(*plan->dirs));
+        plan->dirs[hash & plan->dirs_mask].hash = hash;
+        plan->dirs[hash & plan->dirs_mask].str = plan->root;
+        plan->dirs_count = 1;
+        plan->strings_len = plan->cwd + strlen(plan->strings + plan->cwd) + 1;
+        plan->count = 0;
+}
+
+/*
+ * Add a file to the plan, with its lock held. dir and subdir are offsets
+ * already interned when not 0.
+*/
+static int entry_add(Plan *plan, uint32_t dir, const char *dir_str,
+                     const char *name, uint32_t subdir, const char *subdir_str,
+                     unsigned char type, unsigned char action) {
+        if (plan->count == plan->cap) {
+                size_t cap = plan->cap ? plan->cap * 2 : ENTRIES_INITIAL;
+                PlanEntry *entries =
+                        realloc(plan->entries, cap * sizeof(*entries));
+                if (!entries) return -1;
+                plan->entries = entries;
+                plan->cap = cap;
+        }
+
+        PlanEntry *e = &plan->entries[plan->count];
+        e->dir = dir ? dir : intern(plan, dir_str);
+        e->name = e->dir ? arena_add(plan, name) : 0;
+        e->subdir = !e->name ? 0 : subdir ? subdir : intern(plan, subdir_str);
+        e->type = type;
+        e->action = action;
+        if (e->subdir == 0) return -1;
+        plan->count++;
+        return 0;
+}
+
+/*
+ * Merge the files of a buffer into the plan and empty it
+*/
+static int buf_flush(Plan *plan, PlanBuf *buf) {
+        int err = 0;
+        uint32_t dir = 0, subdir = 0;
+        pthread_mutex_lock(&plan->lock);
+        for (size_t i = 0; i < buf->count; i++) {
+                const PlanEntry *e = &buf->entries[i];
+                // Files of a directory come together, intern it once
+                if (i == 0 || e->dir != e[-1].dir) dir = 0;
+                if (i == 0 || e->subdir != e[-1].subdir) subdir = 0;
+                if (entry_add(plan, dir, buf->strings + e->dir,
+                              buf->strings + e->name, subdir,
+                              buf->strings + e->subdir, e->type,
+                              e->action) != 0) {
+                        err = -1;
+                        dir = subdir = 0;
+                        continue;
+                }
+                dir = plan->entries[plan->count - 1].dir;
+                subdir = plan->entries[plan->count - 1].subdir;
+        }
+        pthread_mutex_unlock(&plan->lock);
+        buf->count = 0;
+        buf->len = 0;
+        return err;
+}
+
+/*
+ * Copy str into a buffer, reusing the string at prev, the same field of the
+ * previous file, when it's the same
+*/
+static uint32_t buf_str(PlanBuf *buf, const char *str, const uint32_t *prev) {
+        if (prev && strcmp(buf->strings + *prev, str) == 0) return *prev;
+        uint32_t off = buf->len;
+        size_t len = strlen(str) + 1;
+        memcpy(buf->strings + off, str, len);
+        buf->len += len;
+        return off;
+}
+
+int plan_add(Plan *plan, int worker, const char *dir, const char *name,
+             const char *subdir, unsigned char type, PlanAction action) {
+        size_t need = strlen(dir) + strlen(name) + strlen(subdir) + 3;
+        if (worker < 0 || worker >= plan->nworkers || need > BUF_BYTES) {
+                pthread_mutex_lock(&plan->lock);
+                int err = entry_add(plan, 0, dir, name, 0, subdir, type,
+                                    action);
+                pthread_mutex_unlock(&plan->lock);
+                return err;
+        }
+
+        PlanBuf *buf = plan->bufs[worker];
+        if (!buf) {
+                buf = plan->bufs[worker] = malloc(sizeof(*buf));
+                if (!buf) return -1;
+                buf->count = 0;
+                buf->len = 0;
+        }
+        int err = 0;
+        if (buf->count == BUF_FILES || buf->len + need > BUF_BYTES)
+                err = buf_flush(plan, buf);
+
+        PlanEntry *prev = buf->count > 0 ? &buf->entries[buf->count - 1] :
+                                           NULL;
+        PlanEntry *e = &buf->entries[buf->count];
+        e->dir = buf_str(buf, dir, prev ? &prev->dir : NULL);
+        e->name = buf_str(buf, name, NULL);
+        e->subdir = buf_str(buf, subdir, prev ? &prev->subdir : NULL);
+        e->type = type;
+        e->action = action;
+        buf->count++;
+        return err;
+}
+
+int plan_flush(Plan *plan) {
+        int err = 0;
+        for (int i = 0; plan->bufs && i < plan->nworkers; i++) {
+                if (plan->bufs[i] && buf_flush(plan, plan->bufs[i]) != 0)
+                        err = -1;
+        }
+        return err;
+}
+
+const char *plan_root(const Plan *plan) {
+        return plan->strings + plan->root;
+}
+
+const char *plan_cwd(const Plan *plan) {
+        return plan->strings + plan->cwd;
+}
+
+static int entry_compare(const void *a, const void *b, void *arg) {
+        const PlanEntry *x = a;
+        const PlanEntry *y = b;
+        const char *strings = arg;
+
+        // Interned, equal offsets are equal strings
+        if (x->subdir != y->subdir)
+                return strcmp(strings + x->subdir, strings + y->subdir);
+        if (x->dir != y->dir) return strcmp(strings + x->dir, strings + y->dir);
+        return x->name < y->name ? -1 : x->name > y->name;
+}
+
+void plan_sort(Plan *plan) {
+        plan_flush(plan);
+        qsort_r(plan->entries, plan->count, sizeof(PlanEntry), entry_compare,
+                plan->strings);
+}
+
+int plan_save(const Plan *plan, const char *path) {
+        FILE *fp = fopen(path, "wb");
+        if (!fp) return -1;
+
+        PlanHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, PLAN_MAGIC, sizeof(hdr.magic));
+        hdr.version = PLAN_VERSION;
+        hdr.entry_size = sizeof(PlanEntry);
+        hdr.strings_len = plan->strings_len;
+        hdr.count = plan->count;
+        hdr.root = plan->root;
+        hdr.cwd = plan->cwd;
+
+        int err = fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+                  fwrite(plan->strings, 1, plan->strings_len, fp) !=
+                          plan->strings_len ||
+                  fwrite(plan->entries, sizeof(PlanEntry), plan->count, fp) !=
+                          plan->count;
+        if (fclose(fp) != 0) err = 1;
+        return err ? -1 : 0;
+}
+
+size_t plan_saved_size(const Plan *plan) {
+        return sizeof(PlanHeader) + plan->strings_len +
+               plan->count * sizeof(PlanEntry);
+}
+
+static int offset_valid(const Plan *plan, uint32_t off) {
+        return off > 0 && off < plan->strings_len;
+}
+
+int plan_load(Plan *plan, const char *path) {
+        memset(plan, 0, sizeof(*plan));
+        FILE *fp = fopen(path, "rb");
+        if (!fp) return -1;
+
+        PlanHeader hdr;
+        if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            memcmp(hdr.magic, PLAN_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != PLAN_VERSION || hdr.entry_size != sizeof(PlanEntry) ||
+            hdr.strings_len < 2 || hdr.strings_len > UINT32_MAX ||
+            hdr.count > SIZE_MAX / sizeof(PlanEntry)) {
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+        }
+
+        plan->strings_len = hdr.strings_len;
+        plan->strings_cap = hdr.strings_len;
+        plan->count = hdr.count;
+        plan->cap = hdr.count;
+        plan->root = hdr.root;
+        plan->cwd = hdr.cwd;
+        plan->strings = malloc(plan->strings_len);
+        plan->entries = malloc(plan->count ? plan->count * sizeof(PlanEntry) : 1);
+        pthread_mutex_init(&plan->lock, NULL);
+        if (!plan->strings || !plan->entries) {
+                fclose(fp);
+                plan_free(plan);
+                errno = ENOMEM;
+                return -1;
+        }
+
+        int err = fread(plan->strings, 1, plan->strings_len, fp) !=
+                          plan->strings_len ||
+                  fread(plan->entries, sizeof(PlanEntry), plan->count, fp) !=
+                          plan->count;
+        fclose(fp);
+
+        // Every string must end inside the arena
+        err = err || plan->strings[plan->strings_len - 1] != '\0' ||
+              !offset_valid(plan, plan->root) ||
+              !offset_valid(plan, plan->cwd);
+        for (size_t i = 0; !err && i < plan->count; i++) {
+                const PlanEntry *e = &plan->entries[i];
+                err = !offset_valid(plan, e->dir) ||
+                      !offset_valid(plan, e->name) ||
+                      !offset_valid(plan, e->subdir) || e->action > PLAN_DEDUP;
+        }
+        if (err) {
+                plan_free(plan);
+                errno = EINVAL;
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Descriptor of a source directory, from the worker's small cache
+*/
+static int src_open(Exec *exec, SrcDir *cache, int id, const ExecGroup *group,
+                    uint32_t dir) {
+        SrcDir *slot = &cache[dir % SRC_CACHE];
+        if (slot->fd >= 0 && slot->plan == group->plan && slot->dir == dir)
+                return slot->fd;
+
+        if (slot->fd >= 0) {
+                // Whatever still refers to the old descriptor must finish
+                if (exec->done) exec->done(id, group->arg);
+                close(slot->fd);
+        }
+        slot->plan = group->plan;
+        slot->dir = dir;
+        slot->fd = open(group->plan->strings + dir,
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        return slot->fd;
+}
+
+static void *exec_worker(void *data) {
+        ExecWorker *worker = data;
+        Exec *exec = worker->exec;
+        int id = worker->id;
+        SrcDir cache[SRC_CACHE];
+
+        for (int i = 0; i < SRC_CACHE; i++) {
+                cache[i].fd = -1;
+        }
+        for (;;) {
+                size_t g = __atomic_fetch_add(&exec->next, 1, __ATOMIC_RELAXED);
+                if (g >= exec->ngroups) break;
+
+                const ExecGroup *group = &exec->groups[g];
+                const Plan *plan = group->plan;
+                for (size_t i = group->start; i < group->end; i++) {
+                        const PlanEntry *e = &plan->entries[i];
+                        const char *dir = plan->strings + e->dir;
+                        int fd = src_open(exec, cache, id, group, e->dir);
+                        if (fd < 0) {
+                                log_message(ERROR,
+                                            "could not open directory %s: %s\n",
+                                            dir, strerror(errno));
+                                continue;
+                        }
+                        PlanStep step = {
+                                { fd, dir, plan->strings + e->name, e->type,
+                                  id },
+                                plan->strings + e->subdir,
+                                e->action,
+                                i,
+                        };
+                        exec->fn(&step, group->arg);
+                }
+                if (exec->done) exec->done(id, group->arg);
+        }
+        for (int i = 0; i < SRC_CACHE; i++) {
+                if (cache[i].fd >= 0) close(cache[i].fd);
+        }
+        return NULL;
+}
+
+int plan_execute(const Plan *plan, int nthreads, plan_fn fn,
+                 walk_done_fn done, void *arg) {
+        return plan_execute_all(&plan, &arg, 1, nthreads, fn, done);
+}
+
+/*
+ * Split a plan into chunks of its destination directories, appending them
+ * to groups
+*/
+static size_t plan_groups(const Plan *plan, void *arg, ExecGroup *groups) {
+        size_t n = 0;
+        for (size_t i = 0; i < plan->count; i++) {
+                if (i > 0 &&
+                    plan->entries[i].subdir == plan->entries[i - 1].subdir &&
+                    i - groups[n - 1].start < PLAN_CHUNK)
+                        continue;
+                if (n > 0) groups[n - 1].end = i;
+                groups[n].plan = plan;
+                groups[n].arg = arg;
+                groups[n].start = i;
+                n++;
+        }
+        if (n > 0) groups[n - 1].end = plan->count;
+        return n;
+}
+
+int plan_execute_all(const Plan **plans, void **args, size_t n,
+                     int nthreads, plan_fn fn, walk_done_fn done) {
+        if (nthreads < 1) nthreads = 1;
+
+        size_t total = 0;
+        for (size_t p = 0; p < n; p++) {
+                total += plans[p]->count;
+        }
+        Exec exec;
+        exec.fn = fn;
+        exec.done = done;
+        exec.next = 0;
+        exec.ngroups = 0;
+        exec.groups = malloc((total ? total : 1) * sizeof(*exec.groups));
+        ExecGroup *split = malloc((total ? total : 1) * sizeof(*split));
+        size_t *first = calloc(n + 1, sizeof(*first));
+        ExecWorker *workers = malloc(nthreads * sizeof(*workers));
+        pthread_t *threads = malloc(nthreads * sizeof(*threads));
+        if (!exec.groups || !split || !first || !workers || !threads) {
+                free(exec.groups);
+                free(split);
+                free(first);
+                free(workers);
+                free(threads);
+                return -1;
+        }
+
+        // Take a group of each plan in turn, so a large plan doesn't hold
+        // back the others
+        for (size_t p = 0; p < n; p++) {
+                first[p + 1] = first[p] +
+                               plan_groups(plans[p], args[p], split + first[p]);
+        }
+        for (size_t round = 0; exec.ngroups < first[n]; round++) {
+                for (size_t p = 0; p < n; p++) {
+                        if (first[p] + round < first[p + 1])
+                                exec.groups[exec.ngroups++] =
+                                        split[first[p] + round];
+                }
+        }
+        free(split);
+        free(first);
+
+        // The calling thread is worker 0
+        int started = 1;
+        for (int i = 0; i < nthreads; i++) {
+                workers[i].exec = &exec;
+                workers[i].id = i;
+        }
+        for (int i = 1; i < nthreads && (size_t)i < exec.ngroups; i++) {
+                if (pthread_create(&threads[i], NULL, exec_worker,
+                                   &workers[i]) != 0)
+                        break;
+                started++;
+        }
+        exec_worker(&workers[0]);
+        for (int i = 1; i < started; i++) {
+                pthread_join(threads[i], NULL);
+        }
+
+        free(exec.groups);
+        free(workers);
+        free(threads);
+        return 0;
+}
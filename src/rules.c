@@ -0,0 +1,517 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "rules.h"
+
+#define TABLE_INITIAL 64
+#define ARENA_INITIAL 4096
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define IMAGE_MAGIC "FORGRULE"
+#define IMAGE_VERSION 4
+#define PENDING_INITIAL 16
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+/*
+ * Header of a compiled rule image, followed by the string arena padded to 8
+ * bytes, then the slots of the tag, extension and signature tables, and
+ * last the byte classes, transitions and accepting paths of the pattern DFA
+*/
+typedef struct {
+        char magic[8];
+        uint32_t version;
+        uint32_t slot_size;
+        uint64_t conf_dev; // Identity of the config it was compiled from
+        uint64_t conf_ino;
+        uint64_t conf_size;
+        int64_t conf_mtime_sec;
+        int64_t conf_mtime_nsec;
+        uint64_t strings_len;
+        uint32_t tags_mask;
+        uint32_t tags_count;
+        uint32_t exts_mask;
+        uint32_t exts_count;
+        uint32_t magics_mask;
+        uint32_t magics_count;
+        uint32_t patterns_count;
+        uint32_t dfa_states;
+        uint32_t dfa_classes;
+        uint32_t reserved;
+        uint64_t conf_hash; // FNV-1a of the content of the config
+} RuleImage;
+
+static unsigned char fold(unsigned char c) {
+        return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static uint32_t hash_key(const char *key, size_t len, int icase) {
+        uint32_t h = FNV_OFFSET;
+        for (size_t i = 0; i < len; i++) {
+                unsigned char c = key[i];
+                h ^= icase ? fold(c) : c;
+                h *= FNV_PRIME;
+        }
+        return h;
+}
+
+static int key_equal(const char *a, const char *b, size_t len, int icase) {
+        if (!icase) return memcmp(a, b, len) == 0;
+        for (size_t i = 0; i < len; i++) {
+                if (fold(a[i]) != fold(b[i])) return 0;
+        }
+        return 1;
+}
+
+static const RuleTable *table_of(const RuleSet *rules, RuleKind kind) {
+        switch (kind) {
+        case RULE_TAG:
+                return &rules->tags;
+        case RULE_EXT:
+                return &rules->exts;
+        default:
+                return &rules->magics;
+        }
+}
+
+static int table_init(RuleTable *t) {
+        t->slots = calloc(TABLE_INITIAL, sizeof(*t->slots));
+        if (!t->slots) return -1;
+        t->mask = TABLE_INITIAL - 1;
+        t->count = 0;
+        return 0;
+}
+
+static RuleSlot *table_probe(const RuleTable *t, const char *strings,
+                             const char *key, size_t len, uint32_t hash,
+                             int icase) {
+        uint32_t i = hash & t->mask;
+        for (;;) {
+                RuleSlot *slot = &t->slots[i];
+                if (slot->key == 0) return slot;
+                if (slot->hash == hash && slot->key_len == len &&
+                    key_equal(strings + slot->key, key, len, icase))
+                        return slot;
+                i = (i + 1) & t->mask;
+        }
+}
+
+static int table_grow(RuleTable *t) {
+        uint32_t size = (t->mask + 1) * 2;
+        RuleSlot *slots = calloc(size, sizeof(*slots));
+        if (!slots) return -1;
+
+        for (uint32_t i = 0; i <= t->mask; i++) {
+                if (t->slots[i].key == 0) continue;
+                uint32_t j = t->slots[i].hash & (size - 1);
+                while (slots[j].key != 0) j = (j + 1) & (size - 1);
+                slots[j] = t->slots[i];
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->mask = size - 1;
+        return 0;
+}
+
+/*
+ * Copy len bytes into the arena and return their offset, or 0 on failure
+*/
+static uint32_t arena_add(RuleSet *rules, const char *str, size_t len) {
+        if (rules->strings_len + len + 1 > UINT32_MAX) return 0;
+        if (rules->strings_len + len + 1 > rules->strings_cap) {
+                size_t cap = rules->strings_cap * 2;
+                while (cap < rules->strings_len + len + 1) cap *= 2;
+                char *strings = realloc(rules->strings, cap);
+                if (!strings) return 0;
+                rules->strings = strings;
+                rules->strings_cap = cap;
+        }
+        uint32_t off = rules->strings_len;
+        memcpy(rules->strings + off, str, len);
+        rules->strings[off + len] = '\0';
+        rules->strings_len += len + 1;
+        return off;
+}
+
+static uint32_t intern(RuleSet *rules, const char *path, size_t len) {
+        uint32_t hash = hash_key(path, len, 0);
+        RuleSlot *slot = table_probe(&rules->paths, rules->strings, path, len,
+                                     hash, 0);
+        if (slot->key != 0) return slot->key;
+
+        uint32_t off = arena_add(rules, path, len);
+        if (off == 0) return 0;
+        slot->hash = hash;
+        slot->key = off;
+        slot->key_len = len;
+        slot->path = off;
+        rules->paths.count++;
+        if (rules->paths.count * 2 > rules->paths.mask &&
+            table_grow(&rules->paths) != 0)
+                return 0;
+        return off;
+}
+
+/*
+ * Intern a destination, ending it with a slash so names can be appended
+*/
+static uint32_t intern_path(RuleSet *rules, const char *dir) {
+        char path[PATH_MAX];
+        size_t len = strlen(dir);
+        if (len + 2 > sizeof(path)) {
+                errno = ENAMETOOLONG;
+                return 0;
+        }
+        memcpy(path, dir, len);
+        if (len == 0 || path[len - 1] != '/') path[len++] = '/';
+        path[len] = '\0';
+        return intern(rules, path, len);
+}
+
+int rules_init(RuleSet *rules) {
+        memset(rules, 0, sizeof(*rules));
+        rules->strings = malloc(ARENA_INITIAL);
+        if (!rules->strings) return -1;
+        rules->strings[0] = '\0';
+        rules->strings_len = 1;
+        rules->strings_cap = ARENA_INITIAL;
+
+        if (table_init(&rules->tags) != 0 || table_init(&rules->exts) != 0 ||
+            table_init(&rules->magics) != 0 ||
+            table_init(&rules->paths) != 0) {
+                rules_free(rules);
+                return -1;
+        }
+        return 0;
+}
+
+void rules_free(RuleSet *rules) {
+        if (rules->image) {
+                munmap(rules->image, rules->image_len);
+        } else {
+                free(rules->strings);
+                free(rules->tags.slots);
+                free(rules->exts.slots);
+                free(rules->magics.slots);
+                pattern_free(&rules->patterns);
+        }
+        free(rules->pending);
+        free(rules->paths.slots);
+        memset(rules, 0, sizeof(*rules));
+}
+
+/*
+ * Keep a glob or regex until rules_compile
+*/
+static int pattern_add(RuleSet *rules, RuleKind kind, const char *text,
+                       const char *path) {
+        PatternKind pkind = kind == RULE_GLOB ? PATTERN_GLOB : PATTERN_REGEX;
+        if (pattern_check(pkind, text) != 0) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (rules->pending_count == rules->pending_cap) {
+                uint32_t cap = rules->pending_cap ? rules->pending_cap * 2
+                                                  : PENDING_INITIAL;
+                RulePattern *pending =
+                        realloc(rules->pending, cap * sizeof(*pending));
+                if (!pending) return -1;
+                rules->pending = pending;
+                rules->pending_cap = cap;
+        }
+
+        uint32_t path_off = intern_path(rules, path);
+        uint32_t text_off =
+                path_off ? arena_add(rules, text, strlen(text)) : 0;
+        if (text_off == 0) return -1;
+        RulePattern *pattern = &rules->pending[rules->pending_count++];
+        pattern->kind = pkind;
+        pattern->text = text_off;
+        pattern->path = path_off;
+        return 0;
+}
+
+int rules_add(RuleSet *rules, RuleKind kind, const char *key,
+              const char *path) {
+        if (kind == RULE_GLOB || kind == RULE_RE)
+                return pattern_add(rules, kind, key, path);
+
+        RuleTable *t = (RuleTable *)table_of(rules, kind);
+        int icase = kind != RULE_TAG;
+        size_t len = strlen(key);
+        uint32_t hash = hash_key(key, len, icase);
+
+        RuleSlot *slot = table_probe(t, rules->strings, key, len, hash, icase);
+        if (slot->key != 0) return 1;
+
+        uint32_t path_off = intern_path(rules, path);
+        uint32_t key_off = path_off ? arena_add(rules, key, len) : 0;
+        if (key_off == 0) return -1;
+
+        slot->hash = hash;
+        slot->key = key_off;
+        slot->key_len = len;
+        slot->path = path_off;
+        t->count++;
+        if (t->count * 2 > t->mask && table_grow(t) != 0) return -1;
+        return 0;
+}
+
+const char *rules_find(const RuleSet *rules, RuleKind kind, const char *key,
+                       size_t len) {
+        const RuleTable *t = table_of(rules, kind);
+        int icase = kind != RULE_TAG;
+        if (t->count == 0) return NULL;
+
+        uint32_t hash = hash_key(key, len, icase);
+        const RuleSlot *slot =
+                table_probe(t, rules->strings, key, len, hash, icase);
+        return slot->key != 0 ? rules->strings + slot->path : NULL;
+}
+
+int rules_compile(RuleSet *rules) {
+        if (rules->pending_count == 0) return 0;
+        PatternSpec *specs =
+                malloc((rules->pending_count + 1) * sizeof(*specs));
+        if (!specs) return -1;
+        for (uint32_t i = 0; i < rules->pending_count; i++) {
+                const RulePattern *pattern = &rules->pending[i];
+                specs[i].kind = pattern->kind;
+                specs[i].text = rules->strings + pattern->text;
+                specs[i].value = pattern->path;
+        }
+
+        PatternDfa dfa;
+        int err = pattern_compile(&dfa, specs, rules->pending_count);
+        free(specs);
+        if (err) return -1;
+        pattern_free(&rules->patterns);
+        rules->patterns = dfa;
+        return 0;
+}
+
+const char *rules_match(const RuleSet *rules, const char *name, size_t len) {
+        uint32_t path = pattern_match(&rules->patterns, name, len);
+        return path ? rules->strings + path : NULL;
+}
+
+static uint64_t hash64(uint64_t h, const void *data, size_t len) {
+        const unsigned char *p = data;
+        for (size_t i = 0; i < len; i++) {
+                h ^= p[i];
+                h *= 1099511628211ULL;
+        }
+        return h;
+}
+
+int rules_conf_hash(const char *path, uint64_t *hash) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        char buf[16384];
+        uint64_t h = 14695981039346656037ULL;
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) h = hash64(h, buf, n);
+        close(fd);
+        if (n < 0) return -1;
+        *hash = h;
+        return 0;
+}
+
+static void image_key(RuleImage *hdr, const struct stat *conf,
+                      uint64_t conf_hash) {
+        hdr->conf_hash = conf_hash;
+        hdr->conf_dev = conf->st_dev;
+        hdr->conf_ino = conf->st_ino;
+        hdr->conf_size = conf->st_size;
+        hdr->conf_mtime_sec = conf->st_mtim.tv_sec;
+        hdr->conf_mtime_nsec = conf->st_mtim.tv_nsec;
+}
+
+int rules_save(const RuleSet *rules, const char *path,
+               const struct stat *conf, uint64_t conf_hash) {
+        RuleImage hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+        hdr.version = IMAGE_VERSION;
+        hdr.slot_size = sizeof(RuleSlot);
+        image_key(&hdr, conf, conf_hash);
+        hdr.strings_len = rules->strings_len;
+        hdr.tags_mask = rules->tags.mask;
+        hdr.tags_count = rules->tags.count;
+        hdr.exts_mask = rules->exts.mask;
+        hdr.exts_count = rules->exts.count;
+        hdr.magics_mask = rules->magics.mask;
+        hdr.magics_count = rules->magics.count;
+        const PatternDfa *dfa = &rules->patterns;
+        hdr.patterns_count = dfa->count;
+        hdr.dfa_states = dfa->nstates;
+        hdr.dfa_classes = dfa->nclasses;
+
+        // Named after the process, so concurrent runs don't share it
+        size_t len = strlen(path) + 32;
+        char *tmp = malloc(len);
+        if (!tmp) return -1;
+        snprintf(tmp, len, "%s.%ld.tmp", path, (long)getpid());
+
+        FILE *fp = fopen(tmp, "wb");
+        if (!fp) {
+                free(tmp);
+                return -1;
+        }
+        static const char pad[8];
+        size_t padding = ALIGN8(rules->strings_len) - rules->strings_len;
+        size_t ntags = (size_t)rules->tags.mask + 1;
+        size_t nexts = (size_t)rules->exts.mask + 1;
+        size_t nmagics = (size_t)rules->magics.mask + 1;
+        size_t nnext = (size_t)dfa->nstates * dfa->nclasses;
+        int err = fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+                  fwrite(rules->strings, 1, rules->strings_len, fp) !=
+                          rules->strings_len ||
+                  fwrite(pad, 1, padding, fp) != padding ||
+                  fwrite(rules->tags.slots, sizeof(RuleSlot), ntags, fp) !=
+                          ntags ||
+                  fwrite(rules->exts.slots, sizeof(RuleSlot), nexts, fp) !=
+                          nexts ||
+                  fwrite(rules->magics.slots, sizeof(RuleSlot), nmagics, fp) !=
+                          nmagics ||
+                  fwrite(dfa->classes, 1, sizeof(dfa->classes), fp) !=
+                          sizeof(dfa->classes) ||
+                  fwrite(dfa->next, sizeof(uint32_t), nnext, fp) != nnext ||
+                  fwrite(dfa->accept, sizeof(uint32_t), dfa->nstates, fp) !=
+                          dfa->nstates;
+        if (fclose(fp) != 0) err = 1;
+        // Readers only ever see a complete image
+        if (!err) err = rename(tmp, path) != 0;
+        if (err) unlink(tmp);
+        free(tmp);
+        return err ? -1 : 0;
+}
+
+/*
+ * Check the shape of a mapped table and every slot of it. Lookups stop at an
+ * empty slot, so one must be left.
+*/
+static int table_valid(const RuleTable *t, size_t strings_len) {
+        uint32_t size = t->mask + 1;
+        if (size == 0 || (size & t->mask) != 0 || t->count * 2 > size)
+                return 0;
+        uint32_t used = 0;
+        for (uint32_t i = 0; i < size; i++) {
+                const RuleSlot *slot = &t->slots[i];
+                if (slot->key == 0) continue;
+                if ((uint64_t)slot->key + slot->key_len >= strings_len ||
+                    slot->path >= strings_len)
+                        return 0;
+                used++;
+        }
+        return used == t->count;
+}
+
+/*
+ * Check the shape, byte classes and every transition of a mapped DFA
+*/
+static int dfa_valid(const PatternDfa *dfa, size_t strings_len) {
+        if (dfa->nstates == 0) return 1;
+        if (dfa->nstates < 2 || dfa->nclasses == 0 || dfa->nclasses > 256)
+                return 0;
+        for (int c = 0; c < 256; c++) {
+                if (dfa->classes[c] >= dfa->nclasses) return 0;
+        }
+        size_t nnext = (size_t)dfa->nstates * dfa->nclasses;
+        for (size_t i = 0; i < nnext; i++) {
+                if (dfa->next[i] >= dfa->nstates) return 0;
+        }
+        for (uint32_t i = 0; i < dfa->nstates; i++) {
+                if (dfa->accept[i] >= strings_len) return 0;
+        }
+        return 1;
+}
+
+int rules_map(RuleSet *rules, const char *path, const struct stat *conf,
+              uint64_t conf_hash) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return errno == ENOENT ? 1 : -1;
+
+        struct stat st;
+        RuleImage *hdr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(RuleImage))
+                hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (hdr == MAP_FAILED) return 1;
+        size_t len = st.st_size;
+
+        RuleImage key;
+        image_key(&key, conf, conf_hash);
+        int valid = memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) == 0 &&
+                    hdr->version == IMAGE_VERSION &&
+                    hdr->slot_size == sizeof(RuleSlot) &&
+                    hdr->conf_dev == key.conf_dev &&
+                    hdr->conf_ino == key.conf_ino &&
+                    hdr->conf_size == key.conf_size &&
+                    hdr->conf_mtime_sec == key.conf_mtime_sec &&
+                    hdr->conf_mtime_nsec == key.conf_mtime_nsec &&
+                    hdr->conf_hash == key.conf_hash &&
+                    hdr->strings_len > 0 && hdr->strings_len < UINT32_MAX;
+        size_t tags_off = 0;
+        size_t exts_off = 0;
+        size_t magics_off = 0;
+        size_t dfa_off = 0;
+        if (valid) {
+                tags_off = sizeof(RuleImage) + ALIGN8(hdr->strings_len);
+                exts_off = tags_off +
+                           ((size_t)hdr->tags_mask + 1) * sizeof(RuleSlot);
+                magics_off = exts_off +
+                             ((size_t)hdr->exts_mask + 1) * sizeof(RuleSlot);
+                dfa_off = magics_off +
+                          ((size_t)hdr->magics_mask + 1) * sizeof(RuleSlot);
+                size_t dfa_len = 256 + ((size_t)hdr->dfa_states *
+                                                hdr->dfa_classes +
+                                        hdr->dfa_states) *
+                                               sizeof(uint32_t);
+                valid = hdr->dfa_classes <= 256 && dfa_off <= len &&
+                        dfa_len == len - dfa_off;
+        }
+
+        RuleSet mapped;
+        memset(&mapped, 0, sizeof(mapped));
+        if (valid) {
+                char *base = (char *)hdr;
+                mapped.strings = base + sizeof(RuleImage);
+                mapped.strings_len = hdr->strings_len;
+                mapped.strings_cap = hdr->strings_len;
+                mapped.tags.slots = (RuleSlot *)(base + tags_off);
+                mapped.tags.mask = hdr->tags_mask;
+                mapped.tags.count = hdr->tags_count;
+                mapped.exts.slots = (RuleSlot *)(base + exts_off);
+                mapped.exts.mask = hdr->exts_mask;
+                mapped.exts.count = hdr->exts_count;
+                mapped.magics.slots = (RuleSlot *)(base + magics_off);
+                mapped.magics.mask = hdr->magics_mask;
+                mapped.magics.count = hdr->magics_count;
+                PatternDfa *dfa = &mapped.patterns;
+                memcpy(dfa->classes, base + dfa_off, sizeof(dfa->classes));
+                dfa->nclasses = hdr->dfa_classes;
+                dfa->nstates = hdr->dfa_states;
+                dfa->count = hdr->patterns_count;
+                dfa->next = (uint32_t *)(base + dfa_off + 256);
+                dfa->accept = dfa->next + (size_t)dfa->nstates * dfa->nclasses;
+                mapped.image = hdr;
+                mapped.image_len = len;
+                valid = mapped.strings[0] == '\0' &&
+                        mapped.strings[mapped.strings_len - 1] == '\0' &&
+                        table_valid(&mapped.tags, mapped.strings_len) &&
+                        table_valid(&mapped.exts, mapped.strings_len) &&
+                        table_valid(&mapped.magics, mapped.strings_len) &&
+                        dfa_valid(&mapped.patterns, mapped.strings_len);
+        }
+        if (!valid) {
+                munmap(hdr, len);
+                return 1;
+        }
+        *rules = mapped;
+        return 0;
+}
@@ -0,0 +1,302 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "scanindex.h"
+
+#define SCAN_MAGIC "FORGSCAN"
+#define SCAN_VERSION 2
+#define SLOTS_INITIAL 1024
+#define NAMES_INITIAL (64 << 10)
+
+#define SCAN_USED 0x1
+#define SCAN_CLEAN 0x2 // Nothing in it needed handling when it was read
+
+static size_t map_size(uint32_t slots, uint64_t names_cap) {
+        return sizeof(ScanHeader) + (size_t)slots * sizeof(ScanRecord) +
+               names_cap;
+}
+
+static void attach(ScanIndex *index, int fd, void *map, size_t len) {
+        index->fd = fd;
+        index->map = map;
+        index->map_len = len;
+        index->hdr = map;
+        index->records = (ScanRecord *)(index->hdr + 1);
+        index->names = (char *)(index->records + index->hdr->slots);
+}
+
+static void detach(ScanIndex *index) {
+        if (index->map) munmap(index->map, index->map_len);
+        if (index->fd >= 0) close(index->fd);
+        index->map = NULL;
+        index->hdr = NULL;
+        index->fd = -1;
+}
+
+static ScanRecord *record_probe(ScanRecord *records, uint32_t slots,
+                                uint64_t dev, uint64_t ino) {
+        uint64_t h = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        uint32_t i = h & (slots - 1);
+        while ((records[i].flags & SCAN_USED) &&
+               (records[i].dev != dev || records[i].ino != ino)) {
+                i = (i + 1) & (slots - 1);
+        }
+        return &records[i];
+}
+
+/*
+ * Write a new index file holding the records of the current one, compacting
+ * their names, and switch to it. Records not visited by this run are dropped
+ * when drop_stale is set.
+*/
+static int rebuild(ScanIndex *index, uint32_t slots, uint64_t names_cap,
+                   uint64_t key, uint32_t generation, int drop_stale) {
+        // Named after the process, so concurrent runs don't share it
+        size_t tmp_len = strlen(index->path) + 32;
+        char *tmp = malloc(tmp_len);
+        if (!tmp) return -1;
+        snprintf(tmp, tmp_len, "%s.%ld.tmp", index->path, (long)getpid());
+
+        size_t len = map_size(slots, names_cap);
+        int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        void *map = MAP_FAILED;
+        if (fd >= 0 && ftruncate(fd, len) == 0)
+                map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                           0);
+        if (map == MAP_FAILED) {
+                if (fd >= 0) close(fd);
+                unlink(tmp);
+                free(tmp);
+                return -1;
+        }
+
+        ScanHeader *hdr = map;
+        memcpy(hdr->magic, SCAN_MAGIC, sizeof(hdr->magic));
+        hdr->version = SCAN_VERSION;
+        hdr->dirty = 1;
+        hdr->key = key;
+        hdr->generation = generation;
+        hdr->slots = slots;
+        hdr->record_size = sizeof(ScanRecord);
+        hdr->names_cap = names_cap;
+        ScanRecord *records = (ScanRecord *)(hdr + 1);
+        char *names = (char *)(records + slots);
+
+        for (uint32_t i = 0; index->hdr && i < index->hdr->slots; i++) {
+                ScanRecord r = index->records[i];
+                if (!(r.flags & SCAN_USED)) continue;
+                if (drop_stale && r.seen != generation) continue;
+                if (r.flags & SCAN_CLEAN) {
+                        memcpy(names + hdr->names_len, index->names + r.names,
+                               r.names_len);
+                        r.names = hdr->names_len;
+                        hdr->names_len += r.names_len;
+                } else {
+                        r.names = 0;
+                        r.names_len = 0;
+                }
+                *record_probe(records, slots, r.dev, r.ino) = r;
+                hdr->count++;
+        }
+
+        int err = rename(tmp, index->path);
+        free(tmp);
+        if (err) {
+                munmap(map, len);
+                close(fd);
+                return -1;
+        }
+        detach(index);
+        attach(index, fd, map, len);
+        return 0;
+}
+
+int scanindex_open(ScanIndex *index, const char *path, uint64_t key,
+                   int full) {
+        memset(index, 0, sizeof(*index));
+        index->fd = -1;
+        index->path = strdup(path);
+        if (!index->path) return -1;
+        pthread_mutex_init(&index->lock, NULL);
+        // The clock file timestamps come from, so none set later is earlier
+        if (clock_gettime(CLOCK_REALTIME_COARSE, &index->start) != 0) {
+                // Nothing will be recorded clean
+                index->start.tv_sec = 0;
+                index->start.tv_nsec = 0;
+        }
+
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fd >= 0 && fstat(fd, &st) == 0 &&
+            (size_t)st.st_size >= sizeof(ScanHeader))
+                map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+                ScanHeader *hdr = map;
+                int valid =
+                        !full &&
+                        memcmp(hdr->magic, SCAN_MAGIC, sizeof(hdr->magic)) ==
+                                0 &&
+                        hdr->version == SCAN_VERSION && !hdr->dirty &&
+                        hdr->key == key &&
+                        hdr->record_size == sizeof(ScanRecord) &&
+                        hdr->slots > 0 &&
+                        (hdr->slots & (hdr->slots - 1)) == 0 &&
+                        hdr->count < hdr->slots &&
+                        hdr->names_len <= hdr->names_cap &&
+                        map_size(hdr->slots, hdr->names_cap) ==
+                                (size_t)st.st_size;
+                if (valid) {
+                        attach(index, fd, map, st.st_size);
+                        hdr->generation++;
+                        // On disk before any record changes, so a run cut
+                        // short leaves an index that won't be trusted
+                        hdr->dirty = 1;
+                        if (msync(map, sizeof(ScanHeader), MS_SYNC) == 0)
+                                return 0;
+                        detach(index);
+                        fd = -1;
+                } else {
+                        munmap(map, st.st_size);
+                }
+        }
+        if (fd >= 0) close(fd);
+
+        if (rebuild(index, SLOTS_INITIAL, NAMES_INITIAL, key, 1, 0) != 0) {
+                free(index->path);
+                pthread_mutex_destroy(&index->lock);
+                return -1;
+        }
+        return 0;
+}
+
+static int unchanged(const ScanRecord *r, const struct stat *st) {
+        return r->mtime_sec == st->st_mtim.tv_sec &&
+               r->mtime_nsec == st->st_mtim.tv_nsec &&
+               r->ctime_sec == st->st_ctim.tv_sec &&
+               r->ctime_nsec == st->st_ctim.tv_nsec;
+}
+
+static int before(const struct timespec *t, const struct timespec *start) {
+        return t->tv_sec < start->tv_sec ||
+               (t->tv_sec == start->tv_sec && t->tv_nsec < start->tv_nsec);
+}
+
+int scanindex_lookup(ScanIndex *index, const struct stat *st, char **names,
+                     size_t *len) {
+        int hit = 0;
+        pthread_mutex_lock(&index->lock);
+        ScanRecord *r = record_probe(index->records, index->hdr->slots,
+                                     st->st_dev, st->st_ino);
+        if (r->flags & SCAN_USED) {
+                r->seen = index->hdr->generation;
+                hit = (r->flags & SCAN_CLEAN) && unchanged(r, st) &&
+                      r->names + r->names_len <= index->hdr->names_len &&
+                      (r->names_len == 0 ||
+                       index->names[r->names + r->names_len - 1] == '\0');
+        }
+        if (hit) {
+                *names = malloc(r->names_len ? r->names_len : 1);
+                hit = *names != NULL;
+        }
+        if (hit) {
+                memcpy(*names, index->names + r->names, r->names_len);
+                *len = r->names_len;
+                index->skipped++;
+        }
+        pthread_mutex_unlock(&index->lock);
+        return hit;
+}
+
+void scanindex_update(ScanIndex *index, const struct stat *st,
+                      const char *names, size_t len, int clean) {
+        pthread_mutex_lock(&index->lock);
+        ScanHeader *hdr = index->hdr;
+        index->read++;
+
+        ScanRecord *r = record_probe(index->records, hdr->slots, st->st_dev,
+                                     st->st_ino);
+        if (!(r->flags & SCAN_USED)) {
+                if ((hdr->count + 1) * 2 > hdr->slots) {
+                        if (rebuild(index, hdr->slots * 2, hdr->names_cap,
+                                    hdr->key, hdr->generation, 0) != 0)
+                                goto out;
+                        hdr = index->hdr;
+                        r = record_probe(index->records, hdr->slots,
+                                         st->st_dev, st->st_ino);
+                }
+                memset(r, 0, sizeof(*r));
+                r->dev = st->st_dev;
+                r->ino = st->st_ino;
+                r->flags = SCAN_USED;
+                hdr->count++;
+        }
+        r->seen = hdr->generation;
+        r->mtime_sec = st->st_mtim.tv_sec;
+        r->mtime_nsec = st->st_mtim.tv_nsec;
+        r->ctime_sec = st->st_ctim.tv_sec;
+        r->ctime_nsec = st->st_ctim.tv_nsec;
+
+        // Racily clean, a change in the same tick would keep its timestamps
+        if (!before(&st->st_mtim, &index->start) ||
+            !before(&st->st_ctim, &index->start))
+                clean = 0;
+        if (!clean) {
+                hdr->garbage += r->names_len;
+                r->names_len = 0;
+                r->flags = SCAN_USED;
+                goto out;
+        }
+        if (r->names_len != len ||
+            memcmp(index->names + r->names, names, len) != 0) {
+                if (hdr->names_len + len > hdr->names_cap) {
+                        uint64_t cap = hdr->names_cap * 2;
+                        while (cap < hdr->names_len + len) cap *= 2;
+                        // Clear the record first, so it isn't left half done
+                        r->flags = SCAN_USED;
+                        if (rebuild(index, hdr->slots, cap, hdr->key,
+                                    hdr->generation, 0) != 0)
+                                goto out;
+                        hdr = index->hdr;
+                        r = record_probe(index->records, hdr->slots,
+                                         st->st_dev, st->st_ino);
+                }
+                hdr->garbage += r->names_len;
+                memcpy(index->names + hdr->names_len, names, len);
+                r->names = hdr->names_len;
+                r->names_len = len;
+                hdr->names_len += len;
+        }
+        r->flags = SCAN_USED | SCAN_CLEAN;
+out:
+        pthread_mutex_unlock(&index->lock);
+}
+
+int scanindex_close(ScanIndex *index) {
+        ScanHeader *hdr = index->hdr;
+        uint32_t stale = 0;
+        for (uint32_t i = 0; i < hdr->slots; i++) {
+                const ScanRecord *r = &index->records[i];
+                if ((r->flags & SCAN_USED) && r->seen != hdr->generation)
+                        stale++;
+        }
+        // Every live directory was visited, whatever wasn't is gone
+        if (stale * 4 > hdr->count || hdr->garbage * 2 > hdr->names_len)
+                rebuild(index, hdr->slots, hdr->names_cap, hdr->key,
+                        hdr->generation, 1);
+
+        int err = msync(index->map, index->map_len, MS_SYNC);
+        index->hdr->dirty = 0;
+        if (msync(index->map, sizeof(ScanHeader), MS_SYNC) != 0) err = -1;
+        detach(index);
+        free(index->path);
+        pthread_mutex_destroy(&index->lock);
+        return err ? -1 : 0;
+}
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+static const char *phase_names[STAT_PHASES] = {
+        "scan", "classify", "mkdir", "move", "hash",
+};
+
+static const char *counter_names[STAT_COUNTERS] = {
+        "seen", "matched", "moved", "skipped", "duplicates", "errors",
+};
+
+int stats_init(Stats *stats, int nslots, int timed) {
+        void *slots;
+        if (nslots < 1) nslots = 1;
+        if (posix_memalign(&slots, sizeof(StatSlot),
+                           nslots * sizeof(StatSlot)) != 0)
+                return -1;
+        memset(slots, 0, nslots * sizeof(StatSlot));
+        stats->slots = slots;
+        stats->nslots = nslots;
+        stats->timed = timed;
+        return 0;
+}
+
+void stats_free(Stats *stats) {
+        free(stats->slots);
+        stats->slots = NULL;
+        stats->nslots = 0;
+}
+
+uint64_t stats_clock(const Stats *stats) {
+        if (!stats->timed) return 0;
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_time(Stats *stats, int worker, StatPhase phase, uint64_t start) {
+        if (!stats->timed) return;
+        stats->slots[worker].nsec[phase] += stats_clock(stats) - start;
+}
+
+void stats_count(Stats *stats, int worker, StatCounter counter, uint64_t n) {
+        stats->slots[worker].count[counter] += n;
+}
+
+CopyStats *stats_copy(Stats *stats, int worker) {
+        return &stats->slots[worker].copy;
+}
+
+void stats_merge(const Stats *stats, StatSlot *total) {
+        memset(total, 0, sizeof(*total));
+        for (int i = 0; i < stats->nslots; i++) {
+                const StatSlot *s = &stats->slots[i];
+                for (int p = 0; p < STAT_PHASES; p++) {
+                        total->nsec[p] += s->nsec[p];
+                }
+                for (int c = 0; c < STAT_COUNTERS; c++) {
+                        total->count[c] += s->count[c];
+                }
+                total->copy.files += s->copy.files;
+                total->copy.bytes += s->copy.bytes;
+                total->copy.nsec += s->copy.nsec;
+        }
+}
+
+static void report_text(const StatSlot *t, const StatCache *caches, size_t n,
+                        int timed, FILE *out) {
+        fprintf(out, "Files:");
+        for (int c = 0; c < STAT_COUNTERS; c++) {
+                fprintf(out, "%s %lu %s", c ? "," : "",
+                        (unsigned long)t->count[c], counter_names[c]);
+        }
+        fprintf(out, "\n");
+
+        double mib = t->copy.bytes / 1048576.0;
+        double secs = t->copy.nsec / 1e9;
+        fprintf(out, "Copied: %lu files, %.1f MiB in %.2fs (%.1f MiB/s)\n",
+                t->copy.files, mib, secs, secs > 0 ? mib / secs : 0.0);
+
+        if (timed) {
+                fprintf(out, "Time:");
+                for (int p = 0; p < STAT_PHASES; p++) {
+                        fprintf(out, "%s %s %.3fs", p ? "," : "",
+                                phase_names[p], t->nsec[p] / 1e9);
+                }
+                fprintf(out, "\n");
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                unsigned long lookups = caches[i].hits + caches[i].misses;
+                fprintf(out, "Cache %s: %lu hits, %lu misses", caches[i].name,
+                        caches[i].hits, caches[i].misses);
+                if (lookups > 0)
+                        fprintf(out, " (%.1f%%)",
+                                100.0 * caches[i].hits / lookups);
+                fprintf(out, "\n");
+        }
+}
+
+static void report_json(const StatSlot *t, const StatCache *caches, size_t n,
+                        int timed, FILE *out) {
+        fprintf(out, "{\"files\":{");
+        for (int c = 0; c < STAT_COUNTERS; c++) {
+                fprintf(out, "%s\"%s\":%lu", c ? "," : "", counter_names[c],
+                        (unsigned long)t->count[c]);
+        }
+        fprintf(out, "},\"copied\":{\"files\":%lu,\"bytes\":%llu,\"ns\":%llu}",
+                t->copy.files, t->copy.bytes, t->copy.nsec);
+
+        if (timed) {
+                fprintf(out, ",\"ns\":{");
+                for (int p = 0; p < STAT_PHASES; p++) {
+                        fprintf(out, "%s\"%s\":%lu", p ? "," : "",
+                                phase_names[p], (unsigned long)t->nsec[p]);
+                }
+                fprintf(out, "}");
+        }
+
+        fprintf(out, ",\"caches\":{");
+        for (size_t i = 0; i < n; i++) {
+                unsigned long lookups = caches[i].hits + caches[i].misses;
+                fprintf(out, "%s\"%s\":{\"hits\":%lu,\"misses\":%lu,",
+                        i ? "," : "", caches[i].name, caches[i].hits,
+                        caches[i].misses);
+                if (lookups > 0)
+                        fprintf(out, "\"rate\":%.4f}",
+                                (double)caches[i].hits / lookups);
+                else
+                        fprintf(out, "\"rate\":null}");
+        }
+        fprintf(out, "}}\n");
+}
+
+void stats_report(const Stats *stats, const StatCache *caches, size_t n,
+                  StatFormat format, FILE *out) {
+        StatSlot total;
+        stats_merge(stats, &total);
+        if (format == STATS_JSON)
+                report_json(&total, caches, n, stats->timed, out);
+        else
+                report_text(&total, caches, n, stats->timed, out);
+}
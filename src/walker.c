@@ -0,0 +1,434 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "logbuf.h"
+#include "walker.h"
+
+#define DEQUE_INITIAL 64
+#define IDLE_WAIT_NS 2000000L
+
+typedef struct WalkDir WalkDir;
+
+/*
+ * A directory waiting to be read, or being read
+*/
+struct WalkDir {
+        WalkDir *parent; // Opened relative to this one, NULL for the root
+        const WalkRoot *root; // The tree it belongs to
+        DIR *dir; // Kept open while queued children still need it
+        char *path;
+        size_t name_off; // Offset of the last component in path
+        int refs;
+};
+
+typedef struct {
+        pthread_mutex_t lock;
+        WalkDir **items;
+        size_t cap;
+        size_t top; // Thieves take from here
+        size_t bottom; // Owner pushes and pops here
+} Deque;
+
+typedef struct {
+        Deque *deques;
+        int nthreads;
+        walk_fn fn;
+        walk_done_fn done;
+        long pending; // Directories queued or being read
+        int sleepers;
+        pthread_mutex_t idle_lock;
+        pthread_cond_t idle_cond;
+} Walk;
+
+typedef struct {
+        Walk *walk;
+        int id;
+} Worker;
+
+static void walkdir_release(WalkDir *node);
+
+static void deque_init(Deque *d) {
+        pthread_mutex_init(&d->lock, NULL);
+        d->items = NULL;
+        d->cap = 0;
+        d->top = 0;
+        d->bottom = 0;
+}
+
+static void deque_free(Deque *d) {
+        for (size_t i = d->top; i < d->bottom; i++) {
+                WalkDir *node = d->items[i % d->cap];
+                if (node->parent) walkdir_release(node->parent);
+                walkdir_release(node);
+        }
+        free(d->items);
+        pthread_mutex_destroy(&d->lock);
+}
+
+static int deque_push(Deque *d, WalkDir *item) {
+        pthread_mutex_lock(&d->lock);
+        if (d->bottom - d->top == d->cap) {
+                size_t cap = d->cap ? d->cap * 2 : DEQUE_INITIAL;
+                WalkDir **items = malloc(cap * sizeof(*items));
+                if (!items) {
+                        pthread_mutex_unlock(&d->lock);
+                        return -1;
+                }
+                size_t n = d->bottom - d->top;
+                for (size_t i = 0; i < n; i++) {
+                        items[i] = d->items[(d->top + i) % d->cap];
+                }
+                free(d->items);
+                d->items = items;
+                d->cap = cap;
+                d->top = 0;
+                d->bottom = n;
+        }
+        d->items[d->bottom % d->cap] = item;
+        d->bottom++;
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+}
+
+static WalkDir *deque_pop(Deque *d) {
+        WalkDir *item = NULL;
+        pthread_mutex_lock(&d->lock);
+        if (d->bottom > d->top) {
+                d->bottom--;
+                item = d->items[d->bottom % d->cap];
+        }
+        pthread_mutex_unlock(&d->lock);
+        return item;
+}
+
+static WalkDir *deque_steal(Deque *d) {
+        WalkDir *item = NULL;
+        // Don't queue up behind the owner, try the next victim instead
+        if (pthread_mutex_trylock(&d->lock) != 0) return NULL;
+        if (d->bottom > d->top) {
+                item = d->items[d->top % d->cap];
+                d->top++;
+        }
+        pthread_mutex_unlock(&d->lock);
+        return item;
+}
+
+static void walkdir_release(WalkDir *node) {
+        if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+        if (node->dir) closedir(node->dir);
+        free(node->path);
+        free(node);
+}
+
+static WalkDir *walkdir_new(WalkDir *parent, const WalkRoot *root,
+                            const char *name) {
+        WalkDir *node = malloc(sizeof(*node));
+        if (!node) return NULL;
+
+        size_t len = strlen(name) + 1;
+        size_t off = 0;
+        if (parent) {
+                off = strlen(parent->path) + 1;
+                len += off;
+        }
+        node->path = malloc(len);
+        if (!node->path) {
+                free(node);
+                return NULL;
+        }
+        if (parent) {
+                snprintf(node->path, len, "%s/%s", parent->path, name);
+                __atomic_add_fetch(&parent->refs, 1, __ATOMIC_ACQ_REL);
+        } else {
+                memcpy(node->path, name, len);
+        }
+        node->parent = parent;
+        node->root = root;
+        node->dir = NULL;
+        node->name_off = off;
+        node->refs = 1;
+        return node;
+}
+
+static void walk_push(Walk *w, int id, WalkDir *node) {
+        __atomic_add_fetch(&w->pending, 1, __ATOMIC_SEQ_CST);
+        if (deque_push(&w->deques[id], node) != 0) {
+                log_message(ERROR, "out of memory, skipping %s\n",
+                            node->path);
+                if (node->parent) walkdir_release(node->parent);
+                walkdir_release(node);
+                __atomic_sub_fetch(&w->pending, 1, __ATOMIC_SEQ_CST);
+                return;
+        }
+        if (__atomic_load_n(&w->sleepers, __ATOMIC_SEQ_CST) > 0) {
+                pthread_mutex_lock(&w->idle_lock);
+                pthread_cond_signal(&w->idle_cond);
+                pthread_mutex_unlock(&w->idle_lock);
+        }
+}
+
+static void walk_done(Walk *w) {
+        if (__atomic_sub_fetch(&w->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&w->idle_lock);
+                pthread_cond_broadcast(&w->idle_cond);
+                pthread_mutex_unlock(&w->idle_lock);
+        }
+}
+
+static int walkdir_open(WalkDir *node) {
+        int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+        int fd;
+        if (node->parent) {
+                fd = openat(dirfd(node->parent->dir),
+                            node->path + node->name_off, flags);
+                // Out of descriptors, resolve the whole path instead
+                if (fd < 0 && errno == EMFILE) fd = open(node->path, flags);
+                walkdir_release(node->parent);
+                node->parent = NULL;
+        } else {
+                fd = open(node->path, flags & ~O_NOFOLLOW);
+        }
+        if (fd < 0) return -1;
+
+        node->dir = fdopendir(fd);
+        if (!node->dir) {
+                close(fd);
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Resolve the type of an entry the filesystem didn't describe. Links to
+ * directories are reported as DT_LNK so they are neither followed nor moved.
+*/
+static unsigned char walk_type(int fd, const struct dirent *entry) {
+        struct stat st;
+        unsigned char type = entry->d_type;
+
+        if (type == DT_UNKNOWN) {
+                if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                        return DT_UNKNOWN;
+                if (S_ISDIR(st.st_mode)) return DT_DIR;
+                if (!S_ISLNK(st.st_mode)) return DT_REG;
+                type = DT_LNK;
+        }
+        if (type == DT_LNK) {
+                if (fstatat(fd, entry->d_name, &st, 0) != 0) return DT_UNKNOWN;
+                return S_ISDIR(st.st_mode) ? DT_LNK : DT_REG;
+        }
+        return type;
+}
+
+/*
+ * Queue the subdirectories an index recorded for a directory it found
+ * unchanged
+*/
+static void walk_recorded(Walk *w, int id, WalkDir *node, const char *names,
+                          size_t len) {
+        for (size_t off = 0; off < len; off += strlen(names + off) + 1) {
+                WalkDir *child = walkdir_new(node, node->root, names + off);
+                if (child) walk_push(w, id, child);
+        }
+}
+
+/*
+ * Append a subdirectory name to the list recorded in the index, returns -1
+ * when out of memory
+*/
+static int names_append(char **names, size_t *len, size_t *cap,
+                        const char *name) {
+        size_t n = strlen(name) + 1;
+        if (*len + n > *cap) {
+                size_t new_cap = *cap ? *cap * 2 : 256;
+                while (new_cap < *len + n) new_cap *= 2;
+                char *grown = realloc(*names, new_cap);
+                if (!grown) return -1;
+                *names = grown;
+                *cap = new_cap;
+        }
+        memcpy(*names + *len, name, n);
+        *len += n;
+        return 0;
+}
+
+static void walk_dir(Walk *w, int id, WalkDir *node) {
+        if (walkdir_open(node) != 0) {
+                log_message(ERROR, "could not read directory %s: %s\n",
+                            node->path, strerror(errno));
+                return;
+        }
+
+        int fd = dirfd(node->dir);
+        // Taken before reading, so changes made meanwhile show next time
+        struct stat st;
+        ScanIndex *index = node->root->index;
+        if (index && fstat(fd, &st) != 0) index = NULL;
+
+        char *names = NULL;
+        size_t names_len = 0;
+        size_t names_cap = 0;
+        if (index && scanindex_lookup(index, &st, &names, &names_len)) {
+                walk_recorded(w, id, node, names, names_len);
+                free(names);
+                return;
+        }
+
+        int clean = 1;
+        struct dirent *entry;
+        while ((entry = readdir(node->dir))) {
+                if (strcmp(entry->d_name, ".") == 0 ||
+                    strcmp(entry->d_name, "..") == 0)
+                        continue;
+
+                unsigned char type = walk_type(fd, entry);
+                if (type == DT_DIR) {
+                        WalkDir *child = walkdir_new(node, node->root,
+                                                     entry->d_name);
+                        if (child) walk_push(w, id, child);
+                        if (index && clean &&
+                            names_append(&names, &names_len, &names_cap,
+                                         entry->d_name) != 0)
+                                clean = 0;
+                } else if (type != DT_LNK && type != DT_UNKNOWN) {
+                        WalkEntry e = { fd, node->path, entry->d_name, type,
+                                        id };
+                        if (w->fn(&e, node->root->arg)) clean = 0;
+                } else if (type == DT_UNKNOWN) {
+                        clean = 0;
+                }
+        }
+        if (w->done) w->done(id, node->root->arg);
+        if (index)
+                scanindex_update(index, &st, names, names_len, clean);
+        free(names);
+}
+
+static WalkDir *walk_find(Walk *w, int id) {
+        WalkDir *node = deque_pop(&w->deques[id]);
+        if (node) return node;
+
+        for (int i = 1; i < w->nthreads; i++) {
+                node = deque_steal(&w->deques[(id + i) % w->nthreads]);
+                if (node) return node;
+        }
+        return NULL;
+}
+
+static void *walk_worker(void *data) {
+        Worker *worker = data;
+        Walk *w = worker->walk;
+        int id = worker->id;
+
+        for (;;) {
+                WalkDir *node = walk_find(w, id);
+                if (node) {
+                        walk_dir(w, id, node);
+                        if (node->parent) walkdir_release(node->parent);
+                        walkdir_release(node);
+                        walk_done(w);
+                        continue;
+                }
+
+                if (__atomic_load_n(&w->pending, __ATOMIC_SEQ_CST) == 0) break;
+
+                // Someone is still reading and may push more directories
+                pthread_mutex_lock(&w->idle_lock);
+                w->sleepers++;
+                if (__atomic_load_n(&w->pending, __ATOMIC_SEQ_CST) > 0) {
+                        struct timespec ts;
+                        clock_gettime(CLOCK_REALTIME, &ts);
+                        ts.tv_nsec += IDLE_WAIT_NS;
+                        if (ts.tv_nsec >= 1000000000L) {
+                                ts.tv_sec++;
+                                ts.tv_nsec -= 1000000000L;
+                        }
+                        pthread_cond_timedwait(&w->idle_cond, &w->idle_lock,
+                                               &ts);
+                }
+                w->sleepers--;
+                pthread_mutex_unlock(&w->idle_lock);
+        }
+        return NULL;
+}
+
+int walk_trees(const WalkRoot *roots, size_t nroots, int nthreads,
+               walk_fn fn, walk_done_fn done) {
+        if (nthreads < 1) nthreads = 1;
+
+        Walk w;
+        w.nthreads = nthreads;
+        w.fn = fn;
+        w.done = done;
+        w.pending = 0;
+        w.sleepers = 0;
+        w.deques = malloc(nthreads * sizeof(*w.deques));
+        Worker *workers = malloc(nthreads * sizeof(*workers));
+        pthread_t *threads = malloc(nthreads * sizeof(*threads));
+        WalkDir **starts = calloc(nroots ? nroots : 1, sizeof(*starts));
+        bool ok = w.deques && workers && threads && starts;
+        for (size_t i = 0; ok && i < nroots; i++) {
+                starts[i] = walkdir_new(NULL, &roots[i], roots[i].path);
+                if (!starts[i]) ok = false;
+        }
+        if (!ok) {
+                for (size_t i = 0; starts && i < nroots; i++) {
+                        if (starts[i]) walkdir_release(starts[i]);
+                }
+                free(starts);
+                free(w.deques);
+                free(workers);
+                free(threads);
+                return -1;
+        }
+        pthread_mutex_init(&w.idle_lock, NULL);
+        pthread_cond_init(&w.idle_cond, NULL);
+        for (int i = 0; i < nthreads; i++) {
+                deque_init(&w.deques[i]);
+                workers[i].walk = &w;
+                workers[i].id = i;
+        }
+
+        // Spread the roots so every worker starts on a tree of its own
+        for (size_t i = 0; i < nroots; i++) {
+                walk_push(&w, i % nthreads, starts[i]);
+        }
+        free(starts);
+
+        // The calling thread is worker 0
+        int started = 1;
+        for (int i = 1; i < nthreads; i++) {
+                if (pthread_create(&threads[i], NULL, walk_worker,
+                                   &workers[i]) != 0)
+                        break;
+                started++;
+        }
+        walk_worker(&workers[0]);
+        for (int i = 1; i < started; i++) {
+                pthread_join(threads[i], NULL);
+        }
+
+        for (int i = 0; i < nthreads; i++) {
+                deque_free(&w.deques[i]);
+        }
+        pthread_cond_destroy(&w.idle_cond);
+        pthread_mutex_destroy(&w.idle_lock);
+        free(w.deques);
+        free(workers);
+        free(threads);
+        return 0;
+}
+
+int walk_tree(const char *root, int nthreads, walk_fn fn, walk_done_fn done,
+              ScanIndex *index, void *arg) {
+        WalkRoot r = { root, index, arg };
+        return walk_trees(&r, 1, nthreads, fn, done);
+}
@@ -0,0 +1,451 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "watch.h"
+
+#define EVENT_BUFFER 65536
+#define PENDING_INITIAL 256
+#define RESCAN_PER_ROUND 16 // Directories read again per round after overflow
+#define MAX_DELAY 4 // A burst delays reports by at most this many debounces
+#define WATCH_MASK                                                         \
+        (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |        \
+         IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+/*
+ * A file waiting to settle, name is NULL in empty slots
+*/
+typedef struct {
+        int wd;
+        uint64_t due; // Not reported before, in CLOCK_MONOTONIC ns
+        uint64_t since; // First queued, in CLOCK_MONOTONIC ns
+        char *name;
+} Pending;
+
+typedef struct {
+        int fd;
+        char **paths; // Indexed by watch descriptor, NULL when unused
+        int paths_cap;
+        int have_skip;
+        dev_t skip_dev;
+        ino_t skip_ino;
+        int warned;
+        Pending *pending;
+        size_t pending_mask;
+        size_t pending_count;
+        int *rescan; // Directories to read again after an overflow
+        size_t rescan_count;
+        uint64_t debounce;
+        uint64_t first_event; // Of the current burst, 0 when none
+        uint64_t last_event;
+        walk_fn fn;
+        watch_batch_fn batch;
+        void *arg;
+} Watch;
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig) {
+        (void)sig;
+        stop = 1;
+}
+
+static uint64_t now_ns(clockid_t clock) {
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t hash_pending(int wd, const char *name) {
+        uint64_t h = 14695981039346656037ULL ^ (unsigned)wd;
+        for (; *name; name++) {
+                h ^= (unsigned char)*name;
+                h *= 1099511628211ULL;
+        }
+        return h;
+}
+
+static Pending *pending_probe(Pending *slots, size_t mask, int wd,
+                              const char *name) {
+        size_t i = hash_pending(wd, name) & mask;
+        while (slots[i].name &&
+               (slots[i].wd != wd || strcmp(slots[i].name, name) != 0)) {
+                i = (i + 1) & mask;
+        }
+        return &slots[i];
+}
+
+static int pending_grow(Watch *w) {
+        size_t size = (w->pending_mask + 1) * 2;
+        Pending *slots = calloc(size, sizeof(*slots));
+        if (!slots) return -1;
+        for (size_t i = 0; i <= w->pending_mask; i++) {
+                Pending *p = &w->pending[i];
+                if (p->name) *pending_probe(slots, size - 1, p->wd, p->name) = *p;
+        }
+        free(w->pending);
+        w->pending = slots;
+        w->pending_mask = size - 1;
+        return 0;
+}
+
+/*
+ * Remember that name in wd changed, postponing it to due. since is when it
+ * was first queued.
+*/
+static void pending_add(Watch *w, int wd, const char *name, uint64_t due,
+                        uint64_t since) {
+        Pending *p = pending_probe(w->pending, w->pending_mask, wd, name);
+        if (p->name) {
+                if (due > p->due) p->due = due;
+                if (since < p->since) p->since = since;
+                return;
+        }
+        p->name = strdup(name);
+        if (!p->name) return;
+        p->wd = wd;
+        p->due = due;
+        p->since = since;
+        w->pending_count++;
+        if (w->pending_count * 2 > w->pending_mask) pending_grow(w);
+}
+
+static void watch_scan(Watch *w, int wd);
+
+/*
+ * Watch the directory at path, and read it if it wasn't watched already
+*/
+static void watch_add(Watch *w, const char *path) {
+        struct stat st;
+        if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return;
+        if (w->have_skip && st.st_dev == w->skip_dev &&
+            st.st_ino == w->skip_ino)
+                return;
+
+        int wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+        if (wd < 0) {
+                if (errno == ENOSPC && !w->warned) {
+                        fprintf(stderr, "Watch: out of inotify watches, raise fs.inotify.max_user_watches\n");
+                        w->warned = 1;
+                }
+                return;
+        }
+        if (wd >= w->paths_cap) {
+                int cap = w->paths_cap ? w->paths_cap : 64;
+                while (cap <= wd) cap *= 2;
+                char **paths = realloc(w->paths, cap * sizeof(*paths));
+                if (!paths) {
+                        inotify_rm_watch(w->fd, wd);
+                        return;
+                }
+                memset(paths + w->paths_cap, 0,
+                       (cap - w->paths_cap) * sizeof(*paths));
+                w->paths = paths;
+                w->paths_cap = cap;
+        }
+        // Same directory reached again, e.g while rescanning
+        if (w->paths[wd]) return;
+
+        w->paths[wd] = strdup(path);
+        if (!w->paths[wd]) {
+                inotify_rm_watch(w->fd, wd);
+                return;
+        }
+        watch_scan(w, wd);
+}
+
+/*
+ * Stop watching path and everything below it
+*/
+static void watch_remove(Watch *w, const char *path) {
+        size_t len = strlen(path);
+        for (int wd = 0; wd < w->paths_cap; wd++) {
+                const char *p = w->paths[wd];
+                if (!p || strncmp(p, path, len) != 0 ||
+                    (p[len] != '\0' && p[len] != '/'))
+                        continue;
+                inotify_rm_watch(w->fd, wd);
+                free(w->paths[wd]);
+                w->paths[wd] = NULL;
+        }
+}
+
+/*
+ * Queue every file of a watched directory, and watch new subdirectories
+*/
+static void watch_scan(Watch *w, int wd) {
+        const char *path = w->paths[wd];
+        DIR *d = opendir(path);
+        if (!d) return;
+
+        uint64_t now = now_ns(CLOCK_MONOTONIC);
+        char child[PATH_MAX];
+        struct dirent *entry;
+        while ((entry = readdir(d))) {
+                if (strcmp(entry->d_name, ".") == 0 ||
+                    strcmp(entry->d_name, "..") == 0)
+                        continue;
+
+                unsigned char type = entry->d_type;
+                if (type == DT_UNKNOWN) {
+                        struct stat st;
+                        if (fstatat(dirfd(d), entry->d_name, &st,
+                                    AT_SYMLINK_NOFOLLOW) != 0)
+                                continue;
+                        type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+                }
+                if (type != DT_DIR) {
+                        pending_add(w, wd, entry->d_name, now, now);
+                        continue;
+                }
+                if ((size_t)snprintf(child, sizeof(child), "%s/%s", path,
+                                     entry->d_name) < sizeof(child))
+                        watch_add(w, child);
+        }
+        closedir(d);
+        if (w->pending_count && !w->first_event) w->first_event = now;
+}
+
+static void handle_event(Watch *w, const struct inotify_event *ev) {
+        if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost, read every directory again
+                int *rescan = realloc(w->rescan,
+                                      w->paths_cap * sizeof(*rescan));
+                if (!rescan) return;
+                w->rescan = rescan;
+                w->rescan_count = 0;
+                for (int wd = 0; wd < w->paths_cap; wd++) {
+                        if (w->paths[wd]) w->rescan[w->rescan_count++] = wd;
+                }
+                return;
+        }
+        if (ev->wd < 0 || ev->wd >= w->paths_cap || !w->paths[ev->wd])
+                return;
+        if (ev->mask & IN_IGNORED) {
+                free(w->paths[ev->wd]);
+                w->paths[ev->wd] = NULL;
+                return;
+        }
+        if (ev->len == 0) return;
+
+        if (ev->mask & IN_ISDIR) {
+                char child[PATH_MAX];
+                if ((size_t)snprintf(child, sizeof(child), "%s/%s",
+                                     w->paths[ev->wd],
+                                     ev->name) >= sizeof(child))
+                        return;
+                // Moved directories are picked up again where they land
+                if (ev->mask & IN_MOVED_FROM) {
+                        watch_remove(w, child);
+                } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        watch_add(w, child);
+                }
+                return;
+        }
+
+        if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                uint64_t now = now_ns(CLOCK_MONOTONIC);
+                pending_add(w, ev->wd, ev->name, now + w->debounce, now);
+                w->last_event = now;
+                if (!w->first_event) w->first_event = now;
+        }
+}
+
+static int compare_wd(const void *a, const void *b) {
+        const Pending *x = a;
+        const Pending *y = b;
+        return (x->wd > y->wd) - (x->wd < y->wd);
+}
+
+/*
+ * Report every file that settled, as one batch
+*/
+static void flush(Watch *w) {
+        uint64_t now = now_ns(CLOCK_MONOTONIC);
+        uint64_t wall = now_ns(CLOCK_REALTIME);
+        Pending *ready = malloc((w->pending_count + 1) * sizeof(*ready));
+        if (!ready) return;
+
+        size_t n = 0;
+        for (size_t i = 0; i <= w->pending_mask; i++) {
+                Pending *p = &w->pending[i];
+                if (p->name && p->due <= now) ready[n++] = *p;
+        }
+        // Take them out, keeping the rest
+        Pending *slots = calloc(w->pending_mask + 1, sizeof(*slots));
+        if (!slots) {
+                free(ready);
+                return;
+        }
+        for (size_t i = 0; i <= w->pending_mask; i++) {
+                Pending *p = &w->pending[i];
+                if (p->name && p->due > now)
+                        *pending_probe(slots, w->pending_mask, p->wd,
+                                       p->name) = *p;
+        }
+        free(w->pending);
+        w->pending = slots;
+        w->pending_count -= n;
+
+        qsort(ready, n, sizeof(*ready), compare_wd);
+        size_t reported = 0;
+        int fd = -1;
+        for (size_t i = 0; i < n; i++) {
+                Pending *p = &ready[i];
+                const char *dir = p->wd < w->paths_cap ? w->paths[p->wd] :
+                                                         NULL;
+                if (i == 0 || p->wd != ready[i - 1].wd) {
+                        if (fd >= 0) close(fd);
+                        fd = dir ? open(dir, O_RDONLY | O_DIRECTORY |
+                                                     O_CLOEXEC) :
+                                   -1;
+                }
+
+                struct stat st;
+                if (fd < 0 ||
+                    fstatat(fd, p->name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                    S_ISDIR(st.st_mode) ||
+                    (S_ISLNK(st.st_mode) &&
+                     (fstatat(fd, p->name, &st, 0) != 0 ||
+                      S_ISDIR(st.st_mode)))) {
+                        free(p->name);
+                        continue;
+                }
+                // Still being written by something that doesn't close it. A
+                // time ahead of the clock tells nothing, so such a file
+                // waits no longer than a burst can.
+                uint64_t mtime = st.st_mtim.tv_sec * 1000000000ULL +
+                                 st.st_mtim.tv_nsec;
+                if (mtime + w->debounce > wall &&
+                    (mtime <= wall ||
+                     now - p->since < MAX_DELAY * w->debounce)) {
+                        pending_add(w, p->wd, p->name, now + w->debounce,
+                                    p->since);
+                        w->last_event = now;
+                        free(p->name);
+                        continue;
+                }
+
+                WalkEntry e = { fd, dir, p->name, DT_REG, 0 };
+                w->fn(&e, w->arg);
+                free(p->name);
+                reported++;
+        }
+        if (fd >= 0) close(fd);
+        free(ready);
+
+        if (reported && w->batch) w->batch(w->arg);
+        w->first_event = w->pending_count ? now : 0;
+}
+
+/*
+ * Milliseconds until the pending files may be reported, -1 when idle
+*/
+static int next_timeout(const Watch *w) {
+        if (w->rescan_count) return 0;
+        if (!w->pending_count) return -1;
+
+        uint64_t now = now_ns(CLOCK_MONOTONIC);
+        uint64_t at = w->last_event + w->debounce;
+        uint64_t latest = w->first_event + MAX_DELAY * w->debounce;
+        if (latest < at) at = latest;
+        if (at <= now) return 0;
+        return (at - now) / 1000000 + 1;
+}
+
+static void watch_free(Watch *w) {
+        for (int wd = 0; wd < w->paths_cap; wd++) {
+                free(w->paths[wd]);
+        }
+        for (size_t i = 0; w->pending && i <= w->pending_mask; i++) {
+                free(w->pending[i].name);
+        }
+        free(w->paths);
+        free(w->pending);
+        free(w->rescan);
+        if (w->fd >= 0) close(w->fd);
+}
+
+int watch_tree(const char *root, const char *skip, unsigned debounce_ms,
+               walk_fn fn, watch_batch_fn batch, void *arg) {
+        Watch w;
+        memset(&w, 0, sizeof(w));
+        w.debounce = debounce_ms * 1000000ULL;
+        w.fn = fn;
+        w.batch = batch;
+        w.arg = arg;
+        w.pending_mask = PENDING_INITIAL - 1;
+        w.pending = calloc(PENDING_INITIAL, sizeof(*w.pending));
+        w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        char *buf = malloc(EVENT_BUFFER);
+        if (w.fd < 0 || !w.pending || !buf) {
+                free(buf);
+                watch_free(&w);
+                return -1;
+        }
+        struct stat st;
+        if (skip && stat(skip, &st) == 0) {
+                w.have_skip = 1;
+                w.skip_dev = st.st_dev;
+                w.skip_ino = st.st_ino;
+        }
+
+        // Signals are only let in while waiting, so none is missed
+        sigset_t block, orig;
+        sigemptyset(&block);
+        sigaddset(&block, SIGINT);
+        sigaddset(&block, SIGTERM);
+        sigprocmask(SIG_BLOCK, &block, &orig);
+        struct sigaction sa, old_int, old_term;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_signal;
+        sigaction(SIGINT, &sa, &old_int);
+        sigaction(SIGTERM, &sa, &old_term);
+        stop = 0;
+
+        watch_add(&w, root);
+        int err = w.paths_cap == 0 ? -1 : 0;
+        while (!err && !stop) {
+                // Read a few directories per round after an overflow, so
+                // new events keep being drained
+                for (int i = 0; i < RESCAN_PER_ROUND && w.rescan_count; i++) {
+                        int wd = w.rescan[--w.rescan_count];
+                        if (wd < w.paths_cap && w.paths[wd]) watch_scan(&w, wd);
+                }
+
+                struct pollfd pfd = { w.fd, POLLIN, 0 };
+                int timeout = next_timeout(&w);
+                struct timespec ts = { timeout / 1000,
+                                       (timeout % 1000) * 1000000L };
+                int ret = ppoll(&pfd, 1, timeout < 0 ? NULL : &ts, &orig);
+                if (ret < 0 && errno != EINTR) err = -1;
+
+                ssize_t len;
+                while (ret > 0 && (len = read(w.fd, buf, EVENT_BUFFER)) > 0) {
+                        for (char *p = buf; p < buf + len;) {
+                                struct inotify_event *ev = (void *)p;
+                                handle_event(&w, ev);
+                                p += sizeof(*ev) + ev->len;
+                        }
+                }
+
+                if (next_timeout(&w) == 0 && w.pending_count) flush(&w);
+        }
+
+        sigaction(SIGINT, &old_int, NULL);
+        sigaction(SIGTERM, &old_term, NULL);
+        sigprocmask(SIG_SETMASK, &orig, NULL);
+        free(buf);
+        watch_free(&w);
+        return err;
+}